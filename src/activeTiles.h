@@ -0,0 +1,55 @@
+#pragma once
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+
+// One flag per TILE x TILE block of a grid, e.g. whether the block holds any density. dilate()
+// grows the set so that it also covers the blocks within reach of a flagged one.
+class ActiveTiles
+{
+public:
+    ActiveTiles(const int32_t width, const int32_t height, const int32_t tile) :
+        mTile{tile}, mTilesX{(width + tile - 1) / tile}, mTilesY{(height + tile - 1) / tile},
+        mFlags(static_cast<size_t>(mTilesX) * mTilesY), mScratch(mFlags.size()) {}
+
+    int32_t tile() const { return mTile; }
+    int32_t tilesX() const { return mTilesX; }
+    int32_t tilesY() const { return mTilesY; }
+
+    bool active(const int32_t tx, const int32_t ty) const { return mFlags[tx + mTilesX * ty]; }
+    void set(const int32_t tx, const int32_t ty, const bool active) { mFlags[tx + mTilesX * ty] = active; }
+
+    // flags every tile within radius tiles (Chebyshev distance) of a flagged one
+    void dilate(const int32_t radius)
+    {
+        if (radius <= 0) return;
+        for (int32_t ty = 0; ty < mTilesY; ++ty) {
+            for (int32_t tx = 0; tx < mTilesX; ++tx) {
+                uint8_t any{};
+                for (int32_t x = std::max(0, tx - radius); x <= std::min(mTilesX - 1, tx + radius); ++x) any |= active(x, ty);
+                mScratch[tx + mTilesX * ty] = any;
+            }
+        }
+        for (int32_t ty = 0; ty < mTilesY; ++ty) {
+            for (int32_t tx = 0; tx < mTilesX; ++tx) {
+                uint8_t any{};
+                for (int32_t y = std::max(0, ty - radius); y <= std::min(mTilesY - 1, ty + radius); ++y) any |= mScratch[tx + mTilesX * y];
+                set(tx, ty, any);
+            }
+        }
+    }
+
+    // fraction of the tiles that are flagged
+    double occupancy() const
+    {
+        return static_cast<double>(std::count(mFlags.begin(), mFlags.end(), 1)) / mFlags.size();
+    }
+
+private:
+    int32_t mTile;
+    int32_t mTilesX;
+    int32_t mTilesY;
+    std::vector<uint8_t> mFlags;
+    std::vector<uint8_t> mScratch;
+};
@@ -0,0 +1,201 @@
+#pragma once
+#include <algorithm>
+#include <stdint.h>
+#include "fieldLayout.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SF_HAVE_AVX2 1
+#endif
+
+
+// The five channels moved by the fused advection: density r, g, b, then velocity u, v.
+// Channel c of cell idx is at src[c][idx * srcStride[c]], so AoS, SoA and packed fields fit; the
+// channels are stored in Format and the kernels compute in float.
+// The velocity used for the back-trace is taken from the U and V source channels.
+template<typename Format = Fp32>
+struct AdvectChannels
+{
+    using Storage = typename Format::Storage;
+    static constexpr int COUNT{5};
+    static constexpr int U{3};
+    static constexpr int V{4};
+
+    const Storage* src[COUNT];
+    Storage* tgt[COUNT];
+    int32_t srcStride[COUNT];
+    int32_t tgtStride[COUNT];
+};
+
+// Where Simulator2D's advection finds cell (i, j) a step earlier. Velocities are in domain widths per
+// time unit, scale converts them to cells.
+inline XYPair backTrace(const int i, const int j, const XYPair velocity, const float scale, const float dt)
+{
+    return XYPair(i, j) - velocity * scale * dt;
+}
+
+// Moves a back-traced point to the cell centres whose 4 interpolated cells are on a width x height grid
+inline void clampToGrid(XYPair& point, const int width, const int height)
+{
+    point.x = std::min(width - 1.5f, std::max(0.5f, point.x));
+    point.y = std::min(height - 1.5f, std::max(0.5f, point.y));
+}
+
+// Bilinear interpolation of q between the 4 cells around a clamped point; index maps (i, j) to the
+// position in q
+template<typename CellType>
+inline CellType interpolateCell(const XYPair& point, const auto& q, const auto& index)
+{
+    const int intX = static_cast<int>(point.x);
+    const int intY = static_cast<int>(point.y);
+    const float decX = point.x - intX;
+    const float decY = point.y - intY;
+
+    return q[index(intX, intY)] * (1.0f - decX) * (1.0f - decY) +
+           q[index(intX, intY+1)] * (1.0f - decX) * decY +
+           q[index(intX+1, intY)] * decX * (1.0f - decY) +
+           q[index(intX+1, intY+1)] * decX * decY;
+}
+
+// Back-traces cells [iBegin, iEnd) of row j once and interpolates all channels from the same 4 cells.
+// The arithmetic follows Simulator2D::interpolate operation for operation, so results are bit-identical.
+// Velocities are in domain widths per time unit, scale converts them to cells. index maps (i, j) to
+// the position in the fields. Only channels FIRST and up are written, FIRST = U advects velocity alone.
+template<int FIRST = 0, typename Format, typename Index>
+inline void advectFusedRowScalar(const AdvectChannels<Format>& ch, const Index& index, const int width, const int height,
+                                 const float scale, const float dt, const int j, const int iBegin, const int iEnd)
+{
+    using Channels = AdvectChannels<Format>;
+    const float lo = 0.5f;
+    const float hiX = width - 1.5f;
+    const float hiY = height - 1.5f;
+    for (int i = iBegin; i < iEnd; ++i) {
+        const int idx = index(i, j);
+        float px = static_cast<float>(i) - Format::unpack(ch.src[Channels::U][idx * ch.srcStride[Channels::U]]) * scale * dt;
+        float py = static_cast<float>(j) - Format::unpack(ch.src[Channels::V][idx * ch.srcStride[Channels::V]]) * scale * dt;
+        px = std::min(hiX, std::max(lo, px));
+        py = std::min(hiY, std::max(lo, py));
+
+        const int x = static_cast<int>(px);
+        const int y = static_cast<int>(py);
+        const float dx = px - x;
+        const float dy = py - y;
+        const int i00 = index(x, y);
+        const int i01 = index(x, y + 1);
+        const int i10 = index(x + 1, y);
+        const int i11 = index(x + 1, y + 1);
+
+        for (int c = FIRST; c < Channels::COUNT; ++c) {
+            const auto* q = ch.src[c];
+            const int32_t s = ch.srcStride[c];
+            ch.tgt[c][idx * ch.tgtStride[c]] = Format::pack(Format::unpack(q[i00 * s]) * (1.0f - dx) * (1.0f - dy) +
+                                                            Format::unpack(q[i01 * s]) * (1.0f - dx) * dy +
+                                                            Format::unpack(q[i10 * s]) * dx * (1.0f - dy) +
+                                                            Format::unpack(q[i11 * s]) * dx * dy);
+        }
+    }
+}
+
+#ifdef SF_HAVE_AVX2
+inline bool cpuHasAvx2()
+{
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    return hasAvx2;
+}
+
+// Field positions of 8 cells, the vector counterparts of LinearIndex and TiledIndex
+__attribute__((target("avx2,f16c")))
+inline __m256i cellIndex(const LinearIndex& index, const __m256i i, const __m256i j)
+{
+    return _mm256_add_epi32(i, _mm256_mullo_epi32(j, _mm256_set1_epi32(index.width())));
+}
+
+template<int32_t TILE>
+__attribute__((target("avx2,f16c")))
+inline __m256i cellIndex(const TiledIndex<TILE>& index, const __m256i i, const __m256i j)
+{
+    constexpr int SHIFT = TiledIndex<TILE>::SHIFT;
+    const __m256i mask = _mm256_set1_epi32(TiledIndex<TILE>::MASK);
+    const __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(j, SHIFT), _mm256_set1_epi32(index.tilesX())),
+                                          _mm256_srli_epi32(i, SHIFT));
+    const __m256i row = _mm256_or_si256(_mm256_slli_epi32(tile, SHIFT), _mm256_and_si256(j, mask));
+    return _mm256_or_si256(_mm256_slli_epi32(row, SHIFT), _mm256_and_si256(i, mask));
+}
+
+// Same as advectFusedRowScalar, 8 cells at a time with gathers. FMA is deliberately not enabled
+// so every multiply and add rounds exactly like the scalar code. F16C is only used by the 16 bit
+// formats, for which callers check Format::hasSimd() rather than cpuHasAvx2().
+template<int FIRST = 0, typename Format, typename Index>
+__attribute__((target("avx2,f16c")))
+inline void advectFusedRowAvx2(const AdvectChannels<Format>& ch, const Index& index, const int width, const int height,
+                               const float scale, const float dt, const int j, const int iBegin, const int iEnd)
+{
+    using Channels = AdvectChannels<Format>;
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 vdt = _mm256_set1_ps(dt);
+    const __m256 lo = _mm256_set1_ps(0.5f);
+    const __m256 hiX = _mm256_set1_ps(width - 1.5f);
+    const __m256 hiY = _mm256_set1_ps(height - 1.5f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 fj = _mm256_set1_ps(static_cast<float>(j));
+    const __m256i vj = _mm256_set1_epi32(j);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i ione = _mm256_set1_epi32(1);
+    // unit stride channels of row-major fields are read and written with plain loads and stores
+    auto contiguous = [](const int32_t stride) { return Index::ROW_CONTIGUOUS && stride == 1; };
+
+    int i = iBegin;
+    for (; i + 8 <= iEnd; i += 8) {
+        const int idx = index(i, j);
+        const __m256i vi = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+        const __m256i vidx = cellIndex(index, vi, vj);
+        const __m256 fi = _mm256_cvtepi32_ps(vi);
+
+        const __m256 u = contiguous(ch.srcStride[Channels::U]) ? Format::load8(ch.src[Channels::U] + idx) :
+                         Format::gather8(ch.src[Channels::U], ch.srcStride[Channels::U], vidx);
+        const __m256 v = contiguous(ch.srcStride[Channels::V]) ? Format::load8(ch.src[Channels::V] + idx) :
+                         Format::gather8(ch.src[Channels::V], ch.srcStride[Channels::V], vidx);
+        __m256 px = _mm256_sub_ps(fi, _mm256_mul_ps(_mm256_mul_ps(u, vscale), vdt));
+        __m256 py = _mm256_sub_ps(fj, _mm256_mul_ps(_mm256_mul_ps(v, vscale), vdt));
+        px = _mm256_min_ps(_mm256_max_ps(px, lo), hiX);
+        py = _mm256_min_ps(_mm256_max_ps(py, lo), hiY);
+
+        const __m256i x = _mm256_cvttps_epi32(px);
+        const __m256i y = _mm256_cvttps_epi32(py);
+        const __m256 dx = _mm256_sub_ps(px, _mm256_cvtepi32_ps(x));
+        const __m256 dy = _mm256_sub_ps(py, _mm256_cvtepi32_ps(y));
+        const __m256 omdx = _mm256_sub_ps(one, dx);
+        const __m256 omdy = _mm256_sub_ps(one, dy);
+        const __m256i x1 = _mm256_add_epi32(x, ione);
+        const __m256i y1 = _mm256_add_epi32(y, ione);
+        const __m256i i00 = cellIndex(index, x, y);
+        const __m256i i01 = cellIndex(index, x, y1);
+        const __m256i i10 = cellIndex(index, x1, y);
+        const __m256i i11 = cellIndex(index, x1, y1);
+
+        for (int c = FIRST; c < Channels::COUNT; ++c) {
+            const auto* q = ch.src[c];
+            const int32_t s = ch.srcStride[c];
+            __m256 val = _mm256_mul_ps(_mm256_mul_ps(Format::gather8(q, s, i00), omdx), omdy);
+            val = _mm256_add_ps(val, _mm256_mul_ps(_mm256_mul_ps(Format::gather8(q, s, i01), omdx), dy));
+            val = _mm256_add_ps(val, _mm256_mul_ps(_mm256_mul_ps(Format::gather8(q, s, i10), dx), omdy));
+            val = _mm256_add_ps(val, _mm256_mul_ps(_mm256_mul_ps(Format::gather8(q, s, i11), dx), dy));
+
+            if (contiguous(ch.tgtStride[c])) {
+                Format::store8(ch.tgt[c] + idx, val);
+            } else {
+                alignas(32) typename Channels::Storage out[8];
+                alignas(32) int32_t outIdx[8];
+                Format::store8(out, val);
+                _mm256_store_si256(reinterpret_cast<__m256i*>(outIdx), vidx);
+                for (int k = 0; k < 8; ++k) {
+                    ch.tgt[c][outIdx[k] * ch.tgtStride[c]] = out[k];
+                }
+            }
+        }
+    }
+
+    advectFusedRowScalar<FIRST>(ch, index, width, height, scale, dt, j, i, iEnd);
+}
+#else
+inline bool cpuHasAvx2() { return false; }
+#endif
@@ -0,0 +1,341 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fieldLayout.h"
+
+
+struct CheckpointOptions
+{
+    std::string path{};        // written every `every` steps and at the end, empty disables checkpoints
+    uint64_t every{1000};
+    std::string restartPath{}; // checkpoint to resume from
+
+    // Consumes a checkpoint option at argv[i], returns false if argv[i] is not one
+    bool parseArg(const int argc, char* argv[], int& i)
+    {
+        if (!strcmp(argv[i], "--checkpoint") && i+1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "--checkpoint-every") && i+1 < argc) {
+            every = std::max(1ll, atoll(argv[++i]));
+        } else if (!strcmp(argv[i], "--restart") && i+1 < argc) {
+            restartPath = argv[++i];
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static constexpr const char* USAGE{" [--checkpoint FILE] [--checkpoint-every N] [--restart FILE]"};
+};
+
+// Everything a restart needs besides the fields
+struct CheckpointState
+{
+    int32_t sceneId{};
+    uint64_t step{};   // steps run so far
+    float time{};      // simulated time after them
+    float dt{};        // Simulator2D::timeStep() of the next step
+    uint64_t rngState{}; // SceneBase::rngState()
+    uint64_t rngSeed{};  // SceneBase::rngSeed()
+};
+
+// First page of a checkpoint file. The fields follow as the grid's raw storage, each at a page
+// aligned offset, so a restart maps the file and copies the planes without parsing them.
+// Native endianness; a file only restarts a grid of the same size and layout.
+struct CheckpointHeader
+{
+    static constexpr char MAGIC[8]{'S', 'F', 'C', 'K', 'P', 'T', 0, 0};
+    static constexpr uint32_t VERSION{3};
+    static constexpr int FIELDS{5}; // velocity, velocityBack, force, density, densityBack
+    static constexpr uint64_t PAGE{4096};
+
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    int32_t width, height;
+    uint32_t soa, rowBlock; // the layout the planes are stored in
+    uint32_t format;        // and the ID of their storage format, see storageFormat.h
+    int32_t storageCells;
+    int32_t sceneId;
+    uint64_t step;
+    float time, dt;
+    uint64_t rngState, rngSeed;
+    uint64_t offset[FIELDS];
+    uint64_t bytes[FIELDS];
+    uint64_t checksum; // of the planes
+};
+static_assert(std::is_trivially_copyable_v<CheckpointHeader> && sizeof(CheckpointHeader) <= CheckpointHeader::PAGE);
+
+// The back buffers are saved too: the density diffusion starts from the stale back buffer, so a
+// restart is only bit-identical with them.
+template<typename GridCellsType>
+auto checkpointFields(GridCellsType& gc)
+{
+    return std::array{gc.velocity.bytes(), gc.velocityBack.bytes(), gc.force.bytes(), gc.density.bytes(), gc.densityBack.bytes()};
+}
+
+// 64 bit multiply-xor hash, one word per step so that it runs near memory speed
+inline uint64_t checkpointHash(const std::byte* p, const uint64_t n, uint64_t hash)
+{
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        hash = (hash ^ w) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < n; ++i) {
+        hash = (hash ^ static_cast<uint8_t>(p[i])) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+// A checkpoint file assembled in memory: capture() is a memcpy of the fields, the checksum and
+// the disk write are left to seal() and write(), which may run on another thread.
+class CheckpointImage
+{
+public:
+    template<typename GridCellsType>
+    void capture(const GridCellsType& gc, const CheckpointState& state)
+    {
+        const auto fields = checkpointFields(gc);
+
+        CheckpointHeader header{};
+        memcpy(header.magic, CheckpointHeader::MAGIC, sizeof(header.magic));
+        header.version = CheckpointHeader::VERSION;
+        header.headerBytes = sizeof(CheckpointHeader);
+        header.width = gc.width();
+        header.height = gc.height();
+        header.soa = GridCellsType::LayoutType::SOA;
+        header.rowBlock = GridCellsType::IndexType::ROW_BLOCK;
+        header.format = GridCellsType::LayoutType::Format::ID;
+        header.storageCells = gc.storageCells();
+        header.sceneId = state.sceneId;
+        header.step = state.step;
+        header.time = state.time;
+        header.dt = state.dt;
+        header.rngState = state.rngState;
+        header.rngSeed = state.rngSeed;
+
+        uint64_t end = CheckpointHeader::PAGE;
+        for (int f = 0; f < CheckpointHeader::FIELDS; ++f) {
+            header.offset[f] = end;
+            header.bytes[f] = fields[f].size();
+            end = (end + fields[f].size() + CheckpointHeader::PAGE - 1) / CheckpointHeader::PAGE * CheckpointHeader::PAGE;
+        }
+
+        if (mData.size() != end) mData = AlignedBuffer<std::byte>(end);
+        memcpy(mData.data(), &header, sizeof(header));
+        for (int f = 0; f < CheckpointHeader::FIELDS; ++f) {
+            memcpy(mData.data() + header.offset[f], fields[f].data(), fields[f].size());
+        }
+    }
+
+    void seal()
+    {
+        CheckpointHeader& header = *reinterpret_cast<CheckpointHeader*>(mData.data());
+        header.checksum = planeChecksum(header, mData.data());
+    }
+
+    // Written next to the target and renamed over it, so a crash leaves the previous checkpoint intact
+    void write(const std::string& path) const
+    {
+        const std::string tmp = path + ".tmp";
+        FILE* pFile = fopen(tmp.c_str(), "wb");
+        if (!pFile) {
+            throw std::runtime_error("cannot create checkpoint " + tmp);
+        }
+        const bool ok = fwrite(mData.data(), 1, mData.size(), pFile) == mData.size() && !fflush(pFile) && !fsync(fileno(pFile));
+        if (fclose(pFile) || !ok || rename(tmp.c_str(), path.c_str())) {
+            unlink(tmp.c_str());
+            throw std::runtime_error("writing checkpoint " + path + " failed");
+        }
+    }
+
+    static uint64_t planeChecksum(const CheckpointHeader& header, const std::byte* base)
+    {
+        uint64_t hash{14695981039346656037ull};
+        for (int f = 0; f < CheckpointHeader::FIELDS; ++f) {
+            hash = checkpointHash(base + header.offset[f], header.bytes[f], hash);
+        }
+        return hash;
+    }
+
+private:
+    AlignedBuffer<std::byte> mData;
+};
+
+// Only reads the state, e.g. to pick the scene before the fields are loaded
+inline CheckpointState peekCheckpoint(const std::string& path)
+{
+    CheckpointHeader header{};
+    FILE* pFile = fopen(path.c_str(), "rb");
+    const bool ok = pFile && fread(&header, sizeof(header), 1, pFile) == 1;
+    if (pFile) fclose(pFile);
+    if (!ok || memcmp(header.magic, CheckpointHeader::MAGIC, sizeof(header.magic)) || header.version != CheckpointHeader::VERSION) {
+        throw std::runtime_error(path + " is not a checkpoint");
+    }
+    return CheckpointState{header.sceneId, header.step, header.time, header.dt, header.rngState, header.rngSeed};
+}
+
+// Restores the fields of gc from a checkpoint file and returns the rest of the state
+template<typename GridCellsType>
+CheckpointState loadCheckpoint(const std::string& path, GridCellsType& gc)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("cannot open checkpoint " + path);
+    }
+    const uint64_t size = st.st_size;
+    void* p = size >= sizeof(CheckpointHeader) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error(path + " is not a checkpoint");
+    }
+    struct Unmap { void* p; uint64_t size; ~Unmap() { munmap(p, size); } } unmap{p, size};
+    madvise(p, size, MADV_SEQUENTIAL);
+
+    const std::byte* base = static_cast<const std::byte*>(p);
+    CheckpointHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, CheckpointHeader::MAGIC, sizeof(header.magic)) || header.version != CheckpointHeader::VERSION ||
+        header.headerBytes != sizeof(CheckpointHeader)) {
+        throw std::runtime_error(path + " is not a version " + std::to_string(CheckpointHeader::VERSION) + " checkpoint");
+    }
+    if (header.width != gc.width() || header.height != gc.height() || header.storageCells != gc.storageCells() ||
+        header.soa != GridCellsType::LayoutType::SOA || header.rowBlock != GridCellsType::IndexType::ROW_BLOCK ||
+        header.format != GridCellsType::LayoutType::Format::ID) {
+        throw std::runtime_error("checkpoint " + path + " holds a " + std::to_string(header.width) + "x" +
+                                 std::to_string(header.height) + " grid in a different size or layout");
+    }
+
+    const auto fields = checkpointFields(gc);
+    for (int f = 0; f < CheckpointHeader::FIELDS; ++f) {
+        if (header.bytes[f] != fields[f].size() || header.offset[f] > size || header.bytes[f] > size - header.offset[f]) {
+            throw std::runtime_error("checkpoint " + path + " is truncated");
+        }
+    }
+    if (CheckpointImage::planeChecksum(header, base) != header.checksum) {
+        throw std::runtime_error("checkpoint " + path + " is corrupt");
+    }
+
+    for (int f = 0; f < CheckpointHeader::FIELDS; ++f) {
+        memcpy(fields[f].data(), base + header.offset[f], header.bytes[f]);
+    }
+    return CheckpointState{header.sceneId, header.step, header.time, header.dt, header.rngState, header.rngSeed};
+}
+
+
+// Periodic checkpoints written by a background thread. offer() copies the fields into the staging
+// image when the writer is idle, so the step loop only pauses for that memcpy; while the previous
+// checkpoint is still being written the offer is declined and the next step tries again.
+class Checkpointer
+{
+    enum State : int { Idle, Full, Stop };
+public:
+    Checkpointer(std::string path, const uint64_t everySteps) :
+        mPath{std::move(path)}, mEvery{std::max<uint64_t>(1, everySteps)}
+    {
+        mWriter = std::thread([this] { writerLoop(); });
+    }
+
+    ~Checkpointer()
+    {
+        waitIdle();
+        mState.store(Stop, std::memory_order_release);
+        mState.notify_one();
+        mWriter.join();
+    }
+
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+
+    // true if a checkpoint of this step was handed to the writer
+    template<typename GridCellsType>
+    bool offer(const GridCellsType& gc, const CheckpointState& state)
+    {
+        if (!mNextStep) mNextStep = (state.step / mEvery + 1) * mEvery; // the first period ends after a restart
+        if (state.step < mNextStep) return false;
+        if (mState.load(std::memory_order_acquire) != Idle) {
+            ++mDeferred;
+            return false;
+        }
+        handOff(gc, state);
+        return true;
+    }
+
+    // Checkpoints this step regardless of the period, waiting for a write in progress
+    template<typename GridCellsType>
+    void save(const GridCellsType& gc, const CheckpointState& state)
+    {
+        waitIdle();
+        handOff(gc, state);
+    }
+
+    void waitIdle()
+    {
+        for (int s; (s = mState.load(std::memory_order_acquire)) == Full; ) mState.wait(s, std::memory_order_acquire);
+    }
+
+    uint64_t written() const { return mWritten; }
+    uint64_t deferred() const { return mDeferred; } // steps that found the writer busy
+    uint64_t failed() const { return mFailed; }
+    const std::string& path() const { return mPath; }
+
+private:
+    template<typename GridCellsType>
+    void handOff(const GridCellsType& gc, const CheckpointState& state)
+    {
+        mImage.capture(gc, state);
+        mNextStep = (state.step / mEvery + 1) * mEvery;
+        mState.store(Full, std::memory_order_release);
+        mState.notify_all();
+    }
+
+    void writerLoop()
+    {
+        while (true) {
+            mState.wait(Idle, std::memory_order_acquire);
+            if (mState.load(std::memory_order_acquire) == Stop) return;
+
+            try {
+                mImage.seal();
+                mImage.write(mPath);
+                ++mWritten;
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                ++mFailed;
+            }
+            mState.store(Idle, std::memory_order_release);
+            mState.notify_all();
+        }
+    }
+
+    const std::string mPath;
+    const uint64_t mEvery;
+    uint64_t mNextStep{};
+    uint64_t mDeferred{};
+    CheckpointImage mImage; // owned by whoever mState says: the caller when Idle, the writer when Full
+    std::atomic<int> mState{Idle};
+    std::atomic<uint64_t> mWritten{};
+    std::atomic<uint64_t> mFailed{};
+    std::thread mWriter;
+};
@@ -0,0 +1,115 @@
+#pragma once
+#include <array>
+#include <stdint.h>
+#include <vector>
+#include "advectKernels.h"
+
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"). Four 32 bit words
+// are a pure function of a 128 bit counter and a 64 bit key, so any value can be drawn in any order,
+// on any thread, without shared state.
+class Philox4x32
+{
+public:
+    using Block = std::array<uint32_t, 4>;
+
+    static constexpr uint32_t M0{0xD2511F53u}, M1{0xCD9E8D57u};
+    static constexpr uint32_t W0{0x9E3779B9u}, W1{0xBB67AE85u};
+    static constexpr int ROUNDS{10};
+
+    static Block generate(Block ctr, uint32_t k0, uint32_t k1)
+    {
+        for (int round = 0; round < ROUNDS; ++round) {
+            const uint64_t p0 = static_cast<uint64_t>(M0) * ctr[0];
+            const uint64_t p1 = static_cast<uint64_t>(M1) * ctr[2];
+            ctr = {static_cast<uint32_t>(p1 >> 32) ^ ctr[1] ^ k0, static_cast<uint32_t>(p1),
+                   static_cast<uint32_t>(p0 >> 32) ^ ctr[3] ^ k1, static_cast<uint32_t>(p0)};
+            k0 += W0;
+            k1 += W1;
+        }
+        return ctr;
+    }
+};
+
+
+// Random words keyed by (seed, step, stream, cell): the counter is (cell, stream, step), the key
+// the seed. A value does not depend on which thread draws it or on what else was drawn, so loops
+// over cells can be split or vectorised freely and a run is reproduced from its seed.
+class CounterRng
+{
+public:
+    explicit CounterRng(const uint64_t seed = 1) : mSeed{seed} {}
+
+    uint64_t seed() const { return mSeed; }
+    void setSeed(const uint64_t seed) { mSeed = seed; }
+
+    Philox4x32::Block operator()(const uint64_t step, const uint32_t stream, const uint32_t cell) const
+    {
+        return Philox4x32::generate({cell, stream, static_cast<uint32_t>(step), static_cast<uint32_t>(step >> 32)},
+                                    static_cast<uint32_t>(mSeed), static_cast<uint32_t>(mSeed >> 32));
+    }
+
+    // The blocks of cells firstCell .. firstCell+n-1, word w of cell firstCell+k at out[w*n + k]
+    void fill(const uint64_t step, const uint32_t stream, const uint32_t firstCell, const int32_t n,
+              std::vector<uint32_t>& out, const bool simd = true) const
+    {
+        out.resize(4 * static_cast<size_t>(n));
+        int32_t k = 0;
+#ifdef SF_HAVE_AVX2
+        if (simd && cpuHasAvx2()) k = fillAvx2(step, stream, firstCell, n, out.data());
+#endif
+        for (; k < n; ++k) {
+            const Philox4x32::Block block = (*this)(step, stream, firstCell + k);
+            for (int w = 0; w < 4; ++w) out[w * static_cast<size_t>(n) + k] = block[w];
+        }
+    }
+
+private:
+#ifdef SF_HAVE_AVX2
+    // 32 x 32 -> 64 bit products of all 8 lanes, split into their high and low halves
+    __attribute__((target("avx2")))
+    static void mulhilo(const __m256i a, const __m256i m, __m256i& hi, __m256i& lo)
+    {
+        const __m256i even = _mm256_mul_epu32(a, m);
+        const __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+        lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+        hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+    }
+
+    // 8 cells per iteration; returns how many cells it filled, the scalar loop does the rest
+    __attribute__((target("avx2")))
+    int32_t fillAvx2(const uint64_t step, const uint32_t stream, const uint32_t firstCell, const int32_t n, uint32_t* out) const
+    {
+        const __m256i m0 = _mm256_set1_epi32(static_cast<int>(Philox4x32::M0));
+        const __m256i m1 = _mm256_set1_epi32(static_cast<int>(Philox4x32::M1));
+        const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+        int32_t k = 0;
+        for (; k + 8 <= n; k += 8) {
+            __m256i c0 = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(firstCell + k)), lane);
+            __m256i c1 = _mm256_set1_epi32(static_cast<int>(stream));
+            __m256i c2 = _mm256_set1_epi32(static_cast<int>(step));
+            __m256i c3 = _mm256_set1_epi32(static_cast<int>(step >> 32));
+            uint32_t k0 = static_cast<uint32_t>(mSeed), k1 = static_cast<uint32_t>(mSeed >> 32);
+            for (int round = 0; round < Philox4x32::ROUNDS; ++round) {
+                __m256i hi0, lo0, hi1, lo1;
+                mulhilo(c0, m0, hi0, lo0);
+                mulhilo(c2, m1, hi1, lo1);
+                c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(static_cast<int>(k0)));
+                c1 = lo1;
+                c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(static_cast<int>(k1)));
+                c3 = lo0;
+                k0 += Philox4x32::W0;
+                k1 += Philox4x32::W1;
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k), c0);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + n + k), c1);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * static_cast<size_t>(n) + k), c2);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 3 * static_cast<size_t>(n) + k), c3);
+        }
+        return k;
+    }
+#endif
+
+    uint64_t mSeed;
+};
@@ -0,0 +1,188 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include "advectKernels.h"
+#include "threadPool.h"
+#include "utils.h"
+
+
+// How density maps to screen brightness. The default is what glDrawPixels did with the raw floats:
+// each channel clamped to [0, 1].
+struct DisplayTone
+{
+    float exposure{1.0f}; // channels are multiplied by this first
+    bool reinhard{false}; // then compressed with v / (1 + v) instead of clipped, keeps detail in dense smoke
+};
+
+// Packed 8 bit RGBA pixels, bytes r, g, b, a in memory, rows in grid order (j = 0 first)
+struct DisplayFrame
+{
+    std::vector<uint32_t> pixels;
+    int32_t width{};
+    int32_t height{};
+};
+
+inline uint32_t toneChannel(const float v, const DisplayTone& tone)
+{
+    float t = v * tone.exposure;
+    if (tone.reinhard) t = std::max(t, 0.0f) / (1.0f + std::max(t, 0.0f));
+    // nearbyint rounds half to even like the SIMD conversion
+    return static_cast<uint32_t>(std::nearbyint(std::min(1.0f, std::max(0.0f, t)) * 255.0f));
+}
+
+inline uint32_t packRGBA8(const uint32_t r, const uint32_t g, const uint32_t b, const uint32_t a = 255)
+{
+    return r | g << 8 | b << 16 | a << 24;
+}
+
+// n cells of interleaved r, g, b floats to RGBA8
+inline void toneRowInterleaved(const float* rgb, const int n, uint32_t* out, const DisplayTone& tone)
+{
+    for (int i = 0; i < n; ++i) {
+        out[i] = packRGBA8(toneChannel(rgb[3*i], tone), toneChannel(rgb[3*i+1], tone), toneChannel(rgb[3*i+2], tone));
+    }
+}
+
+// n cells from separate r, g and b planes to RGBA8
+inline void toneRowPlanar(const float* r, const float* g, const float* b, const int n, uint32_t* out, const DisplayTone& tone)
+{
+    for (int i = 0; i < n; ++i) {
+        out[i] = packRGBA8(toneChannel(r[i], tone), toneChannel(g[i], tone), toneChannel(b[i], tone));
+    }
+}
+
+#ifdef SF_HAVE_AVX2
+// 8 values through toneChannel, as rounded 32 bit integers in [0, 255]
+__attribute__((target("avx2")))
+inline __m256i toneChannelAvx2(const __m256 v, const DisplayTone& tone)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 t = _mm256_mul_ps(v, _mm256_set1_ps(tone.exposure));
+    if (tone.reinhard) {
+        t = _mm256_max_ps(t, zero);
+        t = _mm256_div_ps(t, _mm256_add_ps(one, t));
+    }
+    t = _mm256_min_ps(_mm256_max_ps(t, zero), one); // operand order maps NaN to 0 like the scalar code
+    return _mm256_cvtps_epi32(_mm256_mul_ps(t, _mm256_set1_ps(255.0f)));
+}
+
+// Four cells as 12 consecutive channel values in [0, 255], narrowed to bytes and spread to RGBA
+__attribute__((target("avx2")))
+inline __m128i packCellsRGBA8(const __m128i a, const __m128i b, const __m128i c)
+{
+    const __m128i toRGBA = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i bytes = _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_packus_epi32(c, _mm_setzero_si128()));
+    return _mm_or_si128(_mm_shuffle_epi8(bytes, toRGBA), _mm_set1_epi32(static_cast<int>(0xff000000u)));
+}
+
+// Same results as toneRowInterleaved. Eight cells are 24 consecutive floats, toned as three vectors.
+__attribute__((target("avx2")))
+inline void toneRowInterleavedAvx2(const float* rgb, const int n, uint32_t* out, const DisplayTone& tone)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i v0 = toneChannelAvx2(_mm256_loadu_ps(rgb + 3*i), tone);
+        const __m256i v1 = toneChannelAvx2(_mm256_loadu_ps(rgb + 3*i + 8), tone);
+        const __m256i v2 = toneChannelAvx2(_mm256_loadu_ps(rgb + 3*i + 16), tone);
+        const __m128i lo = packCellsRGBA8(_mm256_castsi256_si128(v0), _mm256_extracti128_si256(v0, 1), _mm256_castsi256_si128(v1));
+        const __m128i hi = packCellsRGBA8(_mm256_extracti128_si256(v1, 1), _mm256_castsi256_si128(v2), _mm256_extracti128_si256(v2, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), hi);
+    }
+    toneRowInterleaved(rgb + 3*i, n - i, out + i, tone);
+}
+
+__attribute__((target("avx2")))
+inline void toneRowPlanarAvx2(const float* r, const float* g, const float* b, const int n, uint32_t* out, const DisplayTone& tone)
+{
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xff000000u));
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i vr = toneChannelAvx2(_mm256_loadu_ps(r + i), tone);
+        const __m256i vg = toneChannelAvx2(_mm256_loadu_ps(g + i), tone);
+        const __m256i vb = toneChannelAvx2(_mm256_loadu_ps(b + i), tone);
+        const __m256i px = _mm256_or_si256(_mm256_or_si256(vr, _mm256_slli_epi32(vg, 8)),
+                                           _mm256_or_si256(_mm256_slli_epi32(vb, 16), alpha));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), px);
+    }
+    toneRowPlanar(r + i, g + i, b + i, n - i, out + i, tone);
+}
+#endif
+
+inline void toneRowInterleaved(const float* rgb, const int n, uint32_t* out, const DisplayTone& tone, const bool simd)
+{
+#ifdef SF_HAVE_AVX2
+    if (simd && cpuHasAvx2()) return toneRowInterleavedAvx2(rgb, n, out, tone);
+#endif
+    toneRowInterleaved(rgb, n, out, tone);
+}
+
+inline void toneRowPlanar(const float* r, const float* g, const float* b, const int n, uint32_t* out,
+                          const DisplayTone& tone, const bool simd)
+{
+#ifdef SF_HAVE_AVX2
+    if (simd && cpuHasAvx2()) return toneRowPlanarAvx2(r, g, b, n, out, tone);
+#endif
+    toneRowPlanar(r, g, b, n, out, tone);
+}
+
+
+// Converts the density of gc to RGBA8. With factor > 1 each factor x factor block of cells is
+// averaged into one pixel, a partial block at the right or top edge is dropped. Rows are split
+// over the pool; the result does not depend on the thread count.
+template<typename GridCellsType>
+void convertDensity(const GridCellsType& gc, DisplayFrame& frame, const int factor, const DisplayTone& tone,
+                    ThreadPool& pool, const bool simd = true)
+{
+    using IndexType = typename GridCellsType::IndexType;
+    const int f = std::max(1, factor);
+    frame.width = gc.width() / f;
+    frame.height = gc.height() / f;
+    frame.pixels.resize(static_cast<size_t>(frame.width) * frame.height);
+    // cells of a row that are adjacent in memory
+    const int segment = IndexType::ROW_CONTIGUOUS ? frame.width * f : IndexType::ROW_BLOCK;
+
+    pool.parallelFor(0, frame.height, [&](const int yBegin, const int yEnd) {
+        std::vector<float> rowSum; // interleaved block sums of one output row, or the widened row of a packed grid
+        if (f > 1 || GridCellsType::LayoutType::PACKED) rowSum.resize(3 * static_cast<size_t>(frame.width));
+
+        for (int y = yBegin; y < yEnd; ++y) {
+            uint32_t* out = frame.pixels.data() + static_cast<size_t>(frame.width) * y;
+            if (f == 1) {
+                for (int i0 = 0; i0 < frame.width; i0 += segment) {
+                    const int n = std::min(segment, frame.width - i0);
+                    const int idx = gc.pos(i0, y);
+                    if constexpr (GridCellsType::LayoutType::SOA) {
+                        toneRowPlanar(gc.density.plane(0) + idx, gc.density.plane(1) + idx, gc.density.plane(2) + idx,
+                                      n, out + i0, tone, simd);
+                    } else if constexpr (GridCellsType::LayoutType::PACKED) {
+                        gc.density.widen(idx, n, rowSum.data(), simd);
+                        toneRowInterleaved(rowSum.data(), n, out + i0, tone, simd);
+                    } else {
+                        toneRowInterleaved(&gc.density[idx].r, n, out + i0, tone, simd);
+                    }
+                }
+                continue;
+            }
+
+            std::fill(rowSum.begin(), rowSum.end(), 0.0f);
+            for (int j = y * f; j < (y + 1) * f; ++j) {
+                for (int x = 0; x < frame.width; ++x) {
+                    float* sum = &rowSum[3 * x];
+                    for (int i = x * f; i < (x + 1) * f; ++i) {
+                        const Density den = gc.density[gc.pos(i, j)];
+                        sum[0] += den.r;
+                        sum[1] += den.g;
+                        sum[2] += den.b;
+                    }
+                }
+            }
+            DisplayTone blockTone = tone;
+            blockTone.exposure *= 1.0f / (f * f);
+            toneRowInterleaved(rowSum.data(), frame.width, out, blockTone, simd);
+        }
+    });
+}
@@ -0,0 +1,240 @@
+#pragma once
+#include <fftw3.h>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "scene/sceneBase.h"
+#include "simulator2D.h"
+#include "threadPool.h"
+
+
+// Scene parameters of the members of a sweep, one line per member:
+//     viscosity gravity densityTrans diffusion
+// Blank lines and lines starting with # are skipped. Each line overrides those four values of the
+// scene's own parameters.
+struct SweepEntry
+{
+    float viscosity{}, gravity{}, densityTrans{}, diffusion{};
+
+    SceneParams apply(SceneParams params) const
+    {
+        params.viscosity = viscosity;
+        params.gravity = gravity;
+        params.densityTrans = densityTrans;
+        params.diffusion = diffusion;
+        return params;
+    }
+};
+
+inline std::vector<SweepEntry> loadSweepFile(const std::string& path)
+{
+    FILE* pFile = fopen(path.c_str(), "r");
+    if (!pFile) {
+        throw std::runtime_error("cannot open sweep file " + path);
+    }
+    std::vector<SweepEntry> entries;
+    char line[512];
+    for (int lineNo = 1; fgets(line, sizeof(line), pFile); ++lineNo) {
+        const char* p = line;
+        while (*p == ' ' || *p == '\t') ++p;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+        SweepEntry e;
+        if (sscanf(p, "%f %f %f %f", &e.viscosity, &e.gravity, &e.densityTrans, &e.diffusion) != 4) {
+            fclose(pFile);
+            throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": expected viscosity gravity densityTrans diffusion");
+        }
+        entries.push_back(e);
+    }
+    fclose(pFile);
+    if (entries.empty()) {
+        throw std::runtime_error("sweep file " + path + " lists no members");
+    }
+    return entries;
+}
+
+
+// N independent grids advanced in lockstep, each with its own parameters. Members are split into
+// one contiguous chunk per pool thread, which runs each of its members single threaded. With the
+// spectral projection the members' u and v planes are staged back to back, and one batched FFTW plan
+// transforms a whole chunk at once, so the planning cost is paid once per ensemble instead of once
+// per grid. Results equal those of Simulator2D on each grid alone.
+template<typename GridCellsType>
+class EnsembleSimulator
+{
+public:
+    using SimType = Simulator2D<GridCellsType>;
+
+    // options.numThreads threads are spread over the members; the rest of options applies to each member
+    template<typename... GridArgs>
+    EnsembleSimulator(const int members, const float dt, const SimOptions& options, GridArgs&&... gridArgs) :
+        mPool(options.numThreads), mSpectral(options.projection == Projection::Spectral)
+    {
+        if (members < 1) {
+            throw std::invalid_argument("an ensemble needs at least one member");
+        }
+        SimOptions memberOptions = options;
+        memberOptions.numThreads = 1;
+        memberOptions.fftThreads = 1;
+        if (mSpectral) memberOptions.projection = Projection::External;
+        for (int k = 0; k < members; ++k) {
+            // with SimOptions::spectralDiffusion each member plans its density FFTs here, in turn; the
+            // wisdom is shared by all of them, so only the last one saves it
+            memberOptions.fftWisdomDir = k + 1 == members ? options.fftWisdomDir : std::string{};
+            Member& m = mMembers.emplace_back();
+            m.grid = std::make_unique<GridCellsType>(gridArgs...);
+            m.sim = std::make_unique<SimType>(*m.grid, dt, memberOptions);
+        }
+        if (mSpectral) createPlans();
+    }
+
+    ~EnsembleSimulator()
+    {
+        for (auto& [count, plans] : mPlans) {
+            fftwf_destroy_plan(plans.rc);
+            fftwf_destroy_plan(plans.cr);
+        }
+        if (mReal) {
+            fftwf_free(mReal);
+            fftwf_free(mSpectrum);
+        }
+    }
+
+    EnsembleSimulator(const EnsembleSimulator&) = delete;
+    EnsembleSimulator& operator=(const EnsembleSimulator&) = delete;
+
+    int size() const { return mMembers.size(); }
+    int numThreads() const { return mPool.size(); }
+    GridCellsType& grid(const int k) { return *mMembers[k].grid; }
+    const GridCellsType& grid(const int k) const { return *mMembers[k].grid; }
+    SimType& simulator(const int k) { return *mMembers[k].sim; }
+
+    // Simulator2D::prepareSpectralDiffusion for each member in turn, on the calling thread, which
+    // update() must not leave to the pool threads. Needed before the first update() when a scene
+    // selects spectral diffusion through SceneParams.
+    void prepareSpectralDiffusion()
+    {
+        for (Member& m : mMembers) m.sim->prepareSpectralDiffusion();
+    }
+
+    // wall time spent creating the batched FFT plans in the constructor
+    double planSeconds() const { return mPlanSeconds; }
+
+    // Advances every member by one step. emit(k) runs member k's sources first, on the thread that
+    // then steps it, and params(k) gives its scene parameters.
+    void update(auto&& emit, auto&& params)
+    {
+        mPool.parallelFor(0, size(), [&](const int kBegin, const int kEnd) {
+            if (!mSpectral) {
+                // the multigrid projection works on each grid by itself
+                for (int k = kBegin; k < kEnd; ++k) {
+                    emit(k);
+                    mMembers[k].sim->update(params(k));
+                }
+                return;
+            }
+            for (int k = kBegin; k < kEnd; ++k) {
+                emit(k);
+                mMembers[k].sim->beginUpdate(params(k));
+            }
+            project(kBegin, kEnd, params);
+            for (int k = kBegin; k < kEnd; ++k) {
+                mMembers[k].sim->endUpdate(params(k));
+            }
+        });
+    }
+
+private:
+    struct Member
+    {
+        std::unique_ptr<GridCellsType> grid;
+        std::unique_ptr<SimType> sim;
+    };
+
+    struct Plans
+    {
+        fftwf_plan rc{}, cr{};
+    };
+
+    int32_t width() const { return mMembers.front().grid->width(); }
+    int32_t height() const { return mMembers.front().grid->height(); }
+
+    // Member k's u plane starts at plane 2k of the staging buffers and its v plane at 2k+1. Planes are
+    // padded to 64 bytes, so every chunk starts with the alignment the plans were made for.
+    float* realPlane(const int plane) { return mReal + static_cast<size_t>(plane) * mRealDist; }
+    fftwf_complex* spectrumPlane(const int plane) { return mSpectrum + static_cast<size_t>(plane) * mSpectrumDist; }
+
+    // one plan pair per chunk size parallelFor hands out, which is at most two sizes
+    void createPlans()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const int W = width(), H = height(), N = size(), T = numThreads();
+        mRealDist = planeStride(W * H);
+        mSpectrumDist = (H * (W / 2 + 1) + 7) / 8 * 8;
+        mReal = fftwf_alloc_real(2 * static_cast<size_t>(N) * mRealDist);
+        mSpectrum = fftwf_alloc_complex(2 * static_cast<size_t>(N) * mSpectrumDist);
+
+        const int n[2] = {H, W};
+        for (int t = 0; t < T; ++t) {
+            const int count = static_cast<int>(static_cast<int64_t>(N) * (t + 1) / T - static_cast<int64_t>(N) * t / T);
+            if (count == 0 || mPlans.count(count)) continue;
+            Plans& plans = mPlans[count];
+            plans.rc = fftwf_plan_many_dft_r2c(2, n, 2 * count, mReal, nullptr, 1, mRealDist,
+                                               mSpectrum, nullptr, 1, mSpectrumDist, FFTW_MEASURE);
+            plans.cr = fftwf_plan_many_dft_c2r(2, n, 2 * count, mSpectrum, nullptr, 1, mSpectrumDist,
+                                               mReal, nullptr, 1, mRealDist, FFTW_MEASURE);
+        }
+        mPlanSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // The spectral projection of members [kBegin, kEnd), the same arithmetic as Simulator2D::diffuseVelocities
+    void project(const int kBegin, const int kEnd, auto&& params)
+    {
+        const int W = width(), H = height();
+        for (int k = kBegin; k < kEnd; ++k) {
+            const GridCellsType& gc = *mMembers[k].grid;
+            float* u = realPlane(2 * k);
+            float* v = realPlane(2 * k + 1);
+            for (int j = 0; j < H; ++j) {
+                for (int i = 0; i < W; ++i) {
+                    const XYPair vel = gc.velocity[gc.pos(i, j)];
+                    u[i + W * j] = vel.x;
+                    v[i + W * j] = vel.y;
+                }
+            }
+        }
+
+        const Plans& plans = mPlans.at(kEnd - kBegin);
+        fftwf_execute_dft_r2c(plans.rc, realPlane(2 * kBegin), spectrumPlane(2 * kBegin));
+        for (int k = kBegin; k < kEnd; ++k) {
+            projectSpectrum(spectrumPlane(2 * k), spectrumPlane(2 * k + 1), W, H, 0, H,
+                            mMembers[k].sim->timeStep(), params(k).viscosity);
+        }
+        fftwf_execute_dft_c2r(plans.cr, spectrumPlane(2 * kBegin), realPlane(2 * kBegin));
+
+        const float f = 1.0 / (float)(W * H);
+        for (int k = kBegin; k < kEnd; ++k) {
+            GridCellsType& gc = *mMembers[k].grid;
+            const float* u = realPlane(2 * k);
+            const float* v = realPlane(2 * k + 1);
+            for (int j = 0; j < H; ++j) {
+                for (int i = 0; i < W; ++i) {
+                    gc.velocity[gc.pos(i, j)] = XYPair(u[i + W * j], v[i + W * j]) * f;
+                }
+            }
+        }
+    }
+
+    ThreadPool mPool;
+    const bool mSpectral;
+    std::vector<Member> mMembers;
+    std::map<int, Plans> mPlans; // by members per chunk
+    float* mReal{};
+    fftwf_complex* mSpectrum{};
+    int32_t mRealDist{}, mSpectrumDist{};
+    double mPlanSeconds{};
+};
@@ -0,0 +1,417 @@
+#pragma once
+#include "storageFormat.h"
+#include "utils.h"
+#include <algorithm>
+#include <bit>
+#include <memory>
+#include <new>
+#include <span>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+
+struct MemoryHint
+{
+    bool hugePages{false}; // 2MB align large buffers and ask the kernel for transparent huge pages
+};
+
+// 64-byte aligned, zero initialised heap array. Copies are deep, swaps exchange pointers.
+// The memory is first touched by the constructing thread.
+template<typename T>
+class AlignedBuffer
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+public:
+    static constexpr size_t ALIGNMENT{64};
+    static constexpr size_t HUGE_PAGE_SIZE{2 << 20};
+
+    explicit AlignedBuffer(const size_t size = 0, const MemoryHint hint = {}) : mSize(size), mHint(hint)
+    {
+        mpData = allocate(size, hint, mAlignment);
+    }
+    AlignedBuffer(const AlignedBuffer& other) : AlignedBuffer(other.mSize, other.mHint)
+    {
+        std::copy(other.mpData, other.mpData + mSize, mpData);
+    }
+    AlignedBuffer(AlignedBuffer&& other) noexcept :
+        mSize(std::exchange(other.mSize, 0)), mHint(other.mHint), mAlignment(other.mAlignment),
+        mpData(std::exchange(other.mpData, nullptr)) {}
+    AlignedBuffer& operator=(AlignedBuffer other) noexcept
+    {
+        swap(*this, other);
+        return *this;
+    }
+    ~AlignedBuffer()
+    {
+        if (mpData) ::operator delete(mpData, std::align_val_t{mAlignment});
+    }
+
+    friend void swap(AlignedBuffer& a, AlignedBuffer& b) noexcept
+    {
+        std::swap(a.mSize, b.mSize);
+        std::swap(a.mHint, b.mHint);
+        std::swap(a.mAlignment, b.mAlignment);
+        std::swap(a.mpData, b.mpData);
+    }
+
+    T& operator[](const size_t idx) { return mpData[idx]; }
+    const T& operator[](const size_t idx) const { return mpData[idx]; }
+    T* data() { return mpData; }
+    const T* data() const { return mpData; }
+    size_t size() const { return mSize; }
+
+private:
+    static T* allocate(const size_t size, const MemoryHint hint, size_t& alignment)
+    {
+        alignment = ALIGNMENT;
+        if (!size) return nullptr;
+
+        size_t bytes = size * sizeof(T);
+        const bool huge = hint.hugePages && bytes >= HUGE_PAGE_SIZE;
+        if (huge) {
+            alignment = HUGE_PAGE_SIZE;
+            bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        }
+        void* p = ::operator new(bytes, std::align_val_t{alignment});
+#ifdef MADV_HUGEPAGE
+        if (huge) madvise(p, bytes, MADV_HUGEPAGE); // only a hint, failure just means normal pages
+#endif
+        return std::uninitialized_value_construct_n(static_cast<T*>(p), size), static_cast<T*>(p);
+    }
+
+    size_t mSize;
+    MemoryHint mHint;
+    size_t mAlignment{ALIGNMENT};
+    T* mpData;
+};
+
+
+// Channel description of the cell types, used to split them into planes
+template<typename CellType> struct CellTraits;
+
+template<> struct CellTraits<XYPair>
+{
+    static constexpr int CHANNELS{2};
+    static constexpr float XYPair::* MEMBERS[CHANNELS]{&XYPair::x, &XYPair::y};
+};
+
+template<> struct CellTraits<Density>
+{
+    static constexpr int CHANNELS{3};
+    static constexpr float Density::* MEMBERS[CHANNELS]{&Density::r, &Density::g, &Density::b};
+};
+
+
+// A float channel kept in a narrower Format, read and written as a float
+template<typename Format>
+struct PackedChannel
+{
+    explicit PackedChannel(typename Format::Storage& bits) : bits(bits) {}
+    PackedChannel(const PackedChannel&) = default;
+
+    operator float() const { return Format::unpack(bits); }
+    PackedChannel& operator=(const float f) { bits = Format::pack(f); return *this; }
+    PackedChannel& operator=(const PackedChannel& ch) { return *this = float(ch); }
+    PackedChannel& operator+=(const float f) { return *this = float(*this) + f; }
+
+    typename Format::Storage& bits;
+};
+
+template<typename Format>
+using ChannelRef = std::conditional_t<std::is_same_v<Format, Fp32>, float&, PackedChannel<Format>>;
+
+// Reference to a cell whose channels live in separate planes or in a packed Format. It reads and
+// writes like the cell type itself, so code written against XYPair& / Density& works on either layout.
+template<typename CellType, typename Format = Fp32> struct CellRef;
+
+template<typename Format> struct CellRef<XYPair, Format>
+{
+    CellRef(typename Format::Storage* p, const int32_t stride) : x(p[0]), y(p[stride]) {}
+    CellRef(const CellRef&) = default;
+
+    operator XYPair() const { return XYPair{x, y}; }
+    CellRef& operator=(const XYPair& xy) { x = xy.x; y = xy.y; return *this; }
+    CellRef& operator=(const CellRef& ref) { return *this = XYPair(ref); }
+    CellRef& operator+=(const XYPair& xy) { x += xy.x; y += xy.y; return *this; }
+    XYPair operator*(const float f) const { return XYPair(*this) * f; }
+    XYPair operator-(const XYPair& xy) const { return XYPair(*this) - xy; }
+    XYPair operator+(const XYPair& xy) const { return XYPair(*this) + xy; }
+    float norm() const { return XYPair(*this).norm(); }
+
+    ChannelRef<Format> x;
+    ChannelRef<Format> y;
+};
+
+template<typename Format> struct CellRef<Density, Format>
+{
+    CellRef(typename Format::Storage* p, const int32_t stride) : r(p[0]), g(p[stride]), b(p[2*stride]) {}
+    CellRef(const CellRef&) = default;
+
+    operator Density() const { return Density{r, g, b}; }
+    CellRef& operator=(const Density& den) { r = den.r; g = den.g; b = den.b; return *this; }
+    CellRef& operator=(const CellRef& ref) { return *this = Density(ref); }
+    CellRef& operator+=(const Density& den) { r += den.r; g += den.g; b += den.b; return *this; }
+    Density operator*(const float f) const { return Density(*this) * f; }
+    Density operator+(const Density& den) const { return Density(*this) + den; }
+
+    ChannelRef<Format> r;
+    ChannelRef<Format> g;
+    ChannelRef<Format> b;
+};
+
+
+// Cells stored contiguously, channels interleaved
+template<typename CellType>
+class AoSField
+{
+public:
+    AoSField(const int32_t cells, const MemoryHint hint) : mData(cells, hint) {}
+
+    CellType& operator[](const int32_t idx) { return mData[idx]; }
+    const CellType& operator[](const int32_t idx) const { return mData[idx]; }
+
+    CellType* data() { return mData.data(); }
+    const CellType* data() const { return mData.data(); }
+
+    int32_t size() const { return mData.size(); }
+
+    // the raw storage, e.g. for snapshots
+    std::span<std::byte> bytes() { return std::as_writable_bytes(std::span(mData.data(), mData.size())); }
+    std::span<const std::byte> bytes() const { return std::as_bytes(std::span(mData.data(), mData.size())); }
+
+    friend void swap(AoSField& a, AoSField& b) noexcept { swap(a.mData, b.mData); }
+
+private:
+    AlignedBuffer<CellType> mData;
+};
+
+// Distance between the planes of a field of the given size, keeps every plane 64-byte aligned
+constexpr int32_t planeStride(const int32_t cells) { return (cells + 15) / 16 * 16; }
+
+// One plane per channel, each padded so that every plane starts on a 64 byte boundary
+template<typename CellType>
+class SoAField
+{
+    using Traits = CellTraits<CellType>;
+public:
+    static constexpr int CHANNELS{Traits::CHANNELS};
+
+    SoAField(const int32_t cells, const MemoryHint hint) :
+        mSize(cells), mPlaneStride(::planeStride(cells)), mData(static_cast<size_t>(CHANNELS) * mPlaneStride, hint) {}
+
+    CellRef<CellType> operator[](const int32_t idx) { return CellRef<CellType>(&mData[idx], mPlaneStride); }
+
+    CellType operator[](const int32_t idx) const
+    {
+        CellType cell;
+        for (int c = 0; c < CHANNELS; ++c) {
+            cell.*Traits::MEMBERS[c] = mData[static_cast<size_t>(c) * mPlaneStride + idx];
+        }
+        return cell;
+    }
+
+    float* plane(const int c) { return &mData[static_cast<size_t>(c) * mPlaneStride]; }
+    const float* plane(const int c) const { return &mData[static_cast<size_t>(c) * mPlaneStride]; }
+
+    int32_t size() const { return mSize; }
+    int32_t planeStride() const { return mPlaneStride; }
+
+    // the raw storage, all planes including their padding
+    std::span<std::byte> bytes() { return std::as_writable_bytes(std::span(mData.data(), mData.size())); }
+    std::span<const std::byte> bytes() const { return std::as_bytes(std::span(mData.data(), mData.size())); }
+
+    friend void swap(SoAField& a, SoAField& b) noexcept
+    {
+        std::swap(a.mSize, b.mSize);
+        std::swap(a.mPlaneStride, b.mPlaneStride);
+        swap(a.mData, b.mData);
+    }
+
+private:
+    int32_t mSize;
+    int32_t mPlaneStride;
+    AlignedBuffer<float> mData;
+};
+
+
+// Cells stored contiguously with their channels interleaved like AoSField, each channel in Format
+// (Fp16 or Bf16). Cells are read and written as floats, rows can be converted in bulk.
+template<typename CellType, typename Format>
+class PackedField
+{
+    using Traits = CellTraits<CellType>;
+    using Storage = typename Format::Storage;
+public:
+    static constexpr int CHANNELS{Traits::CHANNELS};
+
+    // one element of padding after the last cell, read by the gathers of the AVX2 kernels
+    PackedField(const int32_t cells, const MemoryHint hint) : mSize(cells), mData(static_cast<size_t>(CHANNELS) * cells + 1, hint) {}
+
+    CellRef<CellType, Format> operator[](const int32_t idx) { return CellRef<CellType, Format>(&mData[offset(idx)], 1); }
+
+    CellType operator[](const int32_t idx) const
+    {
+        CellType cell;
+        for (int c = 0; c < CHANNELS; ++c) cell.*Traits::MEMBERS[c] = Format::unpack(mData[offset(idx) + c]);
+        return cell;
+    }
+
+    // cells [idx, idx + n) to and from interleaved floats, CHANNELS per cell
+    void widen(const int32_t idx, const int32_t n, float* out, const bool simd = true) const
+    {
+        Format::widen(&mData[offset(idx)], out, CHANNELS * n, simd);
+    }
+    void narrow(const int32_t idx, const int32_t n, const float* in, const bool simd = true)
+    {
+        Format::narrow(in, &mData[offset(idx)], CHANNELS * n, simd);
+    }
+
+    Storage* data() { return mData.data(); }
+    const Storage* data() const { return mData.data(); }
+
+    int32_t size() const { return mSize; }
+
+    // the raw storage, padding included
+    std::span<std::byte> bytes() { return std::as_writable_bytes(std::span(mData.data(), mData.size())); }
+    std::span<const std::byte> bytes() const { return std::as_bytes(std::span(mData.data(), mData.size())); }
+
+    friend void swap(PackedField& a, PackedField& b) noexcept
+    {
+        std::swap(a.mSize, b.mSize);
+        swap(a.mData, b.mData);
+    }
+
+private:
+    static size_t offset(const int32_t idx) { return static_cast<size_t>(CHANNELS) * idx; }
+
+    int32_t mSize;
+    AlignedBuffer<Storage> mData;
+};
+
+
+// Channel c of a field as a base pointer plus the distance in elements between neighbouring cells
+template<typename T = float>
+struct ChannelPtr
+{
+    T* p;
+    int32_t stride;
+};
+
+template<typename CellType>
+ChannelPtr<> channelOf(AoSField<CellType>& field, const int c)
+{
+    static_assert(sizeof(CellType) == CellTraits<CellType>::CHANNELS * sizeof(float));
+    return {&(field[0].*CellTraits<CellType>::MEMBERS[c]), CellTraits<CellType>::CHANNELS};
+}
+
+template<typename CellType>
+ChannelPtr<> channelOf(SoAField<CellType>& field, const int c)
+{
+    return {field.plane(c), 1};
+}
+
+template<typename CellType, typename Format>
+ChannelPtr<typename Format::Storage> channelOf(PackedField<CellType, Format>& field, const int c)
+{
+    return {field.data() + c, CellTraits<CellType>::CHANNELS};
+}
+
+
+// Row-major cell order, i + width * j
+class LinearIndex
+{
+public:
+    static constexpr bool ROW_CONTIGUOUS{true}; // cells i..i+n of a row are adjacent in memory
+    static constexpr int32_t ROW_BLOCK{1};      // rows that have to be handed out together
+
+    constexpr LinearIndex(const int32_t width, const int32_t height) : mWidth{width}, mStorage{width * height} {}
+
+    constexpr int32_t operator()(const int32_t i, const int32_t j) const { return i + mWidth * j; }
+
+    // cells in the field, including padding
+    constexpr int32_t storage() const { return mStorage; }
+    constexpr int32_t width() const { return mWidth; }
+
+private:
+    int32_t mWidth;
+    int32_t mStorage;
+};
+
+// TILE x TILE blocks, row-major inside a block and between blocks. A back-trace that moves a few
+// rows stays within a couple of tiles instead of touching a full grid row per step in j.
+// The grid is padded to whole tiles; the padding cells are never addressed.
+template<int32_t TILE>
+class TiledIndex
+{
+public:
+    static_assert(std::has_single_bit(static_cast<uint32_t>(TILE)), "tile size must be a power of two");
+    static constexpr int SHIFT{std::countr_zero(static_cast<uint32_t>(TILE))};
+    static constexpr int32_t MASK{TILE - 1};
+    static constexpr bool ROW_CONTIGUOUS{false};
+    static constexpr int32_t ROW_BLOCK{TILE};
+
+    constexpr TiledIndex(const int32_t width, const int32_t height) :
+        mTilesX{(width + MASK) >> SHIFT}, mStorage{mTilesX * ((height + MASK) >> SHIFT) * TILE * TILE} {}
+
+    constexpr int32_t operator()(const int32_t i, const int32_t j) const
+    {
+        return ((((j >> SHIFT) * mTilesX + (i >> SHIFT)) << SHIFT | (j & MASK)) << SHIFT) | (i & MASK);
+    }
+
+    constexpr int32_t storage() const { return mStorage; }
+    constexpr int32_t tilesX() const { return mTilesX; }
+
+private:
+    int32_t mTilesX;
+    int32_t mStorage;
+};
+
+
+// Array of structures: each cell's channels are stored together (the original layout)
+struct AoSLayout
+{
+    static constexpr bool SOA{false};
+    static constexpr bool PACKED{false};
+    using Format = Fp32;
+    template<typename CellType> using Field = AoSField<CellType>;
+    using Index = LinearIndex;
+};
+
+// Structure of arrays: separate aligned u, v and r, g, b planes
+struct SoALayout
+{
+    static constexpr bool SOA{true};
+    static constexpr bool PACKED{false};
+    using Format = Fp32;
+    template<typename CellType> using Field = SoAField<CellType>;
+    using Index = LinearIndex;
+};
+
+// Array of structures in TILE x TILE blocks, for grids whose rows do not fit in L2.
+// The FFTs and the renderer work on row-major copies.
+template<int32_t TILE = 32>
+struct TiledLayout
+{
+    static constexpr bool SOA{false};
+    static constexpr bool PACKED{false};
+    using Format = Fp32;
+    template<typename CellType> using Field = AoSField<CellType>;
+    using Index = TiledIndex<TILE>;
+};
+
+// Array of structures with the velocity and density channels stored in 16 bits, Fp16 or Bf16, which
+// halves their footprint and bandwidth. The kernels widen them to float and narrow their results.
+template<typename StorageFormat>
+struct PackedLayout
+{
+    static constexpr bool SOA{false};
+    static constexpr bool PACKED{true};
+    using Format = StorageFormat;
+    template<typename CellType> using Field = PackedField<CellType, StorageFormat>;
+    using Index = LinearIndex;
+};
@@ -0,0 +1,298 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "utils.h"
+
+
+enum class FrameFormat : uint32_t
+{
+    Float32, // r, g, b floats per cell, exactly the density field
+    RGB8     // r, g, b clamped to [0, 1] and quantised to bytes, like the window shows them
+};
+
+// Cells [x, x + width) x [y, y + height) of the grid, a zero width or height records the whole grid
+struct FrameRegion
+{
+    int32_t x{}, y{}, width{}, height{};
+};
+
+struct RecorderOptions
+{
+    std::string path{};  // empty disables recording
+    int everyNth{1};     // capture steps 0, N, 2N, ...
+    FrameRegion region{};
+    FrameFormat format{FrameFormat::RGB8};
+    bool packBits{true}; // run-length encode the frames on the writer thread
+    int slots{8};        // frames that can wait for the writer before new ones are dropped
+
+    // Consumes a --record* option at argv[i], returns false if argv[i] is not one
+    bool parseArg(const int argc, char* argv[], int& i)
+    {
+        if (!strcmp(argv[i], "--record") && i+1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "--record-every") && i+1 < argc) {
+            everyNth = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--record-region") && i+1 < argc &&
+                   sscanf(argv[i+1], "%d,%d,%dx%d", &region.x, &region.y, &region.width, &region.height) == 4) {
+            ++i;
+        } else if (!strcmp(argv[i], "--record-format") && i+1 < argc) {
+            format = strcmp(argv[++i], "f32") ? FrameFormat::RGB8 : FrameFormat::Float32;
+        } else if (!strcmp(argv[i], "--record-raw")) {
+            packBits = false;
+        } else if (!strcmp(argv[i], "--record-slots") && i+1 < argc) {
+            slots = std::max(1, atoi(argv[++i]));
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static constexpr const char* USAGE{" [--record FILE] [--record-every N] [--record-region X,Y,WxH]"
+                                       " [--record-format rgb8|f32] [--record-raw] [--record-slots N]"};
+};
+
+
+// Streams density frames to a file without ever making the simulation wait for the disk.
+// capture() copies the region into the next free slot of a fixed ring and returns; a writer
+// thread encodes and writes the slots in order. When the ring is full the frame is dropped
+// and counted instead.
+//
+// File layout, native endianness:
+//   header  "SFREC\0\0\1", u32 width, u32 height, u32 format, u32 packBits, u32 everyNth, u32 frames
+//   frame   u32 step, f32 time, u32 bytes, then `bytes` of payload
+// The payload is height rows of width cells, grid row j = 0 first, in the header's format. With packBits
+// it is PackBits encoded: a control byte n < 128 is followed by n + 1 literal bytes, n > 128
+// repeats the next byte 257 - n times. frames is filled in on close when the file is seekable.
+class FrameRecorder
+{
+    struct Slot
+    {
+        std::vector<uint8_t> data;
+        uint32_t step{};
+        float time{};
+    };
+
+    static constexpr char MAGIC[8]{'S', 'F', 'R', 'E', 'C', 0, 0, 1};
+
+public:
+    FrameRecorder(const RecorderOptions& options, const int32_t gridWidth, const int32_t gridHeight) :
+        mOptions{options}, mRegion{clipped(options.region, gridWidth, gridHeight)},
+        mFrameBytes{static_cast<size_t>(mRegion.width) * mRegion.height * cellBytes(options.format)},
+        mSlots(std::max(1, options.slots))
+    {
+        for (auto& slot : mSlots) slot.data.resize(mFrameBytes);
+        mpFile = fopen(options.path.c_str(), "wb");
+        if (!mpFile) {
+            throw std::runtime_error("cannot open " + options.path + " for recording");
+        }
+        writeHeader(0);
+        mWriter = std::thread([this] { writerLoop(); });
+    }
+
+    ~FrameRecorder() { finish(); }
+
+    FrameRecorder(const FrameRecorder&) = delete;
+    FrameRecorder& operator=(const FrameRecorder&) = delete;
+
+    // Called by the simulation thread after a step. Only copies, never waits for the writer.
+    template<typename GridCellsType>
+    void capture(const GridCellsType& gc, const uint32_t step, const float time)
+    {
+        if (step % mOptions.everyNth) return;
+
+        const uint64_t head = mHead.load(std::memory_order_relaxed);
+        if (!mpFile || head - mTail.load(std::memory_order_acquire) == mSlots.size()) {
+            ++mDropped;
+            return;
+        }
+
+        Slot& slot = mSlots[head % mSlots.size()];
+        slot.step = step;
+        slot.time = time;
+        if (mOptions.format == FrameFormat::Float32) {
+            copyRegion<Density>(gc, slot.data.data(), [](const Density& d) { return d; });
+        } else {
+            copyRegion<RGB8>(gc, slot.data.data(), [](const Density& d) {
+                return RGB8{quantise(d.r), quantise(d.g), quantise(d.b)};
+            });
+        }
+
+        mHead.store(head + 1, std::memory_order_release);
+        mSignal.fetch_add(1, std::memory_order_release);
+        mSignal.notify_one();
+    }
+
+    // Writes the frames still in the ring and closes the file, later captures are dropped
+    void finish()
+    {
+        if (!mpFile) return;
+        mStop.store(true, std::memory_order_release);
+        mSignal.fetch_add(1, std::memory_order_release);
+        mSignal.notify_one();
+        mWriter.join();
+
+        if (!fseek(mpFile, 0, SEEK_SET)) writeHeader(mWritten);
+        if (fclose(mpFile)) mFailed = true;
+        mpFile = nullptr;
+    }
+
+    // Statistics, exact after finish()
+    uint64_t framesCaptured() const { return mHead.load(std::memory_order_acquire); }
+    uint64_t framesWritten() const { return mWritten; }
+    uint64_t framesDropped() const { return mDropped; }
+    uint64_t bytesWritten() const { return mBytes; }
+    bool failed() const { return mFailed; }
+    const FrameRegion& region() const { return mRegion; }
+
+private:
+    struct RGB8
+    {
+        uint8_t r, g, b;
+    };
+
+    static uint8_t quantise(const float v) { return static_cast<uint8_t>(std::min(1.0f, std::max(0.0f, v)) * 255.0f + 0.5f); }
+
+    static size_t cellBytes(const FrameFormat format) { return format == FrameFormat::Float32 ? sizeof(Density) : sizeof(RGB8); }
+
+    static FrameRegion clipped(const FrameRegion& region, const int32_t gridWidth, const int32_t gridHeight)
+    {
+        if (region.width <= 0 || region.height <= 0) return FrameRegion{0, 0, gridWidth, gridHeight};
+
+        const int32_t x0 = std::clamp(region.x, 0, gridWidth), y0 = std::clamp(region.y, 0, gridHeight);
+        const int32_t x1 = std::clamp(region.x + region.width, 0, gridWidth);
+        const int32_t y1 = std::clamp(region.y + region.height, 0, gridHeight);
+        if (x1 <= x0 || y1 <= y0) {
+            throw std::invalid_argument("recording region lies outside the " + std::to_string(gridWidth) + "x" +
+                                        std::to_string(gridHeight) + " grid");
+        }
+        return FrameRegion{x0, y0, x1 - x0, y1 - y0};
+    }
+
+    // Rows in the order the window draws them, j = 0 at the top
+    template<typename Out, typename GridCellsType, typename Convert>
+    void copyRegion(const GridCellsType& gc, uint8_t* dst, Convert convert) const
+    {
+        Out* out = reinterpret_cast<Out*>(dst);
+        for (int32_t j = mRegion.y; j < mRegion.y + mRegion.height; ++j) {
+            if constexpr (std::is_same_v<Out, Density> && !GridCellsType::LayoutType::SOA &&
+                          GridCellsType::IndexType::ROW_CONTIGUOUS) {
+                if constexpr (GridCellsType::LayoutType::PACKED) {
+                    gc.density.widen(gc.pos(mRegion.x, j), mRegion.width, &out->r);
+                } else {
+                    memcpy(out, &gc.density[gc.pos(mRegion.x, j)], mRegion.width * sizeof(Density));
+                }
+                out += mRegion.width;
+            } else {
+                for (int32_t i = mRegion.x; i < mRegion.x + mRegion.width; ++i) {
+                    *out++ = convert(static_cast<Density>(gc.density[gc.pos(i, j)]));
+                }
+            }
+        }
+    }
+
+    void writerLoop()
+    {
+        std::vector<uint8_t> packed;
+        while (true) {
+            // read the signal before draining, so a frame published meanwhile ends the wait at once
+            const uint32_t signal = mSignal.load(std::memory_order_acquire);
+            const bool stop = mStop.load(std::memory_order_acquire);
+
+            uint64_t tail = mTail.load(std::memory_order_relaxed);
+            while (tail != mHead.load(std::memory_order_acquire)) {
+                writeFrame(mSlots[tail % mSlots.size()], packed);
+                mTail.store(++tail, std::memory_order_release);
+            }
+
+            if (stop) return;
+            mSignal.wait(signal, std::memory_order_acquire);
+        }
+    }
+
+    void writeFrame(const Slot& slot, std::vector<uint8_t>& packed)
+    {
+        const uint8_t* payload = slot.data.data();
+        uint32_t bytes = mFrameBytes;
+        if (mOptions.packBits) {
+            packBits(slot.data, packed);
+            payload = packed.data();
+            bytes = packed.size();
+        }
+
+        const uint32_t step = slot.step;
+        const float time = slot.time;
+        const bool ok = fwrite(&step, sizeof(step), 1, mpFile) == 1 && fwrite(&time, sizeof(time), 1, mpFile) == 1 &&
+                        fwrite(&bytes, sizeof(bytes), 1, mpFile) == 1 && fwrite(payload, 1, bytes, mpFile) == bytes;
+        if (!ok) {
+            mFailed = true; // e.g. disk full, later frames are still tried
+            return;
+        }
+        ++mWritten;
+        mBytes += 3 * sizeof(uint32_t) + bytes;
+    }
+
+    static void packBits(const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+    {
+        out.clear();
+        const size_t n = in.size();
+        size_t i = 0;
+        while (i < n) {
+            size_t run = 1;
+            while (i + run < n && run < 128 && in[i + run] == in[i]) ++run;
+            if (run >= 3) {
+                out.push_back(static_cast<uint8_t>(257 - run));
+                out.push_back(in[i]);
+                i += run;
+                continue;
+            }
+            // literals up to the next run of three
+            size_t lit = 0;
+            while (i + lit < n && lit < 128 &&
+                   !(i + lit + 2 < n && in[i + lit] == in[i + lit + 1] && in[i + lit] == in[i + lit + 2])) {
+                ++lit;
+            }
+            out.push_back(static_cast<uint8_t>(lit - 1));
+            out.insert(out.end(), in.begin() + i, in.begin() + i + lit);
+            i += lit;
+        }
+    }
+
+    void writeHeader(const uint64_t frames)
+    {
+        const uint32_t fields[6]{static_cast<uint32_t>(mRegion.width), static_cast<uint32_t>(mRegion.height),
+                                 static_cast<uint32_t>(mOptions.format), mOptions.packBits,
+                                 static_cast<uint32_t>(mOptions.everyNth), static_cast<uint32_t>(frames)};
+        if (fwrite(MAGIC, sizeof(MAGIC), 1, mpFile) != 1 || fwrite(fields, sizeof(fields), 1, mpFile) != 1) {
+            mFailed = true;
+        }
+    }
+
+    const RecorderOptions mOptions;
+    const FrameRegion mRegion;
+    const size_t mFrameBytes;
+    std::vector<Slot> mSlots;
+    FILE* mpFile{};
+
+    // single producer (capture) and single consumer (writerLoop): slots [mTail, mHead) are full
+    alignas(64) std::atomic<uint64_t> mHead{};
+    alignas(64) std::atomic<uint64_t> mTail{};
+    std::atomic<uint32_t> mSignal{};
+    std::atomic<bool> mStop{false};
+
+    uint64_t mDropped{};                // touched by the producer only
+    std::atomic<uint64_t> mWritten{};   // the rest by the writer only
+    std::atomic<uint64_t> mBytes{};
+    std::atomic<bool> mFailed{false};
+
+    std::thread mWriter;
+};
@@ -3,6 +3,7 @@
 #include <math.h>
 #include <cstring>
 #include <iostream>
+#include <string>
 #include <GLFW/glfw3.h>
 #include "utils.h"
 
@@ -18,9 +19,12 @@ public:
         }
 
         glfwMakeContextCurrent(mpWindow);
+        glfwSwapInterval(1); // draw at the display rate, the simulation runs on its own thread
         glfwSetWindowUserPointer(mpWindow, this);
     }
 
+    void setTitle(const std::string& title) { glfwSetWindowTitle(mpWindow, title.c_str()); }
+
     virtual void draw() = 0;
 
 protected:
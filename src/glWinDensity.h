@@ -1,18 +1,33 @@
 #pragma once
 #include "glWinBase.h"
 #include <math.h>
+#include <atomic>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "displayConvert.h"
+#include "telemetry.h"
+#include "telemetryOverlay.h"
+#include "threadPool.h"
+#include "tripleBuffer.h"
 #include "utils.h"
 
 
+// The window runs on the main thread and the simulation on its own. The simulation thread hands
+// finished density frames over with publishFrame() and picks up mouse forces and obstacle edits with
+// applyMouseInput(); everything else in here belongs to the main thread.
+// Dragging with the left button pushes the fluid, with the right button it paints obstacles and with
+// shift and the right button it erases them. With telemetry, T shows or hides its overlay.
 template<typename GridCellsType>
 class GlWinDensity : public GlWinBase
 {
-    static constexpr uint16_t GRID_SIZE = GridCellsType::GRID_SIZE;
-    auto POS(auto x, auto y) { return GridCellsType::POS(x,y); }
+    auto POS(auto x, auto y) { return mGridCells.pos(x,y); }
 public:
-    GlWinDensity(GridCellsType& gc) : mGridCells(gc)
+    GlWinDensity(GridCellsType& gc, const DisplayTone& tone = {}) :
+        mGridCells(gc), mTone(tone), mFrames(DisplayFrame{std::vector<uint32_t>(gc.cells()), gc.width(), gc.height()})
     {}
 
     void initialize()
@@ -34,17 +49,33 @@ public:
     {
         int width, height;
         glfwGetWindowSize(mpWindow, &width, &height);
+        mWindowWidth.store(width, std::memory_order_relaxed);
+        mWindowHeight.store(height, std::memory_order_relaxed);
 
         glLoadIdentity();
         glMatrixMode(GL_MODELVIEW);
         glOrtho(0, width, 0, height, -1.0, 1.0);
         glViewport(0,0,width,height);
 
-        drawDensity(width, height);
-        //drawVelocity();
-        
+        {
+            // the swap waits for the display, so only the draw calls are timed
+            ScopedTimer drawTimer(mpTelemetry ? &mpTelemetry->histogram(Probe::Draw) : nullptr);
+            drawDensity(width, height);
+            //drawVelocity(); // reads the live grid, races with the simulation thread
+            if (mpOverlay && mShowOverlay) mpOverlay->draw(height);
+        }
+
         glfwSwapBuffers(mpWindow);
         glfwPollEvents();
+        if (mpTelemetry) mpTelemetry->countFrame();
+    }
+
+    // Times the draw calls into telemetry, which must outlive the window, and shows its overlay if asked to
+    void setTelemetry(Telemetry* pTelemetry, const bool showOverlay)
+    {
+        mpTelemetry = pTelemetry;
+        mpOverlay = pTelemetry ? std::make_unique<TelemetryOverlay>(*pTelemetry) : nullptr;
+        mShowOverlay = showOverlay;
     }
 
     bool isFinished()
@@ -52,48 +83,123 @@ public:
         return mQuit || glfwWindowShouldClose(mpWindow);
     }
 
-    int getSceneId() { return mSceneId; }
+    int getSceneId() { return mSceneId.load(std::memory_order_relaxed); }
+    void setSceneId(const int sceneId) { mSceneId.store(sceneId, std::memory_order_relaxed); }
+
+    // Simulation thread: converts the density to RGBA8 for drawDensity, averaged down to about the
+    // window size when the grid has at least twice as many cells per side
+    void publishFrame(ThreadPool& pool)
+    {
+        const int winWidth = mWindowWidth.load(std::memory_order_relaxed);
+        const int winHeight = mWindowHeight.load(std::memory_order_relaxed);
+        const int factor = winWidth > 0 && winHeight > 0 ?
+                           std::max(1, std::min(mGridCells.width() / winWidth, mGridCells.height() / winHeight)) : 1;
+        convertDensity(mGridCells, mFrames.back(), factor, mTone, pool);
+        if (mGridCells.obstacles.interiorSolids()) drawObstacles(mFrames.back(), factor);
+        mFrames.publish();
+    }
+
+    // Simulation thread: stores the forces dragged with the mouse since the last call and paints the
+    // obstacle edits, between steps
+    void applyMouseInput()
+    {
+        if (!mHasMouseInput.load(std::memory_order_acquire)) return;
+        std::lock_guard lock(mMouseMutex);
+        for (const auto& [idx, force] : mMouseForces) {
+            mGridCells.force[idx] = force;
+        }
+        for (const ObstacleEdit& edit : mObstacleEdits) {
+            mGridCells.obstacles.paintDisc(edit.i, edit.j, BRUSH_RADIUS, edit.solid);
+        }
+        mMouseForces.clear();
+        mObstacleEdits.clear();
+        mHasMouseInput.store(false, std::memory_order_relaxed);
+    }
 
 private:
+    static constexpr int BRUSH_RADIUS{3}; // cells
+
+    struct ObstacleEdit
+    {
+        int32_t i, j;
+        bool solid;
+    };
+
+    // solid cells in grey, a pixel showing the cell at the centre of its block
+    void drawObstacles(DisplayFrame& frame, const int factor) const
+    {
+        const ObstacleMask& mask = mGridCells.obstacles;
+        for (int y = 0; y < frame.height; ++y) {
+            for (int x = 0; x < frame.width; ++x) {
+                if (mask.solid(x * factor + factor / 2, y * factor + factor / 2)) {
+                    frame.pixels[x + static_cast<size_t>(frame.width) * y] = packRGBA8(96, 96, 96);
+                }
+            }
+        }
+    }
+
+    // shows the latest published frame, or the previous one again if the simulation has not finished a step
     void drawDensity(const int width, const int height)
     {
-        glPixelZoom(width/static_cast<float>(GRID_SIZE), -height/static_cast<float>(GRID_SIZE));
+        mFrames.acquire();
+        const DisplayFrame& frame = mFrames.front();
+        glPixelZoom(width/static_cast<float>(frame.width), -height/static_cast<float>(frame.height));
         glRasterPos2i(0, height);
-        glDrawPixels(GRID_SIZE, GRID_SIZE, GL_RGB, GL_FLOAT, &mGridCells.density[0]);
+        glDrawPixels(frame.width, frame.height, GL_RGBA, GL_UNSIGNED_BYTE, frame.pixels.data());
     }
 
     void drawVelocity(const int width, const int height)
     {
         constexpr float ks{0.8f};
+        const int W = mGridCells.width(), H = mGridCells.height();
         glColor4f(1.0f, 0.0f, 0.0f, 0.5f);
         glBegin(GL_LINES);
-        for (unsigned int y = 0; y < GRID_SIZE; ++y) {
-            for (unsigned int x = 0; x < GRID_SIZE; ++x) {
-                float px = (x + 0.5) * width / (float)GRID_SIZE;
-                float py = (y + 0.5) * height / (float)GRID_SIZE;
-                float vx = mGridCells.u[POS(x, y)];
-                float vy = mGridCells.v[POS(x, y)];
+        for (int y = 0; y < H; ++y) {
+            for (int x = 0; x < W; ++x) {
+                float px = (x + 0.5) * width / (float)W;
+                float py = (y + 0.5) * height / (float)H;
+                float vx = mGridCells.velocity[POS(x, y)].x;
+                float vy = mGridCells.velocity[POS(x, y)].y;
                 float len = sqrt(vx*vx + vy*vy);
                 glVertex2d(px, py);
-                glVertex2d(px + ks * (width / (float)GRID_SIZE) * vx/len, py + ks * (height / (float)GRID_SIZE) * vy/len);
+                glVertex2d(px + ks * (width / (float)W) * vx/len, py + ks * (height / (float)H) * vy/len);
             }
         }
         glEnd();
     }
 
-    void mouseEvent(GLFWwindow *window, int button, int action, [[maybe_unused]] int mods)
+    void mouseEvent(GLFWwindow *window, int button, int action, int mods)
     {
         if (button == GLFW_MOUSE_BUTTON_LEFT) {
             double px, py;
             glfwGetCursorPos(window, &px, &py);
             mLastMousePos = XYPair(px, py);
             mMouseLeftDown = GLFW_PRESS==action;
+        } else if (button == GLFW_MOUSE_BUTTON_RIGHT) {
+            mMouseRightDown = GLFW_PRESS==action;
+            mEraseObstacles = mods & GLFW_MOD_SHIFT;
+            double px, py;
+            glfwGetCursorPos(window, &px, &py);
+            if (mMouseRightDown) editObstacle(px, py);
         }
     }
 
+    void editObstacle(const double xpos, const double ypos)
+    {
+        int width, height;
+        glfwGetWindowSize(mpWindow, &width, &height);
+        const int W = mGridCells.width(), H = mGridCells.height();
+        const ObstacleEdit edit{static_cast<int32_t>(W * xpos / width), static_cast<int32_t>(H * ypos / height), !mEraseObstacles};
+
+        std::lock_guard lock(mMouseMutex);
+        mObstacleEdits.push_back(edit);
+        mHasMouseInput.store(true, std::memory_order_release);
+    }
+
     void mouseMoveEvent([[maybe_unused]] GLFWwindow *window, double xpos, double ypos)
     {
         constexpr float INTERACTION = 1000000.0f;
+        if (mMouseRightDown) editObstacle(xpos, ypos);
         if (mMouseLeftDown) {
             int width, height;
             glfwGetWindowSize(mpWindow, &width, &height);
@@ -102,11 +208,13 @@ private:
             XYPair delta = newMousePos - mLastMousePos;
             if (delta.norm() >= 2.0f) // ignore slight movement
             {
-                int idx = POS(std::max(0, std::min<int>(GRID_SIZE-1, GRID_SIZE * newMousePos.x / (float)width)),
-                              std::max(0, std::min<int>(GRID_SIZE-1, GRID_SIZE * newMousePos.y / (float)height)));
+                const int W = mGridCells.width(), H = mGridCells.height();
+                int idx = POS(std::max(0, std::min<int>(W-1, W * newMousePos.x / (float)width)),
+                              std::max(0, std::min<int>(H-1, H * newMousePos.y / (float)height)));
 
-                mGridCells.force[idx] = XYPair{GRID_SIZE * delta.x / width,
-                                               GRID_SIZE * delta.y / height} * INTERACTION;
+                std::lock_guard lock(mMouseMutex);
+                mMouseForces.emplace_back(idx, XYPair{W * delta.x / width, H * delta.y / height} * INTERACTION);
+                mHasMouseInput.store(true, std::memory_order_release);
 
                 mLastMousePos = newMousePos;
             }
@@ -117,15 +225,30 @@ private:
     {
         if (GLFW_PRESS == action) {
             if (key == 'Q') mQuit = true;
-            if (key == ' ') mSceneId++;
+            if (key == ' ') mSceneId.fetch_add(1, std::memory_order_relaxed);
+            if (key == 'T') mShowOverlay = !mShowOverlay;
         }
     }
 
 
     GridCellsType& mGridCells;
+    const DisplayTone mTone;
+    TripleBuffer<DisplayFrame> mFrames;
+    std::atomic<int> mWindowWidth{}, mWindowHeight{}; // written by draw(), read by publishFrame()
+
+    std::mutex mMouseMutex;
+    std::vector<std::pair<int32_t, XYPair>> mMouseForces; // cell index, force
+    std::vector<ObstacleEdit> mObstacleEdits;
+    std::atomic<bool> mHasMouseInput{false};
 
-    int mSceneId{};
+    std::atomic<int> mSceneId{};
     bool mMouseLeftDown{false};
+    bool mMouseRightDown{false};
+    bool mEraseObstacles{false};
     XYPair mLastMousePos{};
     bool mQuit{false};
+
+    Telemetry* mpTelemetry{};
+    std::unique_ptr<TelemetryOverlay> mpOverlay;
+    bool mShowOverlay{false};
 };
@@ -0,0 +1,64 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+
+// Characters of a font rendered once by FreeType as 8-bit coverage; FreeType is not needed afterwards
+class GlyphAtlas
+{
+public:
+    // A rendered character, its rows top down from its top, which is `top` pixels above the baseline
+    struct Glyph
+    {
+        int32_t left{}, top{}, width{}, rows{}, advance{};
+        std::vector<uint8_t> pixels;
+    };
+
+    GlyphAtlas(const char* fontPath, const int pixelSize, const std::string_view chars)
+    {
+        FT_Library ft;
+        if (FT_Init_FreeType(&ft)) {
+            throw std::runtime_error("FREETYPE: Could not init FreeType Library");
+        }
+        FT_Face face;
+        if (FT_New_Face(ft, fontPath, 0, &face)) {
+            FT_Done_FreeType(ft);
+            throw std::runtime_error("FREETYPE: Failed to load font");
+        }
+
+        FT_Set_Pixel_Sizes(face, 0, static_cast<int16_t>(pixelSize));
+        for (const char c : chars) {
+            if (FT_Load_Char(face, c, FT_LOAD_RENDER)) {
+                FT_Done_Face(face);
+                FT_Done_FreeType(ft);
+                throw std::runtime_error("FREETYPE: Failed to load glyph");
+            }
+            const FT_GlyphSlot slot = face->glyph;
+            Glyph& glyph = mGlyphs[static_cast<unsigned char>(c) % mGlyphs.size()];
+            glyph.left = slot->bitmap_left;
+            glyph.top = slot->bitmap_top;
+            glyph.width = slot->bitmap.width;
+            glyph.rows = slot->bitmap.rows;
+            glyph.advance = slot->advance.x / 64;
+            glyph.pixels.resize(static_cast<size_t>(glyph.width) * glyph.rows);
+            for (int32_t j = 0; j < glyph.rows; ++j) {
+                const uint8_t* row = slot->bitmap.buffer + static_cast<ptrdiff_t>(slot->bitmap.pitch) * j;
+                std::copy(row, row + glyph.width, glyph.pixels.begin() + static_cast<size_t>(glyph.width) * j);
+            }
+        }
+        FT_Done_Face(face);
+        FT_Done_FreeType(ft);
+    }
+
+    // empty for characters that were not rendered
+    const Glyph& operator[](const char c) const { return mGlyphs[static_cast<unsigned char>(c) % mGlyphs.size()]; }
+
+private:
+    std::array<Glyph, 128> mGlyphs{};
+};
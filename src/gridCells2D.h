@@ -1,23 +1,110 @@
 #pragma once
 #include <iostream>
 #include "utils.h"
+#include "fieldLayout.h"
+#include "obstacleMask.h"
 #include <math.h>
-#include <array>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 
 
-template<int16_t GS>
-class GridCells2D
+// Grid size argument selecting the runtime sized GridCells2D specialization
+constexpr int16_t DYNAMIC_GRID_SIZE{0};
+
+// The velocity, force and density fields and the solid cells, common to every grid shape
+template<typename Layout>
+class GridFields
+{
+public:
+    using LayoutType = Layout;
+    using VelocityField = typename Layout::template Field<XYPair>;
+    using DensityField = typename Layout::template Field<Density>;
+    // forces are summed from scene and mouse kicks that overflow 16 bit floats, so they stay in float
+    using ForceField = std::conditional_t<Layout::PACKED, AoSField<XYPair>, VelocityField>;
+
+    // Scenes and the renderer only see the front buffers (velocity, density); the simulator writes
+    // a step into the back buffer and swaps it to the front, which only exchanges pointers.
+    void swapVelocity() { using std::swap; swap(velocity, velocityBack); }
+    void swapDensity() { using std::swap; swap(density, densityBack); }
+
+    VelocityField velocity;
+    VelocityField velocityBack;
+
+    ForceField force;
+
+    DensityField density;
+    DensityField densityBack;
+
+    // edited between steps, the simulator picks the changes up at the start of the next one
+    ObstacleMask obstacles;
+
+protected:
+    GridFields(const int32_t cells, const int32_t width, const int32_t height, const MemoryHint memory) :
+        velocity(cells, memory), velocityBack(cells, memory), force(cells, memory),
+        density(cells, memory), densityBack(cells, memory), obstacles(width, height) {}
+};
+
+
+// Square grid with the size fixed at compile time, so the solver loops get constant trip counts.
+// pos(i, j) maps a cell to its index in the fields, which is only i + width * j for linear layouts.
+template<int16_t GS, typename Layout = AoSLayout>
+class GridCells2D : public GridFields<Layout>
 {
+    static_assert(GS >= 4, "use DYNAMIC_GRID_SIZE for a runtime sized grid");
 public:
+    using IndexType = typename Layout::Index;
+    static constexpr IndexType INDEX{GS, GS};
     static constexpr int16_t GRID_SIZE{GS};
     static constexpr int32_t ARR_SIZE{GS*GS};
 
-    constexpr inline static int32_t POS(int32_t i, int32_t j) { return i + GRID_SIZE * j; };
-    std::array<XYPair, ARR_SIZE> velocity{};
-    std::array<XYPair, ARR_SIZE> velocityCopy{};
+    explicit GridCells2D(const MemoryHint memory = {}) : GridFields<Layout>(INDEX.storage(), GS, GS, memory) {}
+
+    constexpr inline static int32_t POS(int32_t i, int32_t j) { return INDEX(i, j); };
+
+    static constexpr int32_t pos(const int32_t i, const int32_t j) { return POS(i, j); }
+    static constexpr IndexType index() { return INDEX; }
+    static constexpr int32_t width() { return GS; }
+    static constexpr int32_t height() { return GS; }
+    static constexpr int32_t cells() { return ARR_SIZE; }
+    static constexpr int32_t storageCells() { return INDEX.storage(); }
+};
+
+// width x height grid chosen at runtime, e.g. from a command line option
+template<typename Layout>
+class GridCells2D<DYNAMIC_GRID_SIZE, Layout> : public GridFields<Layout>
+{
+public:
+    using IndexType = typename Layout::Index;
+
+    GridCells2D(const int32_t width, const int32_t height, const MemoryHint memory = {}) :
+        GridFields<Layout>(checkedIndex(width, height).storage(), width, height, memory), mIndex{width, height},
+        mWidth{width}, mHeight{height} {}
+
+    int32_t pos(const int32_t i, const int32_t j) const { return mIndex(i, j); }
+    const IndexType& index() const { return mIndex; }
+    int32_t width() const { return mWidth; }
+    int32_t height() const { return mHeight; }
+    int32_t cells() const { return mWidth * mHeight; }
+    int32_t storageCells() const { return mIndex.storage(); }
 
-    std::array<XYPair, ARR_SIZE> force{};
+private:
+    // cell indices are int32_t throughout the solver and the kernels scale them by up to 3 channels
+    static IndexType checkedIndex(const int32_t width, const int32_t height)
+    {
+        if (width < 4 || height < 4) {
+            throw std::invalid_argument("grid must be at least 4x4, got " + std::to_string(width) + "x" + std::to_string(height));
+        }
+        constexpr int64_t BLOCK{IndexType::ROW_BLOCK};
+        const int64_t storage = (width + BLOCK - 1) / BLOCK * BLOCK * ((height + BLOCK - 1) / BLOCK * BLOCK);
+        if (storage > std::numeric_limits<int32_t>::max() / 4) {
+            throw std::invalid_argument("grid " + std::to_string(width) + "x" + std::to_string(height) + " is too large");
+        }
+        return IndexType{width, height};
+    }
 
-    std::array<Density, ARR_SIZE> density{};
-    std::array<Density, ARR_SIZE> densityCopy{};
+    IndexType mIndex;
+    int32_t mWidth;
+    int32_t mHeight;
 };
@@ -0,0 +1,710 @@
+#include "scene/sceneMovingSources.h"
+#include "scene/sceneBlank.h"
+#include "scene/sceneFire.h"
+#include "scene/sceneText.h"
+#include "simulator2D.h"
+#include "gridCells2D.h"
+#include "stageTimer.h"
+#include "telemetry.h"
+#include "frameRecorder.h"
+#include "checkpoint.h"
+#include "displayConvert.h"
+#include "ensemble.h"
+#include "slabSimulator.h"
+#include "slabTransport.h"
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+#ifndef SF_GRID_SIZE
+#define SF_GRID_SIZE 350
+#endif
+
+
+constexpr float HEADLESS_DT{0.001f};
+
+template<typename GridCellsType>
+std::unique_ptr<SceneBase<GridCellsType>> makeScene(const int sceneId, GridCellsType& gc)
+{
+    switch (sceneId) {
+        case 0: return std::make_unique<SceneMovingSources<GridCellsType>>(gc);
+        case 1: return std::make_unique<SceneFire<GridCellsType>>(gc);
+        case 2: return std::make_unique<SceneText<GridCellsType>>(gc);
+        case 3: return std::make_unique<SceneBlank<GridCellsType>>(gc);
+        default: throw std::runtime_error("unknown scene id " + std::to_string(sceneId));
+    }
+}
+
+// FNV-1a, to compare runs bit for bit
+struct Fnv1a
+{
+    uint64_t hash{14695981039346656037ull};
+
+    void add(const void* p, const size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) {
+            hash = (hash ^ static_cast<const uint8_t*>(p)[i]) * 1099511628211ull;
+        }
+    }
+
+    void addCell(const XYPair& vel, const Density& den)
+    {
+        add(&vel, sizeof(vel));
+        add(&den, sizeof(den));
+    }
+};
+
+// Fnv1a over the velocity and density fields in row-major order
+template<typename GridCellsType>
+uint64_t fieldChecksum(const GridCellsType& gc)
+{
+    Fnv1a fnv;
+    for (int j = 0; j < gc.height(); ++j) {
+        for (int i = 0; i < gc.width(); ++i) {
+            fnv.addCell(gc.velocity[gc.pos(i, j)], gc.density[gc.pos(i, j)]);
+        }
+    }
+    return fnv.hash;
+}
+
+// Largest and RMS difference of a field's channels from a reference run
+struct FieldError
+{
+    double max{}, sumSq{}, refMax{};
+    int64_t count{};
+
+    void add(const float value, const float reference)
+    {
+        const double diff = std::abs(static_cast<double>(value) - reference);
+        max = std::max(max, diff);
+        sumSq += diff * diff;
+        refMax = std::max(refMax, std::abs(static_cast<double>(reference)));
+        ++count;
+    }
+    double rms() const { return std::sqrt(sumSq / count); }
+
+    void add(const Density& d, const Density& dRef)
+    {
+        add(d.r, dRef.r);
+        add(d.g, dRef.g);
+        add(d.b, dRef.b);
+    }
+
+    void add(const XYPair& v, const XYPair& vRef)
+    {
+        add(v.x, vRef.x);
+        add(v.y, vRef.y);
+    }
+};
+
+void printFieldErrors(const char* refName, const FieldError& density, const FieldError& velocity)
+{
+    printf("%-10s %14s %14s %14s\n", "field", "max |error|", "rms error", (std::string("max |") + refName + "|").c_str());
+    printf("%-10s %14.3e %14.3e %14.3e\n", "density", density.max, density.rms(), density.refMax);
+    printf("%-10s %14.3e %14.3e %14.3e\n", "velocity", velocity.max, velocity.rms(), velocity.refMax);
+}
+
+// e.g. "AoS", "AoS tiled" or "AoS fp16"
+template<typename GridCellsType>
+std::string layoutName()
+{
+    using Layout = typename GridCellsType::LayoutType;
+    std::string name = Layout::SOA ? "SoA" : "AoS";
+    if (!GridCellsType::IndexType::ROW_CONTIGUOUS) name += " tiled";
+    if (Layout::PACKED) name = name + " " + Layout::Format::NAME;
+    return name;
+}
+
+// storage of the velocity and density fields with their back buffers, which the layout decides
+template<typename GridCellsType>
+size_t stateBytes(const GridCellsType& gc)
+{
+    return gc.velocity.bytes().size() + gc.velocityBack.bytes().size() + gc.density.bytes().size() + gc.densityBack.bytes().size();
+}
+
+
+// Runs the solver for a fixed number of steps without GLFW or GL and reports per-stage timings
+template<typename GridCellsType>
+class HeadlessFluids
+{
+    static constexpr float DT{HEADLESS_DT};
+public:
+    using SimType = Simulator2D<GridCellsType>;
+
+    template<typename... GridArgs>
+    HeadlessFluids(int sceneId, const SimOptions& options, const RecorderOptions& recorder,
+                   const CheckpointOptions& checkpoint, const uint64_t seed, GridArgs&&... gridArgs) :
+        mGridCells(std::forward<GridArgs>(gridArgs)...), mSimulator(mGridCells, DT, options), mSimd(options.simd),
+        mMultigrid(options.projection == Projection::Multigrid)
+    {
+        if (!recorder.path.empty()) {
+            mpRecorder = std::make_unique<FrameRecorder>(recorder, mGridCells.width(), mGridCells.height());
+        }
+        if (!checkpoint.path.empty()) {
+            mpCheckpointer = std::make_unique<Checkpointer>(checkpoint.path, checkpoint.every);
+        }
+        if (!checkpoint.restartPath.empty()) {
+            mStart = loadCheckpoint(checkpoint.restartPath, mGridCells);
+            sceneId = mStart.sceneId;
+            mSimulator.setTimeStep(mStart.dt);
+            printf("restarted from %s at step %llu, time %.4f s\n", checkpoint.restartPath.c_str(),
+                   static_cast<unsigned long long>(mStart.step), mStart.time);
+        }
+        mStart.sceneId = sceneId;
+
+        mpScene = makeScene(sceneId, mGridCells);
+        if (mpScene->getParams().spectralDiffusion) mSimulator.prepareSpectralDiffusion();
+        // a restart continues with the checkpoint's seed
+        if (!checkpoint.restartPath.empty()) {
+            mpScene->setRngSeed(mStart.rngSeed);
+            mpScene->setRngState(mStart.rngState);
+        } else {
+            mpScene->setRngSeed(seed);
+        }
+    }
+
+    // 0 skips it, N converts the density to RGBA8 after each step with N x N cells per pixel
+    void setDisplayFactor(const int factor) { mDisplayFactor = factor; }
+
+    void setObstacles(const ObstacleOptions& obstacles) { obstacles.apply(mGridCells.obstacles); }
+
+    void setTelemetry(const TelemetryOptions& telemetry)
+    {
+        if (!telemetry.path.empty()) {
+            mpTelemetry = std::make_unique<Telemetry>(telemetry, mGridCells.width(), mGridCells.height());
+        }
+    }
+
+    const GridCellsType& grid() const { return mGridCells; }
+    double stepsPerSecond() const { return mStepsPerSecond; }
+
+    void run(const int steps)
+    {
+        using Clock = std::chrono::steady_clock;
+        double sceneSecs{};
+        double recordSecs{};
+        int64_t diffuseIterations{};
+        double checkpointSecs{};
+        double displaySecs{};
+        int64_t substeps{};
+        double occupancy{};
+        int64_t multigridCycles{};
+        float time{mStart.time};
+        auto probe = [this](const Probe p) { return mpTelemetry ? &mpTelemetry->histogram(p) : nullptr; };
+        FlowStats flow;
+
+        const auto runStart = Clock::now();
+        for (int step = 0; step < steps; ++step) {
+            ScopedTimer stepTimer(probe(Probe::Step));
+            time += mSimulator.timeStep();
+
+            const auto sceneStart = Clock::now();
+            {
+                ScopedTimer sceneTimer(probe(Probe::SceneUpdate));
+                mpScene->update(time);
+            }
+            sceneSecs += std::chrono::duration<double>(Clock::now() - sceneStart).count();
+
+            FlowStats* pFlow = mpTelemetry && mpTelemetry->wantFlowStats() ? &flow : nullptr;
+            mSimulator.update(mpScene->getParams(), &mTimer, pFlow);
+            if (mpTelemetry) mpTelemetry->recordStep(mTimer, pFlow);
+            diffuseIterations += mSimulator.diffuseIterations();
+            substeps += mSimulator.substeps();
+            occupancy += mSimulator.activeOccupancy();
+            multigridCycles += mSimulator.multigridCycles();
+
+            if (mpRecorder) {
+                const auto recordStart = Clock::now();
+                mpRecorder->capture(mGridCells, mStart.step + step, time);
+                recordSecs += std::chrono::duration<double>(Clock::now() - recordStart).count();
+            }
+
+            if (mDisplayFactor > 0) {
+                const auto displayStart = Clock::now();
+                ScopedTimer publishTimer(probe(Probe::PublishFrame));
+                convertDensity(mGridCells, mDisplayFrame, mDisplayFactor, DisplayTone{}, mSimulator.threadPool(), mSimd);
+                displaySecs += std::chrono::duration<double>(Clock::now() - displayStart).count();
+            }
+
+            if (mpCheckpointer) {
+                const auto checkpointStart = Clock::now();
+                mpCheckpointer->offer(mGridCells, state(mStart.step + step + 1, time));
+                checkpointSecs += std::chrono::duration<double>(Clock::now() - checkpointStart).count();
+            }
+        }
+        const double wallSecs = std::chrono::duration<double>(Clock::now() - runStart).count();
+        mStepsPerSecond = steps / wallSecs;
+
+        report(steps, wallSecs, sceneSecs);
+        printf("diffuse sweeps: %.2f per step\n", static_cast<double>(diffuseIterations) / steps);
+        const float simulated = time - mStart.time;
+        printf("simulated %.4f s, mean DT %.3e, %.1f steps and %.1f advection substeps per simulated second\n",
+               simulated, simulated / steps, steps / simulated, substeps / simulated);
+        printf("density passes ran on %.1f%% of the tiles\n", 100.0 * occupancy / steps);
+        if (mMultigrid) {
+            printf("multigrid projection: %.2f V-cycles per step, last residual %.2e of the divergence\n",
+                   static_cast<double>(multigridCycles) / steps, mSimulator.multigridResidual());
+        }
+        if (mDisplayFactor > 0) {
+            const size_t bytes = mDisplayFrame.pixels.size() * sizeof(uint32_t);
+            printf("display conversion: %dx%d RGBA8, %.4f ms/step, %zu bytes per frame instead of %zu as float RGB\n",
+                   mDisplayFrame.width, mDisplayFrame.height, 1e3 * displaySecs / steps, bytes,
+                   static_cast<size_t>(mGridCells.cells()) * sizeof(Density));
+        }
+        if (mpRecorder) reportRecorder(steps, recordSecs);
+        if (mpTelemetry) {
+            mpTelemetry->finish(); // writes the final report
+            printf("telemetry: %llu reports written to %s, %llu failed\n",
+                   static_cast<unsigned long long>(mpTelemetry->written()), mpTelemetry->path().c_str(),
+                   static_cast<unsigned long long>(mpTelemetry->failed()));
+        }
+        if (mpCheckpointer) {
+            mpCheckpointer->save(mGridCells, state(mStart.step + steps, time));
+            mpCheckpointer->waitIdle();
+            printf("checkpoints: %llu written to %s, %.4f ms/step, %llu steps found the writer busy, %llu failed\n",
+                   static_cast<unsigned long long>(mpCheckpointer->written()), mpCheckpointer->path().c_str(),
+                   1e3 * checkpointSecs / steps, static_cast<unsigned long long>(mpCheckpointer->deferred()),
+                   static_cast<unsigned long long>(mpCheckpointer->failed()));
+        }
+    }
+
+private:
+    void report(const int steps, const double wallSecs, const double sceneSecs)
+    {
+        const double simSecs = mTimer.totalSeconds();
+        printf("grid %dx%d %s %s, %d threads, %d steps, %.3f s wall\n", mGridCells.width(), mGridCells.height(),
+               layoutName<GridCellsType>().c_str(), FIXED_SIZE ? "fixed" : "runtime sized",
+               mSimulator.numThreads(), steps, wallSecs);
+        printf("velocity and density fields: %.2f MB, %.2f MB as fp32\n", stateBytes(mGridCells) * 1e-6,
+               static_cast<double>(mGridCells.storageCells()) * 2 * (sizeof(XYPair) + sizeof(Density)) * 1e-6);
+        printf("FFT planning: %.3f s\n", mSimulator.planSeconds());
+        printf("%-22s %12s %8s\n", "stage", "ms/step", "share");
+        for (int s = 0; s < StageTimer::NUM_STAGES; ++s) {
+            const auto stage = static_cast<SimStage>(s);
+            printf("%-22s %12.4f %7.1f%%\n", stageName(stage), 1e3 * mTimer.seconds(stage) / steps,
+                   100.0 * mTimer.seconds(stage) / simSecs);
+        }
+        printf("%-22s %12.4f\n", "  of which FFT", 1e3 * mTimer.fftSeconds() / steps);
+        printf("%-22s %12.4f\n", "simulator total", 1e3 * simSecs / steps);
+        printf("%-22s %12.4f\n", "scene update", 1e3 * sceneSecs / steps);
+        printf("%-22s %12.4f\n", "step total", 1e3 * wallSecs / steps);
+        printf("throughput: %.2f steps/s, %.3e cells/s\n", steps / wallSecs,
+               static_cast<double>(steps) * mGridCells.cells() / wallSecs);
+        printf("checksum: %016llx\n", static_cast<unsigned long long>(fieldChecksum(mGridCells)));
+    }
+
+    CheckpointState state(const uint64_t step, const float time) const
+    {
+        return CheckpointState{mStart.sceneId, step, time, mSimulator.timeStep(), mpScene->rngState(), mpScene->rngSeed()};
+    }
+
+    void reportRecorder(const int steps, const double recordSecs)
+    {
+        FrameRecorder& rec = *mpRecorder;
+        rec.finish(); // waits for the writer to drain the ring
+        printf("recorder: %dx%d region, %.4f ms/step capture, %llu frames written (%.1f MB), %llu dropped%s\n",
+               rec.region().width, rec.region().height, 1e3 * recordSecs / steps,
+               static_cast<unsigned long long>(rec.framesWritten()), rec.bytesWritten() * 1e-6,
+               static_cast<unsigned long long>(rec.framesDropped()), rec.failed() ? ", WRITE ERRORS" : "");
+    }
+
+    static constexpr bool FIXED_SIZE{!std::is_constructible_v<GridCellsType, int32_t, int32_t>};
+
+    GridCellsType mGridCells;
+    SimType mSimulator;
+    std::unique_ptr<SceneBase<GridCellsType>> mpScene;
+    StageTimer mTimer;
+    std::unique_ptr<FrameRecorder> mpRecorder;
+    std::unique_ptr<Checkpointer> mpCheckpointer;
+    std::unique_ptr<Telemetry> mpTelemetry;
+    CheckpointState mStart{}; // where the run began, non-zero after a restart
+    const bool mSimd;
+    const bool mMultigrid;
+    int mDisplayFactor{};
+    DisplayFrame mDisplayFrame;
+    double mStepsPerSecond{};
+};
+
+// Runs the same scene on an fp32 AoS grid and reports how far the fields of fluids are from it
+template<typename ReferenceCells, typename GridCellsType, typename... GridArgs>
+void compareWithFp32(const HeadlessFluids<GridCellsType>& fluids, const int sceneId, const SimOptions& options,
+                     const ObstacleOptions& obstacles, const uint64_t seed, const int steps, GridArgs&&... gridArgs)
+{
+    printf("\nfp32 reference run:\n");
+    auto pReference = std::make_unique<HeadlessFluids<ReferenceCells>>(sceneId, options, RecorderOptions{}, CheckpointOptions{},
+                                                                       seed, std::forward<GridArgs>(gridArgs)...);
+    pReference->setObstacles(obstacles);
+    pReference->run(steps);
+
+    const GridCellsType& gc = fluids.grid();
+    const ReferenceCells& ref = pReference->grid();
+    FieldError density, velocity;
+    for (int j = 0; j < gc.height(); ++j) {
+        for (int i = 0; i < gc.width(); ++i) {
+            density.add(gc.density[gc.pos(i, j)], ref.density[ref.pos(i, j)]);
+            velocity.add(gc.velocity[gc.pos(i, j)], ref.velocity[ref.pos(i, j)]);
+        }
+    }
+
+    printf("\n%s against fp32 after %d steps:\n", layoutName<GridCellsType>().c_str(), steps);
+    printFieldErrors("fp32", density, velocity);
+    printf("velocity and density fields: %.2f MB against %.2f MB (%.0f%% saved)\n", stateBytes(gc) * 1e-6,
+           stateBytes(ref) * 1e-6, 100.0 * (1.0 - static_cast<double>(stateBytes(gc)) / stateBytes(ref)));
+    printf("throughput: %.2f against %.2f steps/s (%.2fx)\n", fluids.stepsPerSecond(), pReference->stepsPerSecond(),
+           fluids.stepsPerSecond() / pReference->stepsPerSecond());
+}
+
+// Without a size the compile time SF_GRID_SIZE grid is used, otherwise a runtime sized one
+// compareFp32 repeats the run on an fp32 AoS grid and reports the differences
+template<typename Layout>
+void runHeadless(const int width, const int height, const MemoryHint memory, const int sceneId,
+                 const SimOptions& options, const RecorderOptions& recorder, const CheckpointOptions& checkpoint,
+                 const TelemetryOptions& telemetry, const int displayFactor, const ObstacleOptions& obstacles, const uint64_t seed, const int steps,
+                 const bool compareFp32)
+{
+    if (compareFp32 && !checkpoint.restartPath.empty()) {
+        throw std::invalid_argument("--compare-fp32 cannot start from a checkpoint");
+    }
+    if (width > 0) {
+        using GridCellsType = GridCells2D<DYNAMIC_GRID_SIZE, Layout>;
+        auto pFluids = std::make_unique<HeadlessFluids<GridCellsType>>(sceneId, options, recorder, checkpoint, seed, width, height, memory);
+        pFluids->setDisplayFactor(displayFactor);
+        pFluids->setObstacles(obstacles);
+        pFluids->setTelemetry(telemetry);
+        pFluids->run(steps);
+        if (compareFp32) {
+            compareWithFp32<GridCells2D<DYNAMIC_GRID_SIZE, AoSLayout>>(*pFluids, sceneId, options, obstacles, seed, steps,
+                                                                       width, height, memory);
+        }
+    } else {
+        using GridCellsType = GridCells2D<SF_GRID_SIZE, Layout>;
+        auto pFluids = std::make_unique<HeadlessFluids<GridCellsType>>(sceneId, options, recorder, checkpoint, seed, memory);
+        pFluids->setDisplayFactor(displayFactor);
+        pFluids->setObstacles(obstacles);
+        pFluids->setTelemetry(telemetry);
+        pFluids->run(steps);
+        if (compareFp32) {
+            compareWithFp32<GridCells2D<SF_GRID_SIZE, AoSLayout>>(*pFluids, sceneId, options, obstacles, seed, steps, memory);
+        }
+    }
+}
+
+// Runs sceneId on every member of a sweep, all members in lockstep, and reports the aggregate throughput
+template<typename GridCellsType, typename... GridArgs>
+void runEnsembleOf(const std::vector<SweepEntry>& sweep, const int sceneId, const SimOptions& options,
+                   const uint64_t seed, const int steps, GridArgs&&... gridArgs)
+{
+    using Clock = std::chrono::steady_clock;
+    const int N = sweep.size();
+    EnsembleSimulator<GridCellsType> ensemble(N, HEADLESS_DT, options, gridArgs...);
+    std::vector<std::unique_ptr<SceneBase<GridCellsType>>> scenes;
+    std::vector<float> times(N);
+    for (int k = 0; k < N; ++k) {
+        scenes.push_back(makeScene(sceneId, ensemble.grid(k)));
+        scenes.back()->setRngSeed(seed);
+    }
+    auto emit = [&](const int k) {
+        times[k] += ensemble.simulator(k).timeStep();
+        scenes[k]->update(times[k]);
+    };
+    auto params = [&](const int k) { return sweep[k].apply(scenes[k]->getParams()); };
+    for (int k = 0; k < N; ++k) {
+        if (params(k).spectralDiffusion) {
+            ensemble.prepareSpectralDiffusion();
+            break;
+        }
+    }
+
+    const auto runStart = Clock::now();
+    for (int step = 0; step < steps; ++step) {
+        ensemble.update(emit, params);
+    }
+    const double wallSecs = std::chrono::duration<double>(Clock::now() - runStart).count();
+
+    const GridCellsType& gc = ensemble.grid(0);
+    printf("ensemble of %d grids %dx%d %s, %d threads, %d steps, %.3f s wall\n", N, gc.width(), gc.height(),
+           layoutName<GridCellsType>().c_str(), ensemble.numThreads(), steps, wallSecs);
+    printf("FFT planning: %.3f s for the whole ensemble\n", ensemble.planSeconds());
+    printf("throughput: %.2f ensemble steps/s, %.3e cells/s aggregate\n", steps / wallSecs,
+           static_cast<double>(steps) * N * gc.cells() / wallSecs);
+    printf("%-6s %10s %8s %10s %10s %18s\n", "member", "viscosity", "gravity", "density", "diffusion", "checksum");
+    for (int k = 0; k < N; ++k) {
+        const SweepEntry& e = sweep[k];
+        printf("%-6d %10.3g %8.3g %10.6g %10.3g   %016llx\n", k, e.viscosity, e.gravity, e.densityTrans, e.diffusion,
+               static_cast<unsigned long long>(fieldChecksum(ensemble.grid(k))));
+    }
+}
+
+template<typename Layout>
+void runEnsemble(const int width, const int height, const MemoryHint memory, const std::vector<SweepEntry>& sweep,
+                 const int sceneId, const SimOptions& options, const uint64_t seed, const int steps)
+{
+    if (width > 0) {
+        runEnsembleOf<GridCells2D<DYNAMIC_GRID_SIZE, Layout>>(sweep, sceneId, options, seed, steps, width, height, memory);
+    } else {
+        runEnsembleOf<GridCells2D<SF_GRID_SIZE, Layout>>(sweep, sceneId, options, seed, steps, memory);
+    }
+}
+
+// CPU time of this process, which unlike wall time leaves out the time other ranks run on a shared core
+double cpuSeconds()
+{
+    timespec t{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// One rank of a --ranks run: its slab of the grid, the scene on it, and the report on rank 0
+void runSlabRank(SlabTransport& transport, const SlabOptions& slab, const int width, const int height, const MemoryHint memory,
+                 const int sceneId, const SimOptions& options, const uint64_t seed, const int steps)
+{
+    using Clock = std::chrono::steady_clock;
+    const int ranks = transport.ranks(), rank = transport.rank();
+    SlabCells cells(width, height, slabBegin(height, ranks, rank), slabBegin(height, ranks, rank + 1), slab.halo, memory);
+    SlabSimulator2D simulator(cells, transport, HEADLESS_DT, options);
+    std::unique_ptr<SceneBase<SlabCells>> pScene = makeScene(sceneId, cells);
+    pScene->setRngSeed(seed);
+
+    StageTimer timer;
+    double sceneSecs{};
+    int64_t diffuseIterations{};
+    float time{};
+    transport.barrier();
+    const auto runStart = Clock::now();
+    const double cpuStart = cpuSeconds();
+    for (int step = 0; step < steps; ++step) {
+        time += simulator.timeStep();
+        const auto sceneStart = Clock::now();
+        pScene->update(time);
+        sceneSecs += std::chrono::duration<double>(Clock::now() - sceneStart).count();
+        simulator.update(pScene->getParams(), &timer);
+        diffuseIterations += simulator.diffuseIterations();
+    }
+    transport.barrier();
+    const double wallSecs = std::chrono::duration<double>(Clock::now() - runStart).count();
+    const float slowestExchange = transport.allReduceMax(static_cast<float>(simulator.exchangeSeconds()));
+    const float busiest = transport.allReduceMax(static_cast<float>(cpuSeconds() - cpuStart));
+    const double clipped = transport.allReduceSum(static_cast<double>(simulator.clippedTraces()));
+    Fnv1a fnv;
+    simulator.gatherRows([&](int32_t, const XYPair* velocity, const Density* density) {
+        for (int32_t i = 0; i < width; ++i) fnv.addCell(velocity[i], density[i]);
+    });
+
+    if (rank == 0) {
+        const double simSecs = timer.totalSeconds();
+        printf("grid %dx%d in %d slabs of %d to %d rows, %d halo rows, %d steps, %.3f s wall\n", width, height, ranks,
+               height / ranks, (height + ranks - 1) / ranks, slab.halo, steps, wallSecs);
+        printf("FFT planning: %.3f s\n", simulator.planSeconds());
+        printf("%-22s %12s %8s\n", "stage (rank 0)", "ms/step", "share");
+        for (int s = 0; s < StageTimer::NUM_STAGES; ++s) {
+            const auto stage = static_cast<SimStage>(s);
+            printf("%-22s %12.4f %7.1f%%\n", stageName(stage), 1e3 * timer.seconds(stage) / steps,
+                   100.0 * timer.seconds(stage) / simSecs);
+        }
+        printf("%-22s %12.4f\n", "  of which FFT", 1e3 * timer.fftSeconds() / steps);
+        printf("%-22s %12.4f\n", "  of which exchange", 1e3 * simulator.exchangeSeconds() / steps);
+        printf("%-22s %12.4f\n", "simulator total", 1e3 * simSecs / steps);
+        printf("%-22s %12.4f\n", "scene update", 1e3 * sceneSecs / steps);
+        printf("%-22s %12.4f\n", "step total", 1e3 * wallSecs / steps);
+        printf("exchange on the slowest rank: %.4f ms/step, CPU time of the busiest rank: %.4f ms/step\n",
+               1e3 * slowestExchange / steps, 1e3 * busiest / steps);
+        printf("throughput: %.2f steps/s, %.3e cells/s\n", steps / wallSecs, static_cast<double>(steps) * width * height / wallSecs);
+        printf("diffuse sweeps: %.2f per step\n", static_cast<double>(diffuseIterations) / steps);
+        printf("back-traces could reach %d rows, %.0f were cut short by the halo\n", simulator.maxReach(), clipped);
+        if (clipped > 0)
+            std::cerr << "warning: " << clipped << " back-traces were cut short by the halo, so the result depends on the"
+                         " number of ranks; raise --halo from " << slab.halo << std::endl;
+        printf("checksum: %016llx\n", static_cast<unsigned long long>(fnv.hash));
+    }
+
+    if (slab.compareSingle) {
+        std::unique_ptr<HeadlessFluids<GridCells2D<DYNAMIC_GRID_SIZE, AoSLayout>>> pReference;
+        if (rank == 0) {
+            printf("\nsingle process reference run:\n");
+            pReference = std::make_unique<HeadlessFluids<GridCells2D<DYNAMIC_GRID_SIZE, AoSLayout>>>(
+                sceneId, options, RecorderOptions{}, CheckpointOptions{}, seed, width, height, memory);
+            pReference->run(steps);
+        }
+        FieldError density, velocity;
+        simulator.gatherRows([&](const int32_t j, const XYPair* vel, const Density* den) {
+            const auto& ref = pReference->grid();
+            for (int32_t i = 0; i < width; ++i) {
+                density.add(den[i], ref.density[ref.pos(i, j)]);
+                velocity.add(vel[i], ref.velocity[ref.pos(i, j)]);
+            }
+        });
+        if (rank == 0) {
+            printf("\n%d slabs against a single process after %d steps:\n", ranks, steps);
+            printFieldErrors("single", density, velocity);
+        }
+    }
+}
+
+// Splits the grid over slab.ranks processes: this one, which reports, and forked workers
+int runSlabs(const SlabOptions& slab, int width, int height, const MemoryHint memory, const int sceneId,
+             SimOptions options, const uint64_t seed, const int steps)
+{
+    if (width <= 0) {
+        width = height = SF_GRID_SIZE;
+    }
+    options.diffuseMethod = DiffuseMethod::RedBlack; // the slab solver's, for --compare-single
+    SlabSimulator2D::checked(width, height, slab.ranks, options);
+    std::unique_ptr<ShmTransport> pTransport =
+        ShmTransport::launch(slab.ranks, SlabSimulator2D::messageBytes(width, height, slab.ranks, slab.halo));
+    int status{};
+    try {
+        runSlabRank(*pTransport, slab, width, height, memory, sceneId, options, seed, steps);
+    } catch (const std::exception& e) {
+        std::cerr << "rank " << pTransport->rank() << ": " << e.what() << std::endl;
+        status = 1;
+    }
+    if (pTransport->rank() > 0) {
+        fflush(nullptr);
+        _exit(status); // workers end here
+    }
+    if (const int failed = pTransport->waitWorkers()) {
+        std::cerr << failed << " of the worker ranks failed" << std::endl;
+        status = 1;
+    }
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int steps{1000};
+    int sceneId{};
+    std::string layout{"aos"};
+    int width{}, height{};
+    MemoryHint memory{};
+    SimOptions options{};
+    RecorderOptions recorder{};
+    CheckpointOptions checkpoint{};
+    TelemetryOptions telemetry{};
+    int displayFactor{};
+    ObstacleOptions obstacles{};
+    uint64_t seed{1};
+    std::string sweepPath{};
+    bool compareFp32{false};
+    SlabOptions slab{};
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--steps") && i+1 < argc) {
+            steps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--scene") && i+1 < argc) {
+            sceneId = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--layout") && i+1 < argc) {
+            layout = argv[++i];
+        } else if (!strcmp(argv[i], "--size") && i+1 < argc && sscanf(argv[i+1], "%dx%d", &width, &height) == 2) {
+            ++i;
+        } else if (!strcmp(argv[i], "--ensemble") && i+1 < argc) {
+            sweepPath = argv[++i];
+        } else if (!strcmp(argv[i], "--seed") && i+1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "--display") && i+1 < argc) {
+            displayFactor = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--compare-fp32")) {
+            compareFp32 = true;
+        } else if (!strcmp(argv[i], "--hugepages")) {
+            memory.hugePages = true;
+        } else if (!strcmp(argv[i], "--threads") && i+1 < argc) {
+            options.numThreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--fft-threads") && i+1 < argc) {
+            options.fftThreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--wisdom") && i+1 < argc) {
+            options.fftWisdomDir = argv[++i];
+        } else if (!strcmp(argv[i], "--separate-advect")) {
+            options.fusedAdvect = false;
+        } else if (!strcmp(argv[i], "--no-simd")) {
+            options.simd = false;
+        } else if (!strcmp(argv[i], "--adaptive-dt")) {
+            options.adaptiveDt = true;
+        } else if (!strcmp(argv[i], "--cfl") && i+1 < argc) {
+            options.cflNumber = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--min-dt") && i+1 < argc) {
+            options.minDt = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--max-dt") && i+1 < argc) {
+            options.maxDt = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--projection") && i+1 < argc) {
+            options.projection = strcmp(argv[++i], "mg") ? Projection::Spectral : Projection::Multigrid;
+        } else if (!strcmp(argv[i], "--mg-cycles") && i+1 < argc) {
+            options.multigridCycles = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--mg-tol") && i+1 < argc) {
+            options.multigridTolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--active-tiles")) {
+            options.activeTiles = true;
+        } else if (!strcmp(argv[i], "--active-threshold") && i+1 < argc) {
+            options.activeThreshold = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--diffuse") && i+1 < argc) {
+            options.diffuseMethod = strcmp(argv[++i], "rb") ? DiffuseMethod::GaussSeidel : DiffuseMethod::RedBlack;
+        } else if (!strcmp(argv[i], "--diffuse-iters") && i+1 < argc) {
+            options.maxDiffuseIterations = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--diffuse-tol") && i+1 < argc) {
+            options.diffuseTolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--spectral-diffusion")) {
+            options.spectralDiffusion = true;
+        } else if (recorder.parseArg(argc, argv, i) || checkpoint.parseArg(argc, argv, i) ||
+                   telemetry.parseArg(argc, argv, i) || obstacles.parseArg(argc, argv, i) || slab.parseArg(argc, argv, i)) {
+            continue;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--steps N] [--scene ID] [--layout aos|soa|tiled|fp16|bf16] [--compare-fp32] [--size WxH] [--hugepages] [--ensemble SWEEP] [--seed N] [--display N] [--threads N]"
+                         " [--fft-threads N] [--wisdom DIR] [--separate-advect] [--no-simd]"
+                         " [--adaptive-dt] [--cfl X] [--min-dt X] [--max-dt X] [--active-tiles] [--active-threshold X]"
+                         " [--projection fft|mg] [--mg-cycles N] [--mg-tol X]"
+                         " [--diffuse gs|rb] [--diffuse-iters N] [--diffuse-tol X] [--spectral-diffusion]" << RecorderOptions::USAGE
+                      << CheckpointOptions::USAGE << TelemetryOptions::USAGE << ObstacleOptions::USAGE
+                      << SlabOptions::USAGE << std::endl;
+            return 1;
+        }
+    }
+
+    try {
+        if (slab.enabled()) {
+            if (layout != "aos" || !sweepPath.empty() || compareFp32 || !recorder.path.empty() || !checkpoint.path.empty() ||
+                !checkpoint.restartPath.empty() || !telemetry.path.empty() || displayFactor > 0 ||
+                !obstacles.imagePath.empty() || !obstacles.discs.empty()) {
+                throw std::invalid_argument("--ranks runs an AoS grid without ensembles, recording, checkpoints, telemetry, "
+                                            "display conversion or obstacles");
+            }
+            return runSlabs(slab, width, height, memory, sceneId, options, seed, steps);
+        }
+        if (!sweepPath.empty()) {
+            const std::vector<SweepEntry> sweep = loadSweepFile(sweepPath);
+            if (layout == "soa") {
+                runEnsemble<SoALayout>(width, height, memory, sweep, sceneId, options, seed, steps);
+            } else if (layout == "tiled") {
+                runEnsemble<TiledLayout<>>(width, height, memory, sweep, sceneId, options, seed, steps);
+            } else if (layout == "fp16") {
+                runEnsemble<PackedLayout<Fp16>>(width, height, memory, sweep, sceneId, options, seed, steps);
+            } else if (layout == "bf16") {
+                runEnsemble<PackedLayout<Bf16>>(width, height, memory, sweep, sceneId, options, seed, steps);
+            } else {
+                runEnsemble<AoSLayout>(width, height, memory, sweep, sceneId, options, seed, steps);
+            }
+        } else if (layout == "soa") {
+            runHeadless<SoALayout>(width, height, memory, sceneId, options, recorder, checkpoint, telemetry, displayFactor, obstacles, seed, steps, compareFp32);
+        } else if (layout == "tiled") {
+            runHeadless<TiledLayout<>>(width, height, memory, sceneId, options, recorder, checkpoint, telemetry, displayFactor, obstacles, seed, steps, compareFp32);
+        } else if (layout == "fp16") {
+            runHeadless<PackedLayout<Fp16>>(width, height, memory, sceneId, options, recorder, checkpoint, telemetry, displayFactor, obstacles, seed, steps, compareFp32);
+        } else if (layout == "bf16") {
+            runHeadless<PackedLayout<Bf16>>(width, height, memory, sceneId, options, recorder, checkpoint, telemetry, displayFactor, obstacles, seed, steps, compareFp32);
+        } else {
+            runHeadless<AoSLayout>(width, height, memory, sceneId, options, recorder, checkpoint, telemetry, displayFactor, obstacles, seed, steps, compareFp32);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
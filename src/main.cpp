@@ -6,10 +6,21 @@
 #include "gridCells2D.h"
 #include <GLFW/glfw3.h>
 #include "glWinDensity.h"
+#include "frameRecorder.h"
+#include "checkpoint.h"
+#include "stageTimer.h"
+#include "telemetry.h"
 #include <stdexcept>
 #include <iostream>
 #include "utils.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 
@@ -22,48 +33,175 @@ public:
     using SimType = Simulator2D<GridCellsType>;
     using WinDensityType = GlWinDensity<GridCellsType>;
 
-    StableFluids() : mSimulator(mGridCells, DT), mWinDensity(mGridCells)
+    explicit StableFluids(const RecorderOptions& recorder = {}, const CheckpointOptions& checkpoint = {},
+                          const ObstacleOptions& obstacles = {}, const TelemetryOptions& telemetry = {},
+                          const uint64_t seed = 1) : mSimulator(mGridCells, DT, SimOptions{static_cast<int>(std::thread::hardware_concurrency())}),
+                     mWinDensity(mGridCells)
     {
         mVecScene.push_back(new SceneMovingSources<GridCellsType>(mGridCells));
         mVecScene.push_back(new SceneFire<GridCellsType>(mGridCells));
         mVecScene.push_back(new SceneText<GridCellsType>(mGridCells));
         mVecScene.push_back(new SceneBlank<GridCellsType>(mGridCells));
+        for (auto* pScene : mVecScene) {
+            pScene->setRngSeed(seed);
+            if (pScene->getParams().spectralDiffusion) mSimulator.prepareSpectralDiffusion();
+        }
 
         if (!glfwInit()) {
             throw std::runtime_error("glfwInit failed");
         }
         mWinDensity.initialize();
+        obstacles.apply(mGridCells.obstacles);
+
+        if (!recorder.path.empty()) {
+            mpRecorder = std::make_unique<FrameRecorder>(recorder, mGridCells.width(), mGridCells.height());
+        }
+        if (!checkpoint.path.empty()) {
+            mpCheckpointer = std::make_unique<Checkpointer>(checkpoint.path, checkpoint.every);
+        }
+        if (telemetry.enabled()) {
+            mpTelemetry = std::make_unique<Telemetry>(telemetry, mGridCells.width(), mGridCells.height());
+            mWinDensity.setTelemetry(mpTelemetry.get(), telemetry.overlay);
+        }
+        if (!checkpoint.restartPath.empty()) {
+            const CheckpointState state = loadCheckpoint(checkpoint.restartPath, mGridCells);
+            mStep = state.step;
+            mTime = state.time;
+            mSimulator.setTimeStep(state.dt);
+            mWinDensity.setSceneId(state.sceneId);
+            mSceneIdx = state.sceneId % mVecScene.size();
+            for (auto* pScene : mVecScene) pScene->setRngSeed(state.rngSeed);
+            mVecScene[mSceneIdx]->setRngState(state.rngState);
+        }
     }
 
     ~StableFluids()
     {
+        if (mpCheckpointer) {
+            mpCheckpointer->save(mGridCells, checkpointState());
+            mpCheckpointer.reset(); // waits for the write
+        }
+        if (mpRecorder) {
+            mpRecorder->finish(); // drains the ring
+            std::cout << "recorder: " << mpRecorder->framesWritten() << " frames written, "
+                      << mpRecorder->framesDropped() << " dropped" << (mpRecorder->failed() ? ", write errors" : "") << std::endl;
+        }
         glfwTerminate();
     }
 
+    // The simulation steps on its own thread while this one draws the latest finished frame at the
+    // display rate. Steps/s and frames/s are shown in the window title.
     void run()
     {
-        float time{};
-        while (!mWinDensity.isFinished()) {
-            time += DT;
-
-            auto& scene = *mVecScene[mWinDensity.getSceneId() % mVecScene.size()];
-            scene.update(time);
-            mSimulator.update(scene.getParams());
+        using Clock = std::chrono::steady_clock;
+        const uint64_t firstStep = mStep;
+        std::thread simThread([this] { simulate(); });
 
+        const auto runStart = Clock::now();
+        auto lastReport = runStart;
+        uint64_t lastSteps = firstStep, frames{}, lastFrames{};
+        while (!mWinDensity.isFinished()) {
             mWinDensity.draw();
+            ++frames;
+
+            const auto now = Clock::now();
+            const double secs = std::chrono::duration<double>(now - lastReport).count();
+            if (secs >= 1.0) {
+                const uint64_t steps = mStep.load(std::memory_order_relaxed);
+                char title[96];
+                snprintf(title, sizeof(title), "Stable fluids sim - %.0f steps/s, %.0f fps",
+                         (steps - lastSteps) / secs, (frames - lastFrames) / secs);
+                mWinDensity.setTitle(title);
+                lastReport = now;
+                lastSteps = steps;
+                lastFrames = frames;
+            }
         }
+
+        const double secs = std::chrono::duration<double>(Clock::now() - runStart).count();
+        mStopSim.store(true, std::memory_order_relaxed);
+        simThread.join(); // finishes the step in progress
+        printf("%llu steps at %.1f steps/s, %llu frames at %.1f fps\n",
+               static_cast<unsigned long long>(mStep - firstStep), (mStep - firstStep) / secs,
+               static_cast<unsigned long long>(frames), frames / secs);
     }
 
 private:
+    void simulate()
+    {
+        auto probe = [this](const Probe p) { return mpTelemetry ? &mpTelemetry->histogram(p) : nullptr; };
+        StageTimer timer;
+        FlowStats flow;
+        while (!mStopSim.load(std::memory_order_relaxed)) {
+            ScopedTimer stepTimer(probe(Probe::Step));
+            mTime += mSimulator.timeStep();
+
+            mSceneIdx = mWinDensity.getSceneId() % mVecScene.size();
+            auto& scene = *mVecScene[mSceneIdx];
+            mWinDensity.applyMouseInput();
+            {
+                ScopedTimer sceneTimer(probe(Probe::SceneUpdate));
+                scene.update(mTime);
+            }
+            if (mpTelemetry) {
+                FlowStats* pFlow = mpTelemetry->wantFlowStats() ? &flow : nullptr;
+                mSimulator.update(scene.getParams(), &timer, pFlow);
+                mpTelemetry->recordStep(timer, pFlow);
+            } else {
+                mSimulator.update(scene.getParams());
+            }
+            {
+                ScopedTimer publishTimer(probe(Probe::PublishFrame));
+                mWinDensity.publishFrame(mSimulator.threadPool());
+            }
+
+            if (mpRecorder) mpRecorder->capture(mGridCells, mStep, mTime);
+            mStep.fetch_add(1, std::memory_order_relaxed);
+            if (mpCheckpointer) mpCheckpointer->offer(mGridCells, checkpointState());
+        }
+    }
+
+    CheckpointState checkpointState()
+    {
+        return CheckpointState{static_cast<int32_t>(mSceneIdx), mStep, mTime, mSimulator.timeStep(),
+                               mVecScene[mSceneIdx]->rngState(), mVecScene[mSceneIdx]->rngSeed()};
+    }
+
+    GridCellsType mGridCells; // constructed before the simulator and window that reference it
     SimType mSimulator;
-    GridCellsType mGridCells;
     std::vector<SceneBase<GridCellsType>*> mVecScene;
     WinDensityType mWinDensity;
+    std::unique_ptr<FrameRecorder> mpRecorder;
+    std::unique_ptr<Checkpointer> mpCheckpointer;
+    std::unique_ptr<Telemetry> mpTelemetry; // written by both threads, see Telemetry
+    // owned by the simulation thread while run() is active
+    std::atomic<uint64_t> mStep{}; // also read by the main thread for the steps/s
+    float mTime{};
+    size_t mSceneIdx{};
+    std::atomic<bool> mStopSim{false};
 };
 
-int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[])
+int main(int argc, char *argv[])
 {
-    StableFluids* sf = new StableFluids();
+    RecorderOptions recorder{};
+    CheckpointOptions checkpoint{};
+    ObstacleOptions obstacles{};
+    TelemetryOptions telemetry{};
+    uint64_t seed{1};
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--seed") && i+1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 0);
+        } else if (!strcmp(argv[i], "--telemetry-overlay")) {
+            telemetry.overlay = true;
+        } else if (!recorder.parseArg(argc, argv, i) && !checkpoint.parseArg(argc, argv, i) &&
+                   !telemetry.parseArg(argc, argv, i) && !obstacles.parseArg(argc, argv, i)) {
+            std::cerr << "usage: " << argv[0] << " [--seed N]" << RecorderOptions::USAGE << CheckpointOptions::USAGE
+                      << TelemetryOptions::USAGE << " [--telemetry-overlay]" << ObstacleOptions::USAGE << std::endl;
+            return 1;
+        }
+    }
+
+    StableFluids* sf = new StableFluids(recorder, checkpoint, obstacles, telemetry, seed);
     sf->run();
     delete sf;
 
@@ -0,0 +1,242 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+#include "threadPool.h"
+
+
+// Geometric multigrid for the pressure equation of the projection on a cell centred grid with solid
+// cells. For every fluid cell c with n fluid neighbours it solves
+//     n q_c - (sum of q over the fluid neighbours) = b_c,
+// the 5 point Laplacian scaled by -h^2 with zero normal gradient across solid faces. The grid is
+// halved until it is a few cells across, a coarse cell being fluid if any of its 2x2 children is.
+// A V-cycle smooths with red-black Gauss-Seidel, restricts the residual by summing the children
+// (the coarse equation is the same stencil at twice the spacing) and adds the coarse correction
+// back piecewise constant. Each level costs O(cells), so a cycle is O(N).
+class MultigridPoisson
+{
+    // cells are stored with a solid one cell border, so stencils need no bounds checks
+    struct Level
+    {
+        int32_t width{}, height{};
+        std::vector<float> q, b, r;
+        std::vector<float> count; // fluid neighbours of a fluid cell, 0 for solid cells
+        std::vector<float> inv;   // 1 / count, 0 where count is 0
+
+        int32_t stride() const { return width + 2; }
+        int32_t at(const int32_t i, const int32_t j) const { return (i + 1) + stride() * (j + 1); }
+    };
+
+    static constexpr int PRE_SWEEPS{2};
+    static constexpr int POST_SWEEPS{2};
+    static constexpr int32_t COARSEST{4};       // stop halving once a side is this short
+    static constexpr int32_t SERIAL_CELLS{1 << 14}; // smaller levels are not worth splitting over the pool
+
+public:
+    MultigridPoisson(const int32_t width, const int32_t height)
+    {
+        int32_t w = width, h = height;
+        while (true) {
+            Level& level = mLevels.emplace_back();
+            level.width = w;
+            level.height = h;
+            const size_t n = static_cast<size_t>(w + 2) * (h + 2);
+            level.q.assign(n, 0.0f);
+            level.b.assign(n, 0.0f);
+            level.r.assign(n, 0.0f);
+            level.count.assign(n, 0.0f);
+            level.inv.assign(n, 0.0f);
+            if (std::min(w, h) <= COARSEST) break;
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+    }
+
+    // solid holds width x height flags row by row, nonzero marks a solid cell
+    void setSolid(const std::vector<uint8_t>& solid)
+    {
+        Level& fine = mLevels.front();
+        if (solid.size() != static_cast<size_t>(fine.width) * fine.height) {
+            throw std::invalid_argument("solid mask does not match the multigrid size");
+        }
+        std::vector<uint8_t> fluid(solid.size());
+        for (size_t c = 0; c < solid.size(); ++c) fluid[c] = !solid[c];
+
+        for (size_t l = 0; l < mLevels.size(); ++l) {
+            Level& level = mLevels[l];
+            if (l > 0) {
+                // a coarse cell is fluid if any of its children is
+                const Level& finer = mLevels[l-1];
+                std::vector<uint8_t> coarse(static_cast<size_t>(level.width) * level.height);
+                for (int32_t j = 0; j < finer.height; ++j) {
+                    for (int32_t i = 0; i < finer.width; ++i) {
+                        coarse[i/2 + level.width * (j/2)] |= fluid[i + finer.width * j];
+                    }
+                }
+                fluid.swap(coarse);
+            }
+            auto isFluid = [&](const int32_t i, const int32_t j) {
+                return i >= 0 && j >= 0 && i < level.width && j < level.height && fluid[i + level.width * j];
+            };
+            for (int32_t j = 0; j < level.height; ++j) {
+                for (int32_t i = 0; i < level.width; ++i) {
+                    const int32_t c = level.at(i, j);
+                    const float n = isFluid(i, j) ? isFluid(i-1, j) + isFluid(i+1, j) + isFluid(i, j-1) + isFluid(i, j+1) : 0;
+                    level.count[c] = n;
+                    level.inv[c] = n > 0 ? 1.0f / n : 0.0f;
+                    level.q[c] = 0.0f;
+                }
+            }
+        }
+    }
+
+    // The finest level: fill rhs() at at(i, j) for the fluid cells, solve() leaves q in pressure().
+    // The previous solution is the initial guess, which saves cycles when the flow changes slowly.
+    int32_t at(const int32_t i, const int32_t j) const { return mLevels.front().at(i, j); }
+    bool fluid(const int32_t i, const int32_t j) const { return mLevels.front().count[at(i, j)] > 0; }
+    float* rhs() { return mLevels.front().b.data(); }
+    const float* pressure() const { return mLevels.front().q.data(); }
+
+    // Runs V-cycles until the largest residual is at most tolerance times the largest right hand side
+    // value, or maxCycles of them. Returns the number of cycles run. Since only pressure gradients
+    // matter, the mean of the right hand side is removed first so that the singular system has a solution.
+    int solve(ThreadPool& pool, const int maxCycles, const float tolerance)
+    {
+        Level& fine = mLevels.front();
+        removeMean(fine);
+        float bMax{};
+        for (const float v : fine.b) bMax = std::max(bMax, std::abs(v));
+        if (bMax == 0.0f) {
+            std::fill(fine.q.begin(), fine.q.end(), 0.0f);
+            mResidual = 0.0f;
+            return 0;
+        }
+
+        int cycles = 0;
+        while (cycles < maxCycles) {
+            vCycle(pool, 0);
+            ++cycles;
+            if (tolerance > 0.0f && residual(pool, fine) <= tolerance * bMax) break;
+        }
+        mResidual = residual(pool, fine) / bMax;
+        return cycles;
+    }
+
+    // largest residual after the last solve(), relative to the largest right hand side value
+    float relativeResidual() const { return mResidual; }
+    int levels() const { return mLevels.size(); }
+
+private:
+    void vCycle(ThreadPool& pool, const size_t l)
+    {
+        Level& level = mLevels[l];
+        if (l + 1 == mLevels.size()) {
+            // a few cells across: relax until the error has spread over the whole level
+            for (int k = 0; k < 2 * (level.width + level.height); ++k) smooth(pool, level);
+            return;
+        }
+
+        for (int k = 0; k < PRE_SWEEPS; ++k) smooth(pool, level);
+        residual(pool, level);
+
+        Level& coarse = mLevels[l+1];
+        const int32_t S = level.stride();
+        forRows(pool, coarse, [&](const int32_t jBegin, const int32_t jEnd) {
+            for (int32_t j = jBegin; j < jEnd; ++j) {
+                for (int32_t i = 0; i < coarse.width; ++i) {
+                    // children past an odd edge lie in the border, whose residual is 0
+                    const float* r = &level.r[level.at(2*i, 2*j)];
+                    coarse.b[coarse.at(i, j)] = r[0] + r[1] + r[S] + r[S+1];
+                }
+            }
+        });
+        std::fill(coarse.q.begin(), coarse.q.end(), 0.0f);
+        vCycle(pool, l + 1);
+
+        forRows(pool, level, [&](const int32_t jBegin, const int32_t jEnd) {
+            for (int32_t j = jBegin; j < jEnd; ++j) {
+                const float* qc = &coarse.q[coarse.at(0, j/2)];
+                for (int32_t i = 0; i < level.width; ++i) {
+                    const int32_t c = level.at(i, j);
+                    if (level.count[c] > 0) level.q[c] += qc[i/2];
+                }
+            }
+        });
+
+        for (int k = 0; k < POST_SWEEPS; ++k) smooth(pool, level);
+    }
+
+    // one red-black Gauss-Seidel sweep; solid cells have inv = 0 and stay at q = 0
+    void smooth(ThreadPool& pool, Level& level)
+    {
+        const int32_t S = level.stride();
+        for (int colour = 0; colour < 2; ++colour) {
+            forRows(pool, level, [&](const int32_t jBegin, const int32_t jEnd) {
+                for (int32_t j = jBegin; j < jEnd; ++j) {
+                    for (int32_t i = (j + colour) & 1; i < level.width; i += 2) {
+                        const int32_t c = level.at(i, j);
+                        const float* q = level.q.data();
+                        level.q[c] = (level.b[c] + q[c-1] + q[c+1] + q[c-S] + q[c+S]) * level.inv[c];
+                    }
+                }
+            });
+        }
+    }
+
+    // stores the residual of every fluid cell in r and returns its largest magnitude
+    float residual(ThreadPool& pool, Level& level)
+    {
+        const int32_t S = level.stride();
+        mRowResidual.assign(level.height, 0.0f);
+        forRows(pool, level, [&](const int32_t jBegin, const int32_t jEnd) {
+            for (int32_t j = jBegin; j < jEnd; ++j) {
+                float rowMax{};
+                for (int32_t i = 0; i < level.width; ++i) {
+                    const int32_t c = level.at(i, j);
+                    const float* q = level.q.data();
+                    const float r = level.count[c] > 0 ?
+                        level.b[c] + q[c-1] + q[c+1] + q[c-S] + q[c+S] - level.count[c] * q[c] : 0.0f;
+                    level.r[c] = r;
+                    rowMax = std::max(rowMax, std::abs(r));
+                }
+                mRowResidual[j] = rowMax;
+            }
+        });
+        return *std::max_element(mRowResidual.begin(), mRowResidual.end());
+    }
+
+    // Shifts b on the fluid cells to sum to zero. Exact for a single connected fluid region; a
+    // pocket enclosed by solids keeps any imbalance of its own, which the smoother then spreads.
+    static void removeMean(Level& level)
+    {
+        double sum{}, fluidCells{};
+        for (size_t c = 0; c < level.b.size(); ++c) {
+            if (level.count[c] > 0) {
+                sum += level.b[c];
+                ++fluidCells;
+            } else {
+                level.b[c] = 0.0f;
+            }
+        }
+        if (fluidCells == 0) return;
+        const float mean = sum / fluidCells;
+        for (size_t c = 0; c < level.b.size(); ++c) {
+            if (level.count[c] > 0) level.b[c] -= mean;
+        }
+    }
+
+    static void forRows(ThreadPool& pool, const Level& level, auto&& fn)
+    {
+        if (static_cast<int64_t>(level.width) * level.height < SERIAL_CELLS) {
+            fn(0, level.height);
+        } else {
+            pool.parallelFor(0, level.height, fn);
+        }
+    }
+
+    std::vector<Level> mLevels;
+    std::vector<float> mRowResidual;
+    float mResidual{};
+};
@@ -0,0 +1,367 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "utils.h"
+
+
+// Solid cells of a grid, the outer frame always among them. The solver only visits the cells that
+// border the fluid, through lists compiled per TILE x TILE block of the mask; edits mark their
+// blocks dirty and compile() rebuilds just those.
+class ObstacleMask
+{
+public:
+    static constexpr int32_t TILE{32};
+
+    // Side of the fluid neighbour a boundary cell copies: +x, -x, +y, -y
+    enum Side { PLUS_X, MINUS_X, PLUS_Y, MINUS_Y, SIDES };
+
+    // A solid cell with two to four fluid neighbours takes their mean; sources on the x axis come first
+    struct MultiBoundary
+    {
+        int32_t cell{};
+        std::array<int32_t, 4> source{};
+        uint8_t count{};
+        uint8_t xSources{};
+    };
+
+    // The cells of one block, as field positions. A solid cell with one fluid neighbour copies it,
+    // density as it is and velocity mirrored across the face between them.
+    struct TileBoundary
+    {
+        std::array<std::vector<int32_t>, SIDES> cell;
+        std::array<std::vector<int32_t>, SIDES> source;
+        std::vector<MultiBoundary> multi;
+        std::vector<int32_t> interior; // solid cells without fluid neighbours, held at zero
+    };
+
+    // A corner of the frame, set to the mean of its two frame neighbours once those are set
+    struct FrameCorner
+    {
+        int32_t cell{}, a{}, b{};
+    };
+
+    ObstacleMask(const int32_t width, const int32_t height) :
+        mWidth{width}, mHeight{height}, mTilesX{(width + TILE - 1) / TILE}, mTilesY{(height + TILE - 1) / TILE},
+        mSolid(static_cast<size_t>(width) * height), mRowSolids(height),
+        mTiles(static_cast<size_t>(mTilesX) * mTilesY), mDirty(mTiles.size(), 1), mDirtyCount(mTiles.size())
+    {
+        for (int32_t i = 0; i < width; ++i) mSolid[i] = mSolid[i + width * (height-1)] = 1;
+        for (int32_t j = 0; j < height; ++j) mSolid[width * j] = mSolid[width-1 + width * j] = 1;
+        mRowSolids.front() = mRowSolids.back() = width - 2;
+    }
+
+    int32_t width() const { return mWidth; }
+    int32_t height() const { return mHeight; }
+    bool solid(const int32_t i, const int32_t j) const { return mSolid[i + mWidth * j]; }
+    const std::vector<uint8_t>& solid() const { return mSolid; } // row by row, nonzero is solid
+    int64_t interiorSolids() const { return mInteriorSolids; }  // solid cells besides the frame
+
+    // Frame cells stay solid, out of range cells are ignored
+    void set(const int32_t i, const int32_t j, const bool solid)
+    {
+        if (i <= 0 || j <= 0 || i >= mWidth-1 || j >= mHeight-1 || this->solid(i, j) == solid) return;
+        mSolid[i + mWidth * j] = solid;
+        mRowSolids[j] += solid ? 1 : -1;
+        mInteriorSolids += solid ? 1 : -1;
+        // the neighbours' lists depend on this cell too
+        markDirty(i, j);
+        markDirty(i-1, j);
+        markDirty(i+1, j);
+        markDirty(i, j-1);
+        markDirty(i, j+1);
+    }
+
+    void paintDisc(const int32_t x, const int32_t y, const int32_t radius, const bool solid)
+    {
+        for (int32_t j = y - radius; j <= y + radius; ++j) {
+            for (int32_t i = x - radius; i <= x + radius; ++i) {
+                if ((i - x) * (i - x) + (j - y) * (j - y) <= radius * radius) set(i, j, solid);
+            }
+        }
+    }
+
+    bool dirty() const { return mDirtyCount > 0; }
+
+    // Rebuilds the lists of the blocks edited since the last call, returns false if there were none
+    template<typename Index>
+    bool compile(const Index& index)
+    {
+        if (!mDirtyCount) return false;
+        for (int32_t ty = 0; ty < mTilesY; ++ty) {
+            for (int32_t tx = 0; tx < mTilesX; ++tx) {
+                if (mDirty[tx + mTilesX * ty]) compileTile(index, tx, ty);
+            }
+        }
+        std::fill(mDirty.begin(), mDirty.end(), 0);
+        mDirtyCount = 0;
+
+        const int32_t W = mWidth, H = mHeight;
+        mCorners = {FrameCorner{index(0, 0), index(1, 0), index(0, 1)},
+                    FrameCorner{index(0, H-1), index(1, H-1), index(0, H-2)},
+                    FrameCorner{index(W-1, 0), index(W-2, 0), index(W-1, 1)},
+                    FrameCorner{index(W-1, H-1), index(W-2, H-1), index(W-1, H-2)}};
+        return true;
+    }
+
+    const std::vector<TileBoundary>& tiles() const { return mTiles; }
+    const std::array<FrameCorner, 4>& corners() const { return mCorners; }
+
+    // Calls fn(j, i0, i1) for the runs of fluid cells within [iBegin, iEnd) of row j
+    void forFluidRuns(const int32_t j, const int32_t iBegin, const int32_t iEnd, auto&& fn) const
+    {
+        if (!mRowSolids[j]) {
+            fn(j, iBegin, iEnd);
+            return;
+        }
+        const uint8_t* row = &mSolid[static_cast<size_t>(mWidth) * j];
+        for (int32_t i = iBegin; i < iEnd;) {
+            while (i < iEnd && row[i]) ++i;
+            int32_t end = i;
+            while (end < iEnd && !row[end]) ++end;
+            if (end > i) fn(j, i, end);
+            i = end;
+        }
+    }
+
+    // The rules below apply to fields indexed like the last compile().
+    // Solid cells next to the fluid copy their fluid neighbour, or the mean of several.
+    void setDensityBoundary(auto& field) const
+    {
+        for (const auto& tile : mTiles) {
+            for (int side = 0; side < SIDES; ++side) {
+                const int32_t* cell = tile.cell[side].data();
+                const int32_t* source = tile.source[side].data();
+                for (size_t k = 0; k < tile.cell[side].size(); ++k) field[cell[k]] = field[source[k]];
+            }
+            for (const auto& b : tile.multi) {
+                Density sum = field[b.source[0]];
+                for (int s = 1; s < b.count; ++s) sum += field[b.source[s]];
+                field[b.cell] = sum * (1.0f / b.count);
+            }
+        }
+        for (const auto& c : mCorners) field[c.cell] = (field[c.a] + field[c.b]) * 0.5;
+    }
+
+    // Like setDensityBoundary, but the velocity is mirrored across the face to the fluid neighbour,
+    // so the flow normal to the wall cancels between the two cells
+    void setVelocityBoundary(auto& field) const
+    {
+        for (const auto& tile : mTiles) {
+            for (int side = 0; side < SIDES; ++side) {
+                const int32_t* cell = tile.cell[side].data();
+                const int32_t* source = tile.source[side].data();
+                const bool xSide = side <= MINUS_X;
+                for (size_t k = 0; k < tile.cell[side].size(); ++k) {
+                    const XYPair v = field[source[k]];
+                    field[cell[k]] = xSide ? XYPair{-v.x, v.y} : XYPair{v.x, -v.y};
+                }
+            }
+            for (const auto& b : tile.multi) {
+                XYPair sum{};
+                for (int s = 0; s < b.count; ++s) {
+                    const XYPair v = field[b.source[s]];
+                    sum += s < b.xSources ? XYPair{-v.x, v.y} : XYPair{v.x, -v.y};
+                }
+                field[b.cell] = sum * (1.0f / b.count);
+            }
+        }
+        for (const auto& c : mCorners) field[c.cell] = (field[c.a] + field[c.b]) * 0.5;
+    }
+
+    // The solid cells next to the fluid, corners included, from source
+    void copyBoundary(auto& field, const auto& source) const
+    {
+        for (const auto& tile : mTiles) {
+            for (const auto& cells : tile.cell) {
+                for (const int32_t c : cells) field[c] = source[c];
+            }
+            for (const auto& b : tile.multi) field[b.cell] = source[b.cell];
+        }
+        for (const auto& c : mCorners) field[c.cell] = source[c.cell];
+    }
+
+    // Solid cells away from the fluid are zero in every field
+    void clearSolids(auto& field, const auto zero) const
+    {
+        if (!mInteriorSolids) return;
+        for (const auto& tile : mTiles) {
+            for (const int32_t c : tile.interior) field[c] = zero;
+        }
+    }
+
+private:
+    void markDirty(const int32_t i, const int32_t j)
+    {
+        if (i < 0 || j < 0 || i >= mWidth || j >= mHeight) return;
+        uint8_t& dirty = mDirty[i / TILE + mTilesX * (j / TILE)];
+        mDirtyCount += !dirty;
+        dirty = 1;
+    }
+
+    template<typename Index>
+    void compileTile(const Index& index, const int32_t tx, const int32_t ty)
+    {
+        TileBoundary& tile = mTiles[tx + mTilesX * ty];
+        for (auto& list : tile.cell) list.clear();
+        for (auto& list : tile.source) list.clear();
+        tile.multi.clear();
+        tile.interior.clear();
+
+        auto fluid = [&](const int32_t i, const int32_t j) {
+            return i >= 0 && j >= 0 && i < mWidth && j < mHeight && !solid(i, j);
+        };
+        auto frameCorner = [&](const int32_t i, const int32_t j) {
+            return (i == 0 || i == mWidth-1) && (j == 0 || j == mHeight-1);
+        };
+        constexpr int32_t DI[SIDES]{1, -1, 0, 0};
+        constexpr int32_t DJ[SIDES]{0, 0, 1, -1};
+
+        for (int32_t j = ty * TILE; j < std::min(mHeight, (ty + 1) * TILE); ++j) {
+            for (int32_t i = tx * TILE; i < std::min(mWidth, (tx + 1) * TILE); ++i) {
+                if (!solid(i, j) || frameCorner(i, j)) continue;
+                MultiBoundary b{index(i, j)};
+                int fluidSide{};
+                for (int side = 0; side < SIDES; ++side) {
+                    if (!fluid(i + DI[side], j + DJ[side])) continue;
+                    b.source[b.count++] = index(i + DI[side], j + DJ[side]);
+                    b.xSources += side <= MINUS_X;
+                    fluidSide = side;
+                }
+                if (b.count == 0) {
+                    tile.interior.push_back(b.cell);
+                } else if (b.count == 1) {
+                    tile.cell[fluidSide].push_back(b.cell);
+                    tile.source[fluidSide].push_back(b.source[0]);
+                } else {
+                    tile.multi.push_back(b);
+                }
+            }
+        }
+    }
+
+    int32_t mWidth, mHeight;
+    int32_t mTilesX, mTilesY;
+    std::vector<uint8_t> mSolid;
+    std::vector<int32_t> mRowSolids; // solid cells of each row between the frame columns
+    int64_t mInteriorSolids{};
+    std::vector<TileBoundary> mTiles;
+    std::vector<uint8_t> mDirty;
+    int32_t mDirtyCount;
+    std::array<FrameCorner, 4> mCorners{};
+};
+
+
+// Obstacles given on the command line, painted into a mask at startup
+struct ObstacleOptions
+{
+    struct Disc
+    {
+        int32_t x{}, y{}, radius{};
+    };
+
+    std::string imagePath{}; // PBM or PGM image, dark pixels are solid; it is scaled to the grid
+    std::vector<Disc> discs{};
+
+    // Consumes an --obstacle* option at argv[i], returns false if argv[i] is not one
+    bool parseArg(const int argc, char* argv[], int& i)
+    {
+        if (Disc d; !strcmp(argv[i], "--obstacle") && i+1 < argc &&
+                    sscanf(argv[i+1], "%d,%d,%d", &d.x, &d.y, &d.radius) == 3) {
+            discs.push_back(d);
+            ++i;
+        } else if (!strcmp(argv[i], "--obstacles") && i+1 < argc) {
+            imagePath = argv[++i];
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static constexpr const char* USAGE{" [--obstacles IMAGE.pbm|pgm] [--obstacle X,Y,R]..."};
+
+    void apply(ObstacleMask& mask) const
+    {
+        if (!imagePath.empty()) loadObstacleImage(imagePath, mask);
+        for (const Disc& d : discs) mask.paintDisc(d.x, d.y, d.radius, true);
+    }
+
+    // Binary or plain PBM (P1, P4) and PGM (P2, P5). Image row 0 is grid row 0, the top of the window.
+    static void loadObstacleImage(const std::string& path, ObstacleMask& mask)
+    {
+        FILE* pFile = fopen(path.c_str(), "rb");
+        if (!pFile) {
+            throw std::runtime_error("cannot open obstacle image " + path);
+        }
+        auto fail = [&](const std::string& what) {
+            fclose(pFile);
+            throw std::runtime_error("obstacle image " + path + ": " + what);
+        };
+        // the next character that is neither whitespace nor in a comment
+        auto next = [&]() {
+            int c = fgetc(pFile);
+            while (c == '#' || isspace(c)) {
+                if (c == '#') while (c != '\n' && c != EOF) c = fgetc(pFile);
+                c = fgetc(pFile);
+            }
+            return c;
+        };
+        // header numbers and plain PGM samples
+        auto number = [&]() {
+            int c = next();
+            int value = 0;
+            if (!isdigit(c)) fail("malformed header");
+            for (; isdigit(c); c = fgetc(pFile)) value = value * 10 + (c - '0');
+            return value; // consumes the single whitespace after it
+        };
+
+        char magic[2]{};
+        if (fread(magic, 1, 2, pFile) != 2 || magic[0] != 'P' || !strchr("1245", magic[1])) fail("not a PBM or PGM file");
+        const bool bitmap = magic[1] == '1' || magic[1] == '4';
+        const bool binary = magic[1] == '4' || magic[1] == '5';
+        const int width = number(), height = number();
+        const int maxValue = bitmap ? 1 : number();
+        if (width <= 0 || height <= 0 || maxValue <= 0 || maxValue > 255) fail("unsupported size or depth");
+
+        // solid flags of the image, 1 is black in PBM and below half the maximum is dark in PGM
+        std::vector<uint8_t> pixels(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; ++y) {
+            if (bitmap && binary) {
+                std::vector<uint8_t> row((width + 7) / 8);
+                if (fread(row.data(), 1, row.size(), pFile) != row.size()) fail("truncated");
+                for (int x = 0; x < width; ++x) pixels[x + width * y] = row[x / 8] >> (7 - x % 8) & 1;
+            } else if (binary) {
+                std::vector<uint8_t> row(width);
+                if (fread(row.data(), 1, row.size(), pFile) != row.size()) fail("truncated");
+                for (int x = 0; x < width; ++x) pixels[x + width * y] = 2 * row[x] < maxValue;
+            } else if (bitmap) {
+                // plain PBM pixels are single characters and need not be separated, e.g. "0110"
+                for (int x = 0; x < width; ++x) {
+                    const int c = next();
+                    if (c == EOF) fail("truncated");
+                    if (c != '0' && c != '1') fail("malformed bitmap");
+                    pixels[x + width * y] = c == '1';
+                }
+            } else {
+                for (int x = 0; x < width; ++x) pixels[x + width * y] = 2 * number() < maxValue;
+            }
+        }
+        fclose(pFile);
+
+        // nearest pixel of each cell centre
+        for (int32_t j = 0; j < mask.height(); ++j) {
+            const int y = static_cast<int>((j + 0.5) * height / mask.height());
+            for (int32_t i = 0; i < mask.width(); ++i) {
+                const int x = static_cast<int>((i + 0.5) * width / mask.width());
+                if (pixels[x + width * y]) mask.set(i, j, true);
+            }
+        }
+    }
+};
@@ -0,0 +1,175 @@
+#pragma once
+#include "src/advectKernels.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+
+// A Gaussian blob of density and velocity centred on cell (x, y), covering width/2 and height/2
+// cells to either side. r, g, b and u, v are the amounts added at the centre.
+struct GaussianStamp
+{
+    int32_t x{}, y{};
+    int32_t width{}, height{};
+    float r{}, g{}, b{};
+    float u{}, v{};
+};
+
+// dst[k] = min(1, dst[k] + wy * add[k]) for density, dst[k] += wy * add[k] for velocity
+inline void splatRow(float* dst, const float* add, const float wy, const int n, const bool saturate)
+{
+    if (saturate) {
+        for (int k = 0; k < n; ++k) dst[k] = std::min(1.0f, dst[k] + wy * add[k]);
+    } else {
+        for (int k = 0; k < n; ++k) dst[k] += wy * add[k];
+    }
+}
+
+#ifdef SF_HAVE_AVX2
+// Same as splatRow 8 floats at a time, without FMA so that it rounds like the scalar loop
+__attribute__((target("avx2")))
+inline void splatRowAvx2(float* dst, const float* add, const float wy, const int n, const bool saturate)
+{
+    const __m256 w = _mm256_set1_ps(wy);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m256 sum = _mm256_add_ps(_mm256_loadu_ps(dst + k), _mm256_mul_ps(w, _mm256_loadu_ps(add + k)));
+        if (saturate) sum = _mm256_min_ps(sum, one);
+        _mm256_storeu_ps(dst + k, sum);
+    }
+    splatRow(dst + k, add + k, wy, n - k, saturate);
+}
+#endif
+
+inline void splatRow(float* dst, const float* add, const float wy, const int n, const bool saturate, const bool simd)
+{
+#ifdef SF_HAVE_AVX2
+    if (simd && cpuHasAvx2()) return splatRowAvx2(dst, add, wy, n, saturate);
+#endif
+    splatRow(dst, add, wy, n, saturate);
+}
+
+
+// Adds batches of Gaussian stamps to a grid. The weight exp(-alpha (di^2 + dj^2)) is separable, so a
+// stamp is a column table times a row of colour (or velocity) times row weights, the tables cached
+// per stamp extent. Each stamp is clipped to the grid once, and all stamps of a batch are splatted in
+// one pass over the rows, in the order they were added, so overlapping stamps saturate as if they
+// had been added one after the other.
+class GaussianEmitter
+{
+public:
+    void add(const GaussianStamp& stamp) { mStamps.push_back(stamp); }
+
+    // Adds and clears the batch. alpha only depends on the grid size.
+    template<typename GridCellsType>
+    void splat(GridCellsType& gc, const bool simd = true)
+    {
+        using IndexType = typename GridCellsType::IndexType;
+        constexpr bool SOA = GridCellsType::LayoutType::SOA;
+        const int32_t W = gc.width(), H = gc.height();
+        const float alpha = -std::log(0.5) / (W * H / 2000.0);
+        if (alpha != mAlpha) {
+            mWeights.clear();
+            mAlpha = alpha;
+        }
+
+        // the clipped rectangle of each stamp and its colour and velocity times the column weights,
+        // interleaved like AoS cells or as one run per channel for SoA
+        size_t count = 0;
+        int32_t jFirst = H, jLast = -1;
+        for (const GaussianStamp& s : mStamps) {
+            const int32_t hx = s.width / 2, hy = s.height / 2;
+            const int32_t i0 = std::max(0, s.x - hx), i1 = std::min(W - 1, s.x + hx);
+            const int32_t j0 = std::max(0, s.y - hy), j1 = std::min(H - 1, s.y + hy);
+            if (i0 > i1 || j0 > j1) continue;
+
+            if (count == mClipped.size()) mClipped.emplace_back();
+            Clipped& c = mClipped[count++];
+            c.i0 = i0;
+            c.i1 = i1;
+            c.j0 = j0;
+            c.j1 = j1;
+            c.rowWeight = weights(hy).data();
+            c.rowOffset = hy - s.y;
+
+            const int32_t n = i1 - i0 + 1;
+            const float* wx = weights(hx).data();
+            const float den[3]{s.r, s.g, s.b}, vel[2]{s.u, s.v};
+            c.density.resize(3 * n);
+            c.velocity.resize(2 * n);
+            for (int32_t k = 0; k < n; ++k) {
+                const float w = wx[i0 + k + hx - s.x];
+                for (int ch = 0; ch < 3; ++ch) c.density[SOA ? ch * n + k : 3 * k + ch] = den[ch] * w;
+                for (int ch = 0; ch < 2; ++ch) c.velocity[SOA ? ch * n + k : 2 * k + ch] = vel[ch] * w;
+            }
+            jFirst = std::min(jFirst, j0);
+            jLast = std::max(jLast, j1);
+        }
+        mStamps.clear();
+
+        for (int32_t j = jFirst; j <= jLast; ++j) {
+            for (size_t s = 0; s < count; ++s) {
+                const Clipped& c = mClipped[s];
+                if (j < c.j0 || j > c.j1) continue;
+                const float wy = c.rowWeight[j + c.rowOffset];
+                const int32_t n = c.i1 - c.i0 + 1;
+                // cells of the row adjacent in memory
+                for (int32_t i = c.i0; i <= c.i1;) {
+                    const int32_t end = IndexType::ROW_CONTIGUOUS ?
+                        c.i1 + 1 : std::min(c.i1 + 1, (i / IndexType::ROW_BLOCK + 1) * IndexType::ROW_BLOCK);
+                    const int32_t k = i - c.i0, len = end - i, idx = gc.pos(i, j);
+                    if constexpr (SOA) {
+                        for (int ch = 0; ch < 3; ++ch) {
+                            splatRow(gc.density.plane(ch) + idx, &c.density[ch * n + k], wy, len, true, simd);
+                        }
+                        for (int ch = 0; ch < 2; ++ch) {
+                            splatRow(gc.velocity.plane(ch) + idx, &c.velocity[ch * n + k], wy, len, false, simd);
+                        }
+                    } else if constexpr (GridCellsType::LayoutType::PACKED) {
+                        // splatted on the run widened to floats, then narrowed back
+                        mRow.resize(3 * len);
+                        gc.density.widen(idx, len, mRow.data(), simd);
+                        splatRow(mRow.data(), &c.density[3 * k], wy, 3 * len, true, simd);
+                        gc.density.narrow(idx, len, mRow.data(), simd);
+                        gc.velocity.widen(idx, len, mRow.data(), simd);
+                        splatRow(mRow.data(), &c.velocity[2 * k], wy, 2 * len, false, simd);
+                        gc.velocity.narrow(idx, len, mRow.data(), simd);
+                    } else {
+                        splatRow(&gc.density[idx].r, &c.density[3 * k], wy, 3 * len, true, simd);
+                        splatRow(&gc.velocity[idx].x, &c.velocity[2 * k], wy, 2 * len, false, simd);
+                    }
+                    i = end;
+                }
+            }
+        }
+    }
+
+private:
+    struct Clipped
+    {
+        int32_t i0{}, i1{}, j0{}, j1{}; // inclusive
+        const float* rowWeight{};       // at j + rowOffset
+        int32_t rowOffset{};
+        std::vector<float> density, velocity;
+    };
+
+    // exp(-alpha d^2) for d = -half..half
+    const std::vector<float>& weights(const int32_t half)
+    {
+        std::vector<float>& w = mWeights[half];
+        if (w.empty()) {
+            w.resize(2 * half + 1);
+            for (int32_t d = -half; d <= half; ++d) w[d + half] = std::exp(-mAlpha * (d * d));
+        }
+        return w;
+    }
+
+    std::vector<GaussianStamp> mStamps;
+    std::vector<Clipped> mClipped;
+    std::vector<float> mRow; // a run of a packed field as floats
+    std::map<int32_t, std::vector<float>> mWeights;
+    float mAlpha{};
+};
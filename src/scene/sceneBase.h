@@ -1,6 +1,9 @@
 #pragma once
+#include "src/counterRng.h"
+#include "src/scene/gaussianEmitter.h"
 #include "src/utils.h"
 #include <stdint.h>
+#include <vector>
 
 
 struct SceneParams
@@ -9,13 +12,12 @@ struct SceneParams
     float gravity{};
     float densityTrans{};
     float diffusion{};
+    bool spectralDiffusion{false}; // diffuse density exactly in frequency space instead of by relaxation
 };
 
 template<typename GridCellsType>
 class SceneBase
 {
-    auto POS(auto x, auto y) { return GridCellsType::POS(x,y); }
-    static constexpr uint16_t GRID_SIZE = GridCellsType::GRID_SIZE;
 public:
     SceneBase(GridCellsType& gc) : mGridCells(gc) {}
     virtual ~SceneBase() {};
@@ -24,32 +26,56 @@ public:
                                                            9.81, // gravity
                                                            0.9999f, // density
                                                            0.0f};} // diffusion
+
+    // Seed of the source randomness, from the configuration so that runs are reproducible
+    uint64_t rngSeed() const { return mRng.seed(); }
+    void setRngSeed(const uint64_t seed) { mRng.setSeed(seed); }
+
+    // Steps that drew random values so far, which with the seed lets a checkpoint resume the same sequence
+    uint64_t rngState() const { return mRngStep; }
+    void setRngState(const uint64_t state) { mRngStep = state; }
+
 protected:
-    std::pair<Density, XYPair> getFireSource()
+    // Independent sequences for the different uses of a cell's random words
+    enum class RngStream : uint32_t { FireSource, Downdraft, TextSource };
+
+    // The step to key this update's random values with; call once per update() that draws any
+    uint64_t nextRngStep() { return mRngStep++; }
+
+    // Random words of cells 0..n-1 of a stream, word w of cell k at out[w*n + k]
+    void randomBatch(const uint64_t step, const RngStream stream, const int32_t n, std::vector<uint32_t>& out) const
+    {
+        mRng.fill(step, static_cast<uint32_t>(stream), 0, n, out);
+    }
+
+    Philox4x32::Block randomBlock(const uint64_t step, const RngStream stream, const uint32_t cell) const
     {
-        long rVal = (rand() % 2000)+50;
+        return mRng(step, static_cast<uint32_t>(stream), cell);
+    }
+
+    int32_t width() const { return mGridCells.width(); }
+    int32_t height() const { return mGridCells.height(); }
+
+    // A fire cell from two random words: its density, and now and then an upward kick
+    static std::pair<Density, XYPair> getFireSource(const uint32_t r0, const uint32_t r1)
+    {
+        long rVal = (r0 % 2000)+50;
         return {Density(rVal / 150.0f, sqrt(rVal) / 20.0f, 0),
-                XYPair(0, (rand() % 50 == 0) ? -rVal / 10.0f : 0)};
+                XYPair(0, (r1 % 50 == 0) ? -rVal / 10.0f : 0)};
     }
 
+    // Queues a Gaussian stamp; splatGaussians() adds the queued ones in a single pass
     void addGaussian(const int x, const int y, const int width, const int height, const float r, const float g, const float b, const float u, const float v)
     {
-        for(int i=-width/2; i<=width/2; ++i) {
-            for(int j=-height/2; j<=height/2; ++j) {
-                if (i+x>=0 && j+y>=0 && i+x<GRID_SIZE && j+y<GRID_SIZE) {
-                    const  float alpha = -log(0.5)/(GRID_SIZE*GRID_SIZE/2000.0);
-                    const float wgt = exp(-alpha * (i*i + j*j));
-
-                    auto satAdd = [](float& x, const float& y) { x = std::min(1.0f, x+y); };
-
-                    satAdd(mGridCells.density[POS(i+x, j+y)].r, r*wgt);
-                    satAdd(mGridCells.density[POS(i+x, j+y)].g, g*wgt);
-                    satAdd(mGridCells.density[POS(i+x, j+y)].b, b*wgt);
-                    mGridCells.velocity[POS(i+x, j+y)] += XYPair{u, v} * wgt;
-                }
-            }
-        }
+        mEmitter.add(GaussianStamp{x, y, width, height, r, g, b, u, v});
     }
 
+    void splatGaussians() { mEmitter.splat(mGridCells); }
+
     GridCellsType& mGridCells;
+
+private:
+    CounterRng mRng;
+    uint64_t mRngStep{};
+    GaussianEmitter mEmitter;
 };
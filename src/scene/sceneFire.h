@@ -2,14 +2,14 @@
 #include "src/scene/sceneBase.h"
 #include "src/utils.h"
 #include <cmath>
+#include <vector>
 
 
 template<typename GridCellsType>
 class SceneFire : public SceneBase<GridCellsType>
 {
     using baseType = SceneBase<GridCellsType>;
-    auto POS(auto x, auto y) { return GridCellsType::POS(x,y); }
-    static constexpr uint16_t GRID_SIZE = GridCellsType::GRID_SIZE;
+    auto POS(auto x, auto y) { return baseType::mGridCells.pos(x,y); }
 public:
     SceneFire(GridCellsType& gc) : baseType(gc) {}
 
@@ -20,32 +20,38 @@ public:
 
     void update([[maybe_unused]] const float time)
     {
-        for(int x=0; x<GRID_SIZE; ++x) {
-            auto [den, vel] = baseType::getFireSource();
-            baseType::mGridCells.density[POS(x, GRID_SIZE-2)] = den;
-            baseType::mGridCells.velocity[POS(x, GRID_SIZE-5)] = vel;
+        const int W = baseType::width(), H = baseType::height();
+        // words 0 and 1 of column x make its fire source, word 2 decides on a downdraft
+        const uint64_t step = baseType::nextRngStep();
+        baseType::randomBatch(step, baseType::RngStream::FireSource, W, mRandom);
+        for(int x=0; x<W; ++x) {
+            auto [den, vel] = baseType::getFireSource(mRandom[x], mRandom[W + x]);
+            baseType::mGridCells.density[POS(x, H-2)] = den;
+            baseType::mGridCells.velocity[POS(x, H-5)] = vel;
 
-            if (rand() % (1000000/GRID_SIZE) == 0) // rare downdraft
+            if (mRandom[2*W + x] % (1000000/W) == 0) // rare downdraft
             {
                 for(int i = 50; i < 99; ++i)
                 {
-                    baseType::mGridCells.force[POS(x, GRID_SIZE * i / 1000.0f)].y += 1e4;
-                    baseType::mGridCells.force[POS(x, GRID_SIZE * i / 1000.0f)].x += 1e4 * (rand() % 3 - 1);
+                    const uint32_t r = baseType::randomBlock(step, baseType::RngStream::Downdraft, x + W * i)[0];
+                    baseType::mGridCells.force[POS(x, H * i / 1000.0f)].y += 1e4;
+                    baseType::mGridCells.force[POS(x, H * i / 1000.0f)].x += 1e4 * (static_cast<int>(r % 3) - 1);
                 }
             }
         }
 
         constexpr float velWgt = 0.01f;
-        constexpr int size = std::max(1, GRID_SIZE/5);
+        const int size = std::max(1, std::min(W, H)/5);
         struct SourceInfo {
             float xAmp, xOffset, xPhase, xSpeed;
             float yAmp, yOffset, yPhase, ySpeed;
             float r,g,b;
         };
 
+        const float cx = W/2, cy = H/2; // the sources circle around the grid centre
         std::vector<SourceInfo> mSources;
-        mSources.push_back(SourceInfo{GRID_SIZE * 0.4f, GRID_SIZE/2, 0, 10,
-                                      GRID_SIZE * 0.4f, GRID_SIZE/2, 0, 13,
+        mSources.push_back(SourceInfo{W * 0.4f, cx, 0, 10,
+                                      H * 0.4f, cy, 0, 13,
                                       0, 0, 0.05});
 
         for(auto s : mSources) {
@@ -55,7 +61,9 @@ public:
                                   velWgt * cos(time * s.xSpeed + s.xPhase) * s.xAmp,
                                   velWgt * cos(time * s.ySpeed + s.yPhase) * s.yAmp);
         }
+        baseType::splatGaussians();
     }
 
 private:
+    std::vector<uint32_t> mRandom;
 };
@@ -7,8 +7,6 @@ template<typename GridCellsType>
 class SceneMovingSources : public SceneBase<GridCellsType>
 {
     using baseType = SceneBase<GridCellsType>;
-    auto POS(auto x, auto y) { return GridCellsType::POS(x,y); }
-    static constexpr uint16_t GRID_SIZE = GridCellsType::GRID_SIZE;
 public:
     SceneMovingSources(GridCellsType& gc) : baseType(gc) {}
 
@@ -19,8 +17,9 @@ public:
 
     void update(const float time)
     {
+        const int W = baseType::width(), H = baseType::height();
         constexpr float velWgt = 0.01f;
-        constexpr int size = std::max(1, GRID_SIZE/5);
+        const int size = std::max(1, std::min(W, H)/5);
 
         struct SourceInfo {
             float xAmp, xOffset, xPhase, xSpeed;
@@ -28,21 +27,22 @@ public:
             float r,g,b;
         };
 
+        const float cx = W/2, cy = H/2; // the sources circle around the grid centre
         std::vector<SourceInfo> mSources;
-        mSources.push_back(SourceInfo{GRID_SIZE * 0.4f, GRID_SIZE/2, 0, 10,
-                                      GRID_SIZE * 0.4f, GRID_SIZE/2, 0, 13,
+        mSources.push_back(SourceInfo{W * 0.4f, cx, 0, 10,
+                                      H * 0.4f, cy, 0, 13,
                                       0.1, 0, 0});
 
-        mSources.push_back(SourceInfo{GRID_SIZE * 0.4f, GRID_SIZE/2, 0.5, 12,
-                                      GRID_SIZE * 0.4f, GRID_SIZE/2, 0.5, 15,
+        mSources.push_back(SourceInfo{W * 0.4f, cx, 0.5, 12,
+                                      H * 0.4f, cy, 0.5, 15,
                                       0.1, 0.1, 0});
 
-        mSources.push_back(SourceInfo{GRID_SIZE * 0.4f, GRID_SIZE/2, 1, 7,
-                                      GRID_SIZE * 0.4f, GRID_SIZE/2, 1, 5,
+        mSources.push_back(SourceInfo{W * 0.4f, cx, 1, 7,
+                                      H * 0.4f, cy, 1, 5,
                                       0, 0.1, 0});
 
-        mSources.push_back(SourceInfo{GRID_SIZE * 0.4f, GRID_SIZE/2, 2, 11,
-                                      GRID_SIZE * 0.4f, GRID_SIZE/2, 2, 8,
+        mSources.push_back(SourceInfo{W * 0.4f, cx, 2, 11,
+                                      H * 0.4f, cy, 2, 8,
                                       0, 0, 0.1});
 
         for(auto s : mSources) {
@@ -52,6 +52,7 @@ public:
                                   velWgt * cos(time * s.xSpeed + s.xPhase) * s.xAmp,
                                   velWgt * cos(time * s.ySpeed + s.yPhase) * s.yAmp);
         }
+        baseType::splatGaussians();
     }
 
 private:
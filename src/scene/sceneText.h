@@ -1,30 +1,26 @@
 #pragma once
+#include "src/glyphAtlas.h"
 #include "src/scene/sceneBase.h"
-#include <stdexcept>
-#include <ft2build.h>
-#include FT_FREETYPE_H  
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
 
 
 template<typename GridCellsType>
 class SceneText : public SceneBase<GridCellsType>
 {
     using baseType = SceneBase<GridCellsType>;
-    int32_t POS(const int32_t x, const int32_t y) { return GridCellsType::POS(x,y); }
-    static constexpr int16_t GRID_SIZE = GridCellsType::GRID_SIZE;
+    int32_t POS(const int32_t x, const int32_t y) { return baseType::mGridCells.pos(x,y); }
 public:
-    SceneText(GridCellsType& gc) : baseType(gc)
-    {
-        FT_Library ft;
-        if (FT_Init_FreeType(&ft)) {
-            throw std::runtime_error("FREETYPE: Could not init FreeType Library");
-        }
-
-        if (FT_New_Face(ft, "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf", 0, &face)) {
-            throw std::runtime_error("FREETYPE: Failed to load font");
-        }
-    }
+    // Renders the clock's glyphs once at a size fixed by the grid height
+    SceneText(GridCellsType& gc) : baseType(gc),
+        mAtlas("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf", baseType::height() * 0.15f, "0123456789:")
+    {}
 
     constexpr SceneParams getParams() { return SceneParams{0, // viscosity
                                                            -9, // gravity
@@ -33,51 +29,39 @@ public:
 
     void update([[maybe_unused]] const float time)
     {
-        constexpr int16_t bufWidth{GRID_SIZE};
-        constexpr int16_t bufHeight{GRID_SIZE};
-        int8_t buf[bufWidth * bufHeight];
-        memset(buf, 0, bufWidth * bufHeight * sizeof(int8_t));
-        int16_t x{}, fontSize(GRID_SIZE * 0.15f);
+        const int32_t W = baseType::width(), H = baseType::height();
 
         std::time_t ct = std::time(0);
+        std::tm local{};
+        localtime_r(&ct, &local); // scenes of an ensemble update on several threads
         char mbstr[100];
-        int16_t maxHeight{};
-        int16_t slen(strlen(mbstr));
-        if (std::strftime(mbstr, sizeof(mbstr), "%H:%M:%S", std::localtime(&ct))) {
-            for (int16_t i=0; i<slen; ++i) {
-                auto [newX, thisHeight] = copyCharacterToBuffer(mbstr[i], fontSize, x, 0, buf, bufWidth, bufHeight);
-                x = newX;
-                maxHeight = std::max(maxHeight, thisHeight);
-            }
+        const size_t slen = std::strftime(mbstr, sizeof(mbstr), "%H:%M:%S", &local);
+        if (std::string_view(mbstr, slen) != mText) {
+            mText.assign(mbstr, slen);
+            composeText();
         }
 
-        const int16_t gridX = (GRID_SIZE - x)/2;
-        const int16_t gridY = (GRID_SIZE - maxHeight)/2;
-
-        for(int16_t j=0; j < maxHeight; ++j) {
-            for(int16_t i=0; i < x; ++i) {
-                int16_t inIdx = i + bufWidth * j;
-                int8_t val = buf[inIdx];
-                if (val != 0) {
-                    int32_t outIdx = POS(i+gridX, j+gridY);
-                    auto [den, vel] = baseType::getFireSource();
-                    baseType::mGridCells.density[outIdx] += den * static_cast<float>(GRID_SIZE) * 0.00015f;
-                    baseType::mGridCells.velocity[outIdx] += vel * 0.05;
-                }
-            }
+        // keyed by the position in the list of lit cells
+        const int32_t lit = mLitCells.size();
+        baseType::randomBatch(baseType::nextRngStep(), baseType::RngStream::TextSource, lit, mRandom);
+        for (int32_t k = 0; k < lit; ++k) {
+            auto [den, vel] = baseType::getFireSource(mRandom[k], mRandom[lit + k]);
+            baseType::mGridCells.density[mLitCells[k]] += den * static_cast<float>(W) * 0.00015f;
+            baseType::mGridCells.velocity[mLitCells[k]] += vel * 0.05;
         }
 
         constexpr float velWgt = 0.01f;
-        constexpr int16_t size = std::max(1, GRID_SIZE/5);
+        const int32_t size = std::max(1, std::min(W, H)/5);
         struct SourceInfo {
             float xAmp, xOffset, xPhase, xSpeed;
             float yAmp, yOffset, yPhase, ySpeed;
             float r,g,b;
         };
 
+        const float cx = W/2, cy = H/2; // the sources circle around the grid centre
         std::vector<SourceInfo> mSources;
-        mSources.push_back(SourceInfo{GRID_SIZE * 0.4f, GRID_SIZE/2, 0, 10,
-                                      GRID_SIZE * 0.4f, GRID_SIZE/2, 0, 13,
+        mSources.push_back(SourceInfo{W * 0.4f, cx, 0, 10,
+                                      H * 0.4f, cy, 0, 13,
                                       0, 0, 0.05});
 
         for(auto s : mSources) {
@@ -87,38 +71,46 @@ public:
                                   velWgt * cos(time * s.xSpeed + s.xPhase) * s.xAmp,
                                   velWgt * cos(time * s.ySpeed + s.yPhase) * s.yAmp);
         }
+        baseType::splatGaussians();
     }
 
 private:
-    std::pair<int16_t, int16_t> copyCharacterToBuffer(const char c, const int16_t fontHeight, int16_t x, int16_t y,
-                                  int8_t* pBuf, const int16_t width, const int16_t height)
+    // Lays mText out from the atlas and lists the lit cells, row by row, centred on the grid.
+    // A glyph that does not fit restarts the line at the left edge.
+    void composeText()
     {
-        FT_Set_Pixel_Sizes(face, 0, fontHeight);
-        if (FT_Load_Char(face, c, FT_LOAD_RENDER)) {
-            throw std::runtime_error("FREETYPE: Failed to load glyph");
-        }
-
-        // adjust the render origin
-        x += face->glyph->bitmap_left;
-        y = std::max(0, y - face->glyph->bitmap_top);
-
-        if ((face->glyph->bitmap.width + x >= static_cast<uint16_t>(width)) ||
-            (face->glyph->bitmap.rows + y >= static_cast<uint16_t>(height))) {
-            return std::pair(0,0);
+        const int32_t W = baseType::width(), H = baseType::height();
+        int32_t rows{};
+        for (const char c : mText) rows = std::max(rows, mAtlas[c].rows);
+        std::vector<uint8_t> buf(static_cast<size_t>(W) * rows);
+
+        int32_t x{}, maxHeight{};
+        for (const char c : mText) {
+            const GlyphAtlas::Glyph& glyph = mAtlas[c];
+            const int32_t gx = x + glyph.left;
+            if (gx < 0 || glyph.width + gx >= W || glyph.rows >= H) {
+                x = 0;
+                continue;
+            }
+            for (int32_t j = 0; j < glyph.rows; ++j) {
+                std::copy_n(&glyph.pixels[static_cast<size_t>(glyph.width) * j], glyph.width, &buf[gx + static_cast<size_t>(W) * j]);
+            }
+            x = gx + glyph.advance;
+            maxHeight = std::max(maxHeight, glyph.rows);
         }
 
-        uint8_t* pBuffer = face->glyph->bitmap.buffer;
-        for(int16_t j=0; j < static_cast<int16_t>(face->glyph->bitmap.rows); ++j) {
-            for(int16_t i=0; i < static_cast<int16_t>(face->glyph->bitmap.width); ++i) {
-                int16_t outIdx = i+x + width * (j+y);
-                pBuf[outIdx] = *pBuffer;
-                pBuffer++;
+        const int32_t gridX = (W - x)/2;
+        const int32_t gridY = (H - maxHeight)/2;
+        mLitCells.clear();
+        for (int32_t j = 0; j < maxHeight; ++j) {
+            for (int32_t i = 0; i < x; ++i) {
+                if (buf[i + static_cast<size_t>(W) * j]) mLitCells.push_back(POS(i+gridX, j+gridY));
             }
         }
-        return std::pair{x + face->glyph->advance.x / 64,
-                y + face->glyph->bitmap.rows};
     }
 
-    FT_Face face;
+    const GlyphAtlas mAtlas;
+    std::string mText;              // the clock as last composed
+    std::vector<int32_t> mLitCells; // field positions of its lit cells
+    std::vector<uint32_t> mRandom;
 };
-
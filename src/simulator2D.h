@@ -1,206 +1,1152 @@
 #pragma once
 #include <fftw3.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "activeTiles.h"
+#include "advectKernels.h"
+#include "fieldLayout.h"
+#include "multigrid.h"
+#include "obstacleMask.h"
+#include "stageTimer.h"
+#include "threadPool.h"
+#include "utils.h"
 
 
+enum class DiffuseMethod
+{
+    GaussSeidel, // lexicographic in-place sweeps, serial
+    RedBlack     // checkerboard sweeps, each colour split over the thread pool
+};
+
+enum class Projection
+{
+    Spectral, // FFT over the whole grid, which treats it as periodic; walls are imposed afterwards
+    Multigrid, // V-cycles on the grid itself, with zero flow through the frame and solid cells
+    External   // left to the owner between beginUpdate() and endUpdate(), e.g. EnsembleSimulator
+};
+
+struct SimOptions
+{
+    int numThreads{1}; // 1 runs every kernel on the calling thread
+    DiffuseMethod diffuseMethod{DiffuseMethod::GaussSeidel};
+    int maxDiffuseIterations{20};
+    bool spectralDiffusion{false}; // diffuse density in frequency space in every scene, see prepareSpectralDiffusion
+    float diffuseTolerance{0.0f}; // stop once the residual of the diffusion is at most this in every cell, 0 always runs the max
+    int fftThreads{1}; // >1 plans the velocity FFTs with fftw3f_threads
+    std::string fftWisdomDir{}; // FFTW wisdom is loaded from and saved to this directory, empty disables it
+    bool fusedAdvect{true}; // advect density and velocity in one pass, bit-identical to the separate passes
+    bool simd{true}; // use the AVX2 kernels when the CPU has them
+    bool adaptiveDt{false}; // pick each step's DT from cflNumber instead of keeping the constructor's DT
+    float cflNumber{5.0f}; // cells the fastest flow may cross in one advection step
+    float minDt{1e-4f};
+    float maxDt{1e-2f};
+    int maxSubsteps{8}; // advection is split into up to this many substeps when a step breaks the CFL limit
+    bool activeTiles{false}; // advect and diffuse density only near tiles holding any, see markActiveTiles
+    float activeThreshold{1e-4f}; // density at or below this counts as none; it is flushed to zero in quiet tiles
+    Projection projection{Projection::Spectral};
+    int multigridCycles{4}; // V-cycles per projection at most
+    float multigridTolerance{0.0f}; // stop once the residual is below this fraction of the divergence, 0 runs every cycle
+};
+
+
+// The viscosity and projection step of the spectral solver for the coefficients u and v at the
+// wavenumber (kx, ky). Divergence free velocity corresponds to Fourier coefficients perpendicular
+// to the wavenumber, so projecting onto that direction removes the divergent flow.
+inline void projectCoefficient(fftwf_complex& u, fftwf_complex& v, const float kx, const float ky,
+                               const float dt, const float viscosity)
+{
+    const float kk = kx * kx + ky * ky; // squared norm
+
+    if (kk > 1e-9)
+    {
+        const float u0 = u[0];
+        const float v0 = v[0];
+        const float u1 = u[1];
+        const float v1 = v[1];
+
+        const float wxx = kx * kx / kk;
+        const float wxy = ky * kx / kk;
+        const float wyy = ky * ky / kk;
+
+        const float f = std::exp(-kk * dt * viscosity); // viscosity
+
+        // update the Fourier values
+        u[0] = f * ((1 - wxx) * u0 - wxy * v0);
+        u[1] = f * ((1 - wxx) * u1 - wxy * v1);
+        v[0] = f * ((1 - wyy) * v0 - wxy * u0);
+        v[1] = f * ((1 - wyy) * v1 - wxy * u1);
+    }
+}
+
+// projectCoefficient on rows [jBegin, jEnd) of the r2c spectra of u and v, W x H cells
+inline void projectSpectrum(fftwf_complex* uc, fftwf_complex* vc, const int W, const int H, const int jBegin, const int jEnd,
+                            const float dt, const float viscosity)
+{
+    // ky is rescaled to cycles per domain width like kx
+    const float kyScale = static_cast<float>(W) / H;
+    for (int j = jBegin; j < jEnd; ++j) {
+        int idx = j * (W / 2 + 1);
+        const float ky = ((j <= H / 2) ? j : j - H) * kyScale;
+        for (int i = 0; i <= W / 2; ++i) {
+            projectCoefficient(uc[idx], vc[idx], i, ky, dt, viscosity);
+            idx++;
+        }
+    }
+}
+
+// The factor of spectral density diffusion at wavenumber (i, ky) in cycles per domain width, scale
+// included. Wavenumbers are taken in radians per domain length, so the decay matches the diffusion
+// constant used by the relaxation.
+inline float spectralDecay(const int i, const float ky, const float scale, const float dt, const float diffusion)
+{
+    constexpr float TWO_PI_SQ = 4.0f * M_PI * M_PI;
+    const float kk = TWO_PI_SQ * (i * i + ky * ky);
+    return scale * std::exp(-kk * dt * diffusion);
+}
+
+inline float maxDifference(const Density& a, const Density& b)
+{
+    return std::max({std::abs(a.r-b.r), std::abs(a.g-b.g), std::abs(a.b-b.b)});
+}
+
+// One colour of a red-black Gauss-Seidel sweep of the implicit diffusion x = c * (x0 + a * sum of the
+// 4 neighbours), over the cells of that colour in [iBegin, iEnd) of row j of a W x H grid. The target
+// is stale before the first sweep, so in that one every cell the sweep has not updated yet, the
+// boundary included, is read from the source.
+template<bool FIRST_SWEEP>
+inline void relaxRedBlackRow(auto& dataTgt, const auto& dataSource, const auto& index, const int W, const int H,
+                              const int j, const int iBegin, const int iEnd, const int colour, const float a, const float c)
+{
+    // in the first sweep only the interior cells of the first colour have been updated
+    auto cur = [&](const int x, const int y) -> Density {
+        const bool updated = colour == 1 && x > 0 && y > 0 && x < W-1 && y < H-1;
+        if (FIRST_SWEEP && !updated) return dataSource[index(x,y)];
+        return dataTgt[index(x,y)];
+    };
+
+    for (int i = iBegin + ((iBegin+j+colour) & 1); i < iEnd; i += 2) {
+        const int idx = index(i,j);
+        dataTgt[idx] = (dataSource[idx] + (cur(i-1,j) + cur(i+1,j) + cur(i,j-1) + cur(i,j+1)) * a) * c;
+    }
+}
+
+// The largest residual |x - c * (x0 + a * sum of the 4 neighbours)| of that equation over cells
+// [iBegin, iEnd) of row j. Unlike the change a sweep makes, which is small whenever a is, it only
+// becomes small once the sweeps have converged.
+inline float diffuseResidualRow(const auto& dataTgt, const auto& dataSource, const auto& index,
+                                const int j, const int iBegin, const int iEnd, const float a, const float c)
+{
+    auto x = [&](const int i, const int y) { return Density(dataTgt[index(i,y)]); };
+    float residual{};
+    for (int i = iBegin; i < iEnd; ++i) {
+        const Density val = (Density(dataSource[index(i,j)]) + (x(i-1,j) + x(i+1,j) + x(i,j-1) + x(i,j+1)) * a) * c;
+        residual = std::max(residual, maxDifference(val, x(i,j)));
+    }
+    return residual;
+}
+
 template<typename GridCellsType>
 class Simulator2D
 {
-    static constexpr uint16_t GRID_SIZE = GridCellsType::GRID_SIZE;
-    auto POS(auto x, auto y) { return GridCellsType::POS(x,y); }
+    static constexpr bool SOA = GridCellsType::LayoutType::SOA;
+    static constexpr bool PACKED = GridCellsType::LayoutType::PACKED;
+    using Format = typename GridCellsType::LayoutType::Format;
+    using IndexType = typename GridCellsType::IndexType;
+    static constexpr int ROW_BLOCK = IndexType::ROW_BLOCK;
+    static constexpr int ACTIVE_TILE = ROW_BLOCK > 1 ? ROW_BLOCK : 32; // activity is tracked per tile of this size
+    auto POS(auto x, auto y) const { return mGridCells.pos(x,y); }
+
+    // Lengths are in units of the domain width, so a cell is 1/width() wide in both directions.
+    int32_t width() const { return mGridCells.width(); }
+    int32_t height() const { return mGridCells.height(); }
 public:
-    Simulator2D(GridCellsType& gridCells, const float _DT) :  mGridCells{gridCells}, DT{_DT}
+    // _DT is the time step, or the first one with adaptiveDt
+    Simulator2D(GridCellsType& gridCells, const float _DT, const SimOptions& options = {}) :
+        mGridCells{gridCells}, DT{_DT}, mOptions{options},
+        DENSITY_DIST{planeStride(gridCells.cells())},
+        SPECTRUM_SIZE{gridCells.height() * (gridCells.width() / 2 + 1)},
+        mActive(gridCells.width(), gridCells.height(), ACTIVE_TILE),
+        mPool(options.numThreads)
     {
-        mFft_uc = fftwf_alloc_complex(GRID_SIZE * GRID_SIZE);
-        mFft_vc = fftwf_alloc_complex(GRID_SIZE * GRID_SIZE);
-        mFft_ur = fftwf_alloc_real(GRID_SIZE * GRID_SIZE);
-        mFft_vr = fftwf_alloc_real(GRID_SIZE * GRID_SIZE);
-        m_plan_u_rc = fftwf_plan_dft_r2c_2d(GRID_SIZE, GRID_SIZE, mFft_ur, mFft_uc, FFTW_MEASURE);
-        m_plan_v_rc = fftwf_plan_dft_r2c_2d(GRID_SIZE, GRID_SIZE, mFft_vr, mFft_vc, FFTW_MEASURE);
-        m_plan_u_cr = fftwf_plan_dft_c2r_2d(GRID_SIZE, GRID_SIZE, mFft_uc, mFft_ur, FFTW_MEASURE);
-        m_plan_v_cr = fftwf_plan_dft_c2r_2d(GRID_SIZE, GRID_SIZE, mFft_vc, mFft_vr, FFTW_MEASURE);
+        if (options.fftThreads > 1) {
+            // before any other FFTW call, the wisdom import included
+            static const bool threadsReady = fftwf_init_threads();
+            if (!threadsReady) {
+                throw std::runtime_error("fftwf_init_threads failed");
+            }
+        }
+        if (options.projection == Projection::Multigrid) {
+            mMultigrid = std::make_unique<MultigridPoisson>(width(), height());
+        } else if (options.projection == Projection::Spectral) {
+            allocateFft();
+        }
+        if (options.spectralDiffusion) createDensityPlans();
+        syncObstacles();
     }
 
     ~Simulator2D()
     {
-        fftwf_destroy_plan(m_plan_u_rc);
-        fftwf_destroy_plan(m_plan_v_rc);
-        fftwf_destroy_plan(m_plan_u_cr);
-        fftwf_destroy_plan(m_plan_v_cr);
-        fftwf_free(mFft_uc);
-        fftwf_free(mFft_vc);
-        fftwf_free(mFft_ur);
-        fftwf_free(mFft_vr);
+        if (m_plan_u_rc) {
+            fftwf_destroy_plan(m_plan_u_rc);
+            fftwf_destroy_plan(m_plan_v_rc);
+            fftwf_destroy_plan(m_plan_u_cr);
+            fftwf_destroy_plan(m_plan_v_cr);
+        }
+        if (mPlanDensityRc) {
+            fftwf_destroy_plan(mPlanDensityRc);
+            fftwf_destroy_plan(mPlanDensityCr);
+            fftwf_free(mFft_densityc);
+            fftwf_free(mFft_densityr);
+        }
+        if (mFft_uc) {
+            fftwf_free(mFft_uc);
+            fftwf_free(mFft_vc);
+            fftwf_free(mFft_ur);
+            fftwf_free(mFft_vr);
+        }
+    }
+
+    int numThreads() const { return mPool.size(); }
+
+    // Makes the density FFT plans of spectral diffusion unless SimOptions::spectralDiffusion already did.
+    // A scene that selects it through SceneParams needs this before its first step, called on the
+    // owner's thread: FFTW plans must not be made during a step or on several threads at once.
+    void prepareSpectralDiffusion()
+    {
+        if (!mPlanDensityRc) createDensityPlans();
     }
 
+    // idle between update() calls, e.g. for converting the result for display
+    ThreadPool& threadPool() { return mPool; }
+
+    // number of density diffusion sweeps run by the last update
+    int diffuseIterations() const { return mDiffuseIterations; }
+
+    // wall time spent creating the FFT plans in the constructor
+    double planSeconds() const { return mPlanSeconds; }
+
+    // the time the next update() advances the simulation by
+    float timeStep() const { return DT; }
+    void setTimeStep(const float dt) { DT = dt; } // e.g. to resume an adaptive run from a checkpoint
+
+    // advection substeps run by the last update
+    int substeps() const { return mSubsteps; }
+
+    // V-cycles run by the last multigrid projection, and the residual they left relative to the divergence
+    int multigridCycles() const { return mMultigridCycles; }
+    float multigridResidual() const { return mMultigrid ? mMultigrid->relativeResidual() : 0.0f; }
+
+    // share of the tiles the density passes of the last update worked on, 1 without activeTiles
+    double activeOccupancy() const { return mTrackActive ? mActive.occupancy() : 1.0; }
+
+    // Solid cells are skipped. With activeTiles, density is only advected in the active tiles and zeroed in the others
     template<typename DataType>
-    void advect(const auto& velSource, const auto& dataSource, auto& dataTgt)
+    void advect(const auto& velSource, const auto& dataSource, auto& dataTgt, const float dt)
+    {
+        constexpr bool DENSITY = std::is_same_v<DataType, Density>;
+        const int W = width(), H = height();
+        forRows(1, H-1, [&](const int jBegin, const int jEnd) {
+            forTileSegments<!DENSITY>(jBegin, jEnd, 1, W-1, true, fluidRuns([&](const int j, const int iBegin, const int iEnd) {
+                for (int i = iBegin; i < iEnd; ++i) {
+                    const int idx = POS(i, j);
+                    XYPair point = backTrace(i, j, velSource[idx], W, dt);
+                    dataTgt[idx] = interpolate<DataType>(point, dataSource);
+                }
+            }));
+            if constexpr (DENSITY) clearQuietTiles(dataTgt, jBegin, jEnd);
+        });
+    }
+
+    // Solid cells next to the fluid copy their fluid neighbour, or the mean of several; see ObstacleMask
+    void setDensityBoundary(auto& dataTgt) { mGridCells.obstacles.setDensityBoundary(dataTgt); }
+
+    // Like setDensityBoundary, with the velocity mirrored across the wall
+    void setVelocityBoundary(auto& dataTgt) { mGridCells.obstacles.setVelocityBoundary(dataTgt); }
+
+    // pTimer, when given, is charged with the wall time of each stage; pStats, when given, receives
+    // the flow statistics of this step at the cost of two extra passes over the fields
+    void update(const auto params, StageTimer* pTimer = nullptr, FlowStats* pStats = nullptr)
+    {
+        beginUpdate(params, pTimer);
+        // apply viscosity term and solve for non-divergent velocities
+        if (mMultigrid) {
+            projectMultigrid(params.viscosity);
+        } else if (mOptions.projection == Projection::Spectral) {
+            diffuseVelocities(params.viscosity, pTimer);
+        }
+        if (pTimer) pTimer->lap(SimStage::DiffuseVelocities);
+        if (pStats) {
+            measureVelocity(*pStats);
+            if (pTimer) pTimer->lap(SimStage::FlowStats);
+        }
+        endUpdate(params, pTimer, pStats);
+    }
+
+    // update() in two halves: the forces, then everything after the projection. With
+    // Projection::External the caller projects the velocity in between.
+    void beginUpdate(const auto params, StageTimer* pTimer = nullptr)
     {
-        for (unsigned int j = 1; j < GRID_SIZE-1; ++j) {
-            for (unsigned int i = 1; i < GRID_SIZE-1; ++i) {
-                const int idx = POS(i, j);
-                XYPair point = XYPair(i, j) - velSource[idx] * GRID_SIZE * DT;
-                dataTgt[idx] = interpolate<DataType>(point, dataSource);
+        if (pTimer) pTimer->start();
+        syncObstacles();
+        clearSolids(mGridCells.density, Density{}); // scenes emit wherever they like
+
+        // Update velocities using forces. The force field is reset to gravity, but only cells a scene
+        // or the mouse touched are stored to, so untouched cache lines are not written back.
+        const XYPair gravity{0.0f, params.gravity};
+        auto resetForce = [&](auto&& f) {
+            if (f.x != gravity.x || f.y != gravity.y) {
+                f = gravity;
             }
+        };
+        if constexpr (PACKED) {
+            // a row of velocity at a time, widened and narrowed again
+            forPackedRows<true, true>(mGridCells.velocity, [&](const int j, float* row) {
+                for (int i = 0; i < width(); ++i) {
+                    auto&& f = mGridCells.force[POS(i, j)];
+                    row[2*i] += f.x * DT;
+                    row[2*i + 1] += f.y * DT;
+                    resetForce(f);
+                }
+            });
+        } else {
+            forCells([&](const int32_t begin, const int32_t end) {
+                for (int i = begin; i < end; ++i) {
+                    auto&& f = mGridCells.force[i];
+                    mGridCells.velocity[i] += f * DT;
+                    resetForce(f);
+                }
+            });
         }
+        if (pTimer) pTimer->lap(SimStage::AddForce);
     }
 
-    void setDensityBoundary(auto& dataTgt)
+    // pStats only receives the total density here, see update()
+    void endUpdate(const auto params, StageTimer* pTimer = nullptr, FlowStats* pStats = nullptr)
     {
-        for (int i=1 ; i<=GRID_SIZE ; i++) {
-            dataTgt[POS(0, i)] = dataTgt[POS(1, i)];
-            dataTgt[POS(GRID_SIZE-1, i)] = dataTgt[POS(GRID_SIZE-2,i)];
-            dataTgt[POS(i, 0)] = dataTgt[POS(i, 1)];
-            dataTgt[POS(i, GRID_SIZE-1)] = dataTgt[POS(i,GRID_SIZE-2)];
+        auto lap = [pTimer](const SimStage stage) { if (pTimer) pTimer->lap(stage); };
+        if (!mMultigrid) clearSolids(mGridCells.velocity, XYPair{}); // the FFT does not know about them
+        setVelocityBoundary(mGridCells.velocity);
+        lap(SimStage::VelocityBoundary);
+
+        // The CFL condition is checked against the velocity that is about to be advected. If a force
+        // spike pushed it past the limit, this step's advection is split into substeps; the next
+        // step's DT is chosen so that no substeps are needed.
+        mSubsteps = 1;
+        float nextDt = DT;
+        const float cellsPerTime = mOptions.adaptiveDt || mOptions.activeTiles ? maxSpeed() * width() : 0.0f;
+        if (mOptions.adaptiveDt) {
+            const float stepCells = cellsPerTime * DT;
+            if (stepCells > mOptions.cflNumber) {
+                mSubsteps = std::min(mOptions.maxSubsteps, static_cast<int>(std::ceil(stepCells / mOptions.cflNumber)));
+            }
+            nextDt = cellsPerTime > 0.0f ? mOptions.cflNumber / cellsPerTime : mOptions.maxDt;
+            nextDt = std::clamp(nextDt, mOptions.minDt, mOptions.maxDt);
         }
-        dataTgt[POS(0, 0)] = (dataTgt[POS(1, 0)]+dataTgt[POS(0, 1)]) * 0.5;
-        dataTgt[POS(0, GRID_SIZE-1)] = (dataTgt[POS(1, GRID_SIZE-1)]+dataTgt[POS(0, GRID_SIZE-2)]) * 0.5;
-        dataTgt[POS(GRID_SIZE-1, 0)] = (dataTgt[POS(GRID_SIZE-2, 0)]+dataTgt[POS(GRID_SIZE-1, 1)]) * 0.5;
-        dataTgt[POS(GRID_SIZE-1, GRID_SIZE-1)] = (dataTgt[POS(GRID_SIZE-2, GRID_SIZE-1)]+dataTgt[POS(GRID_SIZE-1, GRID_SIZE-2)]) * 0.5;
+        mTrackActive = mOptions.activeTiles;
+        if (mTrackActive) markActiveTiles(cellsPerTime * DT);
+
+        // Advect density and velocity: both back-trace through the same field. The previous state
+        // moves to the back buffer and is advected into the front one.
+        const float advectDt = DT / mSubsteps;
+        for (int substep = 0; substep < mSubsteps; ++substep) {
+            mGridCells.swapDensity();
+            mGridCells.swapVelocity();
+            if (mOptions.fusedAdvect) {
+                advectFused(advectDt);
+                lap(SimStage::AdvectFused);
+            } else {
+                advect<Density>(mGridCells.velocityBack, mGridCells.densityBack, mGridCells.density, advectDt);
+                lap(SimStage::AdvectDensity);
+                advect<XYPair>(mGridCells.velocityBack, mGridCells.velocityBack, mGridCells.velocity, advectDt);
+                lap(SimStage::AdvectVelocity);
+            }
+            copyBoundary(mGridCells.velocity, mGridCells.velocityBack);
+            copyBoundary(mGridCells.density, mGridCells.densityBack);
+        }
+
+        if (mTrackActive && mActive.occupancy() == 0.0) {
+            mDiffuseIterations = 0; // advection flushed all of the density, nothing to diffuse
+        } else if (mOptions.spectralDiffusion || params.spectralDiffusion) {
+            diffuseDensitySpectral(params.diffusion, params.densityTrans, pTimer);
+            mDiffuseIterations = 0;
+        } else if (mOptions.maxDiffuseIterations > 0) {
+            mGridCells.swapDensity();
+            mDiffuseIterations = diffuse(mGridCells.density, mGridCells.densityBack, params.diffusion, params.densityTrans);
+        }
+        lap(SimStage::DiffuseDensity);
+        if (pStats) {
+            pStats->totalDensity = totalDensity();
+            lap(SimStage::FlowStats);
+        }
+
+        DT = nextDt;
+    }
+
+private:
+    // Wisdom is specific to the transform sizes and the FFTW thread count, so each combination gets its own file
+    std::string wisdomFileName() const
+    {
+        if (mOptions.fftWisdomDir.empty()) return {};
+        return mOptions.fftWisdomDir + "/sf_fftw_" + std::to_string(width()) + "x" + std::to_string(height()) +
+               "_t" + std::to_string(mOptions.fftThreads) + ".wisdom";
+    }
+
+    void allocateFft()
+    {
+        mFft_uc = fftwf_alloc_complex(SPECTRUM_SIZE);
+        mFft_vc = fftwf_alloc_complex(SPECTRUM_SIZE);
+        mFft_ur = fftwf_alloc_real(mGridCells.cells());
+        mFft_vr = fftwf_alloc_real(mGridCells.cells());
+        createPlans();
     }
 
-    void setVelocityBoundary(auto& dataTgt)
+    void createPlans()
     {
-        for (int i=1; i<=GRID_SIZE; i++) {
-            dataTgt[POS(0, i)].x = -dataTgt[POS(1,i)].x;
-            dataTgt[POS(0, i)].y = dataTgt[POS(1,i)].y;
-            dataTgt[POS(GRID_SIZE-1, i)].x = 0-dataTgt[POS(GRID_SIZE-2,i)].x;
-            dataTgt[POS(GRID_SIZE-1, i)].y = dataTgt[POS(GRID_SIZE-2,i)].y;
-            dataTgt[POS(i, 0)].x = dataTgt[POS(i,1)].x;
-            dataTgt[POS(i, 0)].y = -dataTgt[POS(i,1)].y;
-            dataTgt[POS(i, GRID_SIZE-1)].x = dataTgt[POS(i,GRID_SIZE-2)].x;
-            dataTgt[POS(i, GRID_SIZE-1)].y = -dataTgt[POS(i,GRID_SIZE-2)].y;
+        const auto start = std::chrono::steady_clock::now();
+
+        const std::string wisdomFile = wisdomFileName();
+        const bool haveWisdom = !wisdomFile.empty() && fftwf_import_wisdom_from_filename(wisdomFile.c_str());
+
+        // rows are the slow dimension, so the transform is height x width
+        setPlannerThreads(mOptions.fftThreads);
+        m_plan_u_rc = fftwf_plan_dft_r2c_2d(height(), width(), mFft_ur, mFft_uc, FFTW_MEASURE);
+        m_plan_v_rc = fftwf_plan_dft_r2c_2d(height(), width(), mFft_vr, mFft_vc, FFTW_MEASURE);
+        m_plan_u_cr = fftwf_plan_dft_c2r_2d(height(), width(), mFft_uc, mFft_ur, FFTW_MEASURE);
+        m_plan_v_cr = fftwf_plan_dft_c2r_2d(height(), width(), mFft_vc, mFft_vr, FFTW_MEASURE);
+        setPlannerThreads(1);
+
+        if (!haveWisdom) {
+            exportWisdom();
         }
-        dataTgt[POS(0,0)] = (dataTgt[POS(1,0)]+dataTgt[POS(0,1)]) * 0.5;
-        dataTgt[POS(0, GRID_SIZE-1)] = (dataTgt[POS(1, GRID_SIZE-1)]+dataTgt[POS(0, GRID_SIZE-2)]) * 0.5;
-        dataTgt[POS(GRID_SIZE-1,0)] = (dataTgt[POS(GRID_SIZE-2, 0)]+dataTgt[POS(GRID_SIZE-1,1)]) * 0.5;
-        dataTgt[POS(GRID_SIZE-1,GRID_SIZE-1)] = (dataTgt[POS(GRID_SIZE-2, GRID_SIZE-1)]+dataTgt[POS(GRID_SIZE-1, GRID_SIZE-2)]) * 0.5;
+
+        mPlanSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // One batched plan transforms the r, g and b planes, which are DENSITY_DIST floats apart
+    void createDensityPlans()
+    {
+        const int n[2] = {height(), width()};
+        mFft_densityr = fftwf_alloc_real(3 * DENSITY_DIST);
+        mFft_densityc = fftwf_alloc_complex(3 * SPECTRUM_SIZE);
+
+        setPlannerThreads(mOptions.fftThreads);
+        mPlanDensityRc = fftwf_plan_many_dft_r2c(2, n, 3, mFft_densityr, nullptr, 1, DENSITY_DIST,
+                                                 mFft_densityc, nullptr, 1, SPECTRUM_SIZE, FFTW_MEASURE);
+        mPlanDensityCr = fftwf_plan_many_dft_c2r(2, n, 3, mFft_densityc, nullptr, 1, SPECTRUM_SIZE,
+                                                 mFft_densityr, nullptr, 1, DENSITY_DIST, FFTW_MEASURE);
+        setPlannerThreads(1);
+
+        exportWisdom();
     }
 
-    void update(const auto params)
+    void setPlannerThreads(const int numThreads)
     {
-        // Update velocities using forces
-        for (int i = 0; i < GRID_SIZE*GRID_SIZE; ++i) {
-            mGridCells.velocity[i] += mGridCells.force[i] * DT;
-            mGridCells.force[i] = XYPair{0.0f, params.gravity};
+        if (mOptions.fftThreads > 1) fftwf_plan_with_nthreads(numThreads);
+    }
+
+    void exportWisdom()
+    {
+        const std::string wisdomFile = wisdomFileName();
+        if (!wisdomFile.empty() && !fftwf_export_wisdom_to_filename(wisdomFile.c_str())) {
+            std::cerr << "failed to write FFTW wisdom to " << wisdomFile << std::endl;
         }
-        
-        // apply viscosity term and solve for non-divergent velocities
-        // setVelocityBoundary(mGridCells.velocity);
-        diffuseVelocities(params.viscosity);
+    }
+
+    // advect only writes fluid cells, the solid ones next to them keep the values of the previous step
+    void copyBoundary(auto& dataTgt, const auto& dataSource) { mGridCells.obstacles.copyBoundary(dataTgt, dataSource); }
+
+    // solid cells away from the fluid are zero in every field
+    void clearSolids(auto& field, const auto zero) { mGridCells.obstacles.clearSolids(field, zero); }
+
+    // Compiles the obstacle edits made since the last step. Cells that became solid lose their flow
+    // and density, and the multigrid solver gets the new mask.
+    void syncObstacles()
+    {
+        ObstacleMask& mask = mGridCells.obstacles;
+        if (!mask.compile(mGridCells.index())) return;
+        clearSolids(mGridCells.velocity, XYPair{});
+        clearSolids(mGridCells.velocityBack, XYPair{});
+        clearSolids(mGridCells.density, Density{});
+        clearSolids(mGridCells.densityBack, Density{});
         setVelocityBoundary(mGridCells.velocity);
+        setDensityBoundary(mGridCells.density);
+        if (mMultigrid) mMultigrid->setSolid(mask.solid());
+    }
 
-        // Advect density
-        mGridCells.densityCopy = mGridCells.density;
-        advect<Density>(mGridCells.velocity, mGridCells.densityCopy, mGridCells.density);
+    // fn(j, iBegin, iEnd) restricted to the fluid cells of each segment
+    auto fluidRuns(auto&& fn) const
+    {
+        return [this, &fn](const int j, const int iBegin, const int iEnd) {
+            mGridCells.obstacles.forFluidRuns(j, iBegin, iEnd, fn);
+        };
+    }
 
-        mGridCells.densityCopy = mGridCells.density;
-        diffuse(mGridCells.density, mGridCells.densityCopy, params.diffusion, params.densityTrans);
+    // largest speed of any cell, in domain widths per time unit
+    float maxSpeed()
+    {
+        const int W = width();
+        mRowSpeed.assign(height(), 0.0f);
+        forRows(0, height(), [&](const int jBegin, const int jEnd) {
+            for (int j = jBegin; j < jEnd; ++j) {
+                float maxSq{};
+                for (int i = 0; i < W; ++i) {
+                    const XYPair v = mGridCells.velocity[POS(i, j)];
+                    maxSq = std::max(maxSq, v.x * v.x + v.y * v.y);
+                }
+                mRowSpeed[j] = maxSq;
+            }
+        });
+        return std::sqrt(*std::max_element(mRowSpeed.begin(), mRowSpeed.end()));
+    }
 
-        // Advect velocities
-        mGridCells.velocityCopy = mGridCells.velocity;
-        advect<XYPair>(mGridCells.velocityCopy, mGridCells.velocityCopy, mGridCells.velocity);
+    // The largest speed, and the divergence as the net outflow through the faces of each fluid cell
+    // as in projectMultigrid, scaled to per time unit. The frame is solid, so only interior rows count.
+    void measureVelocity(FlowStats& stats)
+    {
+        const ObstacleMask& mask = mGridCells.obstacles;
+        const auto& vel = mGridCells.velocity;
+        const int W = width(), H = height();
+        mRowStats.assign(H, RowStats{});
+        forRows(0, H, [&](const int jBegin, const int jEnd) {
+            for (int j = jBegin; j < jEnd; ++j) {
+                RowStats& row = mRowStats[j];
+                for (int i = 0; i < W; ++i) {
+                    const XYPair v = vel[POS(i, j)];
+                    row.maxSpeedSq = std::max(row.maxSpeedSq, v.x * v.x + v.y * v.y);
+                }
+                if (j == 0 || j == H-1) continue;
+                mask.forFluidRuns(j, 1, W-1, [&](const int, const int iBegin, const int iEnd) {
+                    for (int i = iBegin; i < iEnd; ++i) {
+                        const XYPair c = vel[POS(i, j)];
+                        auto flux = [&](const int ni, const int nj) { return mask.solid(ni, nj) ? XYPair{} : (XYPair(vel[POS(ni, nj)]) + c) * 0.5f; };
+                        const float div = W * (flux(i+1, j).x - flux(i-1, j).x + flux(i, j+1).y - flux(i, j-1).y);
+                        row.divergenceSq += static_cast<double>(div) * div;
+                        row.divergenceMax = std::max(row.divergenceMax, std::abs(div));
+                        ++row.fluidCells;
+                    }
+                });
+            }
+        });
+
+        float maxSpeedSq{};
+        double divergenceSq{};
+        int64_t fluidCells{};
+        stats.divergenceMax = 0.0f;
+        for (const RowStats& row : mRowStats) {
+            maxSpeedSq = std::max(maxSpeedSq, row.maxSpeedSq);
+            divergenceSq += row.divergenceSq;
+            stats.divergenceMax = std::max(stats.divergenceMax, row.divergenceMax);
+            fluidCells += row.fluidCells;
+        }
+        stats.maxSpeed = std::sqrt(maxSpeedSq);
+        stats.divergenceRms = fluidCells ? std::sqrt(divergenceSq / fluidCells) : 0.0f;
     }
 
-private:
-    void diffuse(auto& dataTgt, const auto& dataSource, const float diffusion, const float trans)
+    // r + g + b of every cell, the frame included
+    double totalDensity()
     {
-        const float a = DT * diffusion * GRID_SIZE * GRID_SIZE;
-        for (int k=0 ; k<20 ; k++ ) {
-            for (int i=1 ; i<=GRID_SIZE-2 ; i++ ) {
-                for (int j=1 ; j<=GRID_SIZE-2 ; j++ ) {
-                    dataTgt[POS(i,j)] = (dataSource[POS(i,j)] + (dataTgt[POS(i-1,j)] + dataTgt[POS(i+1,j)] +
-                                         dataTgt[POS(i,j-1)] + dataTgt[POS(i,j+1)]) * a) * (trans/(1+4*a));
+        const int W = width(), H = height();
+        mRowStats.assign(H, RowStats{});
+        forRows(0, H, [&](const int jBegin, const int jEnd) {
+            for (int j = jBegin; j < jEnd; ++j) {
+                double sum{};
+                for (int i = 0; i < W; ++i) {
+                    const Density d = mGridCells.density[POS(i, j)];
+                    sum += d.r + d.g + d.b;
                 }
+                mRowStats[j].density = sum;
+            }
+        });
+        double total{};
+        for (const RowStats& row : mRowStats) total += row.density;
+        return total;
+    }
+
+    // runs fn(jBegin, jEnd) over row ranges of [jBegin, jEnd) on the worker pool. Tiled grids are
+    // split at tile boundaries, so no two threads write into the same tile.
+    void forRows(const int jBegin, const int jEnd, auto&& fn)
+    {
+        if constexpr (ROW_BLOCK == 1) {
+            mPool.parallelFor(jBegin, jEnd, fn);
+        } else {
+            mPool.parallelFor(jBegin / ROW_BLOCK, (jEnd + ROW_BLOCK - 1) / ROW_BLOCK, [&](const int bBegin, const int bEnd) {
+                fn(std::max(jBegin, bBegin * ROW_BLOCK), std::min(jEnd, bEnd * ROW_BLOCK));
+            });
+        }
+    }
+
+    // runs fn(begin, end) over ranges of field positions, for element-wise loops (padding included)
+    void forCells(auto&& fn)
+    {
+        const int bands = (height() + ROW_BLOCK - 1) / ROW_BLOCK;
+        const int32_t bandCells = mGridCells.storageCells() / bands;
+        mPool.parallelFor(0, bands, [&](const int bBegin, const int bEnd) {
+            fn(bBegin * bandCells, bEnd * bandCells);
+        });
+    }
+
+    // Calls fn(j, iBegin, iEnd) for the cells [iBegin, iEnd) of rows [jBegin, jEnd). Tiled grids are
+    // walked one tile column at a time, so consecutive rows read from the same few tiles.
+    void forRowSegments(const int jBegin, const int jEnd, const int iBegin, const int iEnd, auto&& fn)
+    {
+        if constexpr (ROW_BLOCK == 1) {
+            for (int j = jBegin; j < jEnd; ++j) fn(j, iBegin, iEnd);
+        } else {
+            for (int i0 = iBegin; i0 < iEnd;) {
+                const int i1 = std::min(iEnd, (i0 / ROW_BLOCK + 1) * ROW_BLOCK);
+                for (int j = jBegin; j < jEnd; ++j) fn(j, i0, i1);
+                i0 = i1;
+            }
+        }
+    }
+
+    // Like forRowSegments, but while the density passes are restricted (mTrackActive) only over the
+    // tiles whose activity equals `active`; consecutive tiles of row-major grids form one segment.
+    // Otherwise, or for EVERY_TILE, it visits every cell for active and none for quiet tiles.
+    template<bool EVERY_TILE = false>
+    void forTileSegments(const int jBegin, const int jEnd, const int iBegin, const int iEnd, const bool active, auto&& fn)
+    {
+        if (EVERY_TILE || !mTrackActive) {
+            if (active) forRowSegments(jBegin, jEnd, iBegin, iEnd, fn);
+            return;
+        }
+        constexpr int T = ACTIVE_TILE;
+        for (int ty = jBegin / T; ty * T < jEnd; ++ty) {
+            const int j0 = std::max(jBegin, ty * T), j1 = std::min(jEnd, (ty + 1) * T);
+            for (int tx = iBegin / T; tx * T < iEnd;) {
+                if (mActive.active(tx, ty) != active) {
+                    ++tx;
+                    continue;
+                }
+                int txEnd = tx + 1;
+                if constexpr (ROW_BLOCK == 1) {
+                    while (txEnd * T < iEnd && mActive.active(txEnd, ty) == active) ++txEnd;
+                }
+                const int i0 = std::max(iBegin, tx * T), i1 = std::min(iEnd, txEnd * T);
+                for (int j = j0; j < j1; ++j) fn(j, i0, i1);
+                tx = txEnd;
             }
-            setDensityBoundary(dataTgt);
         }
     }
 
-    void diffuseVelocities(const float viscosity)
+    // zeroes the interior cells of rows [jBegin, jEnd) that lie in quiet tiles
+    void clearQuietTiles(auto& field, const int jBegin, const int jEnd)
+    {
+        forTileSegments(std::max(1, jBegin), std::min(height()-1, jEnd), 1, width()-1, false,
+                        [&](const int j, const int iBegin, const int iEnd) {
+            for (int i = iBegin; i < iEnd; ++i) field[POS(i, j)] = Density{};
+        });
+    }
+
+    // A tile is active if any density channel in it exceeds activeThreshold. The set is then grown by
+    // the farthest back-trace of this step plus the interpolation and diffusion stencils, so a cell
+    // outside it only reads quiet cells, and its exact result would not exceed the threshold either.
+    void markActiveTiles(const float reachCells)
+    {
+        constexpr int T = ACTIVE_TILE;
+        const int W = width(), H = height();
+        const float threshold = mOptions.activeThreshold;
+        mPool.parallelFor(0, mActive.tilesY(), [&](const int tyBegin, const int tyEnd) {
+            for (int ty = tyBegin; ty < tyEnd; ++ty) {
+                for (int tx = 0; tx < mActive.tilesX(); ++tx) {
+                    bool active{false};
+                    for (int j = ty * T; j < std::min(H, (ty + 1) * T) && !active; ++j) {
+                        for (int i = tx * T; i < std::min(W, (tx + 1) * T); ++i) {
+                            const Density d = mGridCells.density[POS(i, j)];
+                            active |= std::max({std::abs(d.r), std::abs(d.g), std::abs(d.b)}) > threshold;
+                        }
+                    }
+                    mActive.set(tx, ty, active);
+                }
+            }
+        });
+        mActive.dilate(static_cast<int>(std::ceil((reachCells + 2.0f) / T)));
+    }
+
+    // Runs fn(idx, lin) for every cell, idx being its position in the fields and lin its row-major
+    // position in the FFT buffers. The two are the same unless the grid is tiled.
+    void forLinearCells(auto&& fn)
+    {
+        const int W = width();
+        forRows(0, height(), [&](const int jBegin, const int jEnd) {
+            if constexpr (IndexType::ROW_CONTIGUOUS) {
+                for (int i = POS(0, jBegin); i < POS(0, jEnd); ++i) fn(i, i);
+            } else {
+                for (int j = jBegin; j < jEnd; ++j) {
+                    for (int i = 0; i < W; ++i) fn(POS(i, j), i + W * j);
+                }
+            }
+        });
+    }
+
+    // For packed layouts: runs fn(j, row) for every row of field as interleaved floats, widened
+    // from the field first if READ and narrowed back into it afterwards if WRITE
+    template<bool READ, bool WRITE>
+    void forPackedRows(auto& field, auto&& fn)
     {
-        for (int i = 0; i < GRID_SIZE*GRID_SIZE; ++i) { // copy velocity
-            const auto& v = mGridCells.velocity[i];
-            mFft_ur[i] = v.x;
-            mFft_vr[i] = v.y;
+        static_assert(IndexType::ROW_CONTIGUOUS);
+        const int W = width();
+        forRows(0, height(), [&](const int jBegin, const int jEnd) {
+            std::vector<float> row(static_cast<size_t>(field.CHANNELS) * W);
+            for (int j = jBegin; j < jEnd; ++j) {
+                if (READ) field.widen(POS(0, j), W, row.data(), mOptions.simd);
+                fn(j, row.data());
+                if (WRITE) field.narrow(POS(0, j), W, row.data(), mOptions.simd);
+            }
+        });
+    }
+
+    // Implicit diffusion by relaxation, returns the number of sweeps run. With diffuseTolerance the
+    // residual is measured after each sweep, a pass about as costly as a red-black sweep.
+    int diffuse(auto& dataTgt, const auto& dataSource, const float diffusion, const float trans)
+    {
+        const float a = DT * diffusion * width() * width();
+        const bool checkResidual = mOptions.diffuseTolerance > 0.0f;
+        // the sweeps skip quiet tiles, whose neighbours then read zero there, and solid cells, which
+        // start out as the source's like the cells the first sweep has not reached yet
+        forRows(0, height(), [&](const int jBegin, const int jEnd) { clearQuietTiles(dataTgt, jBegin, jEnd); });
+        copyBoundary(dataTgt, dataSource);
+        for (int k=0 ; k<mOptions.maxDiffuseIterations ; k++ ) {
+            if (mOptions.diffuseMethod == DiffuseMethod::RedBlack) {
+                k == 0 ? sweepRedBlack<true>(dataTgt, dataSource, a, trans)
+                       : sweepRedBlack<false>(dataTgt, dataSource, a, trans);
+            } else if constexpr (PACKED) {
+                k == 0 ? sweepLexicographicPacked<true>(dataTgt, dataSource, a, trans)
+                       : sweepLexicographicPacked<false>(dataTgt, dataSource, a, trans);
+            } else {
+                k == 0 ? sweepLexicographic<true>(dataTgt, dataSource, a, trans)
+                       : sweepLexicographic<false>(dataTgt, dataSource, a, trans);
+            }
+            setDensityBoundary(dataTgt);
+
+            if (checkResidual && diffuseResidual(dataTgt, dataSource, a, trans) <= mOptions.diffuseTolerance) {
+                return k+1;
+            }
         }
+        return mOptions.maxDiffuseIterations;
+    }
+
+    // the largest diffuseResidualRow over the cells the sweeps update
+    float diffuseResidual(const auto& dataTgt, const auto& dataSource, const float a, const float trans)
+    {
+        const int W = width(), H = height();
+        const float c = trans/(1+4*a);
+        mRowResidual.assign(H, 0.0f);
+        forRows(1, H-1, [&](const int jBegin, const int jEnd) {
+            forTileSegments(jBegin, jEnd, 1, W-1, true, fluidRuns([&](const int j, const int iBegin, const int iEnd) {
+                const float residual = diffuseResidualRow(dataTgt, dataSource, mGridCells.index(), j, iBegin, iEnd, a, c);
+                mRowResidual[j] = std::max(mRowResidual[j], residual);
+            }));
+        });
+        return *std::max_element(mRowResidual.begin(), mRowResidual.end());
+    }
 
-        fftwf_execute(m_plan_u_rc); // FFT of velocities
-        fftwf_execute(m_plan_v_rc);
+    // The target of diffuse() is a stale back buffer. In the first sweep, cells that the sweep has not
+    // updated yet (including the whole boundary) are read from the source instead, which gives exactly
+    // the result of starting from a copy of the source.
 
-        // diffuse step in frequency domain
-        for (int j = 0; j < GRID_SIZE; ++j) {
-            int idx = j * (GRID_SIZE / 2 + 1);
-            const float ky = (j <= GRID_SIZE / 2) ? j : j - GRID_SIZE;
-            for (int i = 0; i <= GRID_SIZE / 2; ++i) {
-                const float kx = i;
-                const float kk = kx * kx + ky * ky; // squared norm
+    // Lexicographic Gauss-Seidel: every cell reads the ones just updated, so this stays serial.
+    // Each cell reads its left and upper neighbours updated and the other two not yet, which holds for
+    // any order that visits a cell after those two. The grid is therefore swept row by row, and
+    // tile by tile for tiled grids, with the same result as the column by column sweep.
+    template<bool FIRST_SWEEP>
+    void sweepLexicographic(auto& dataTgt, const auto& dataSource, const float a, const float trans)
+    {
+        auto cur = [&](const bool updated, const int idx) -> Density {
+            if (FIRST_SWEEP && !updated) return dataSource[idx];
+            return dataTgt[idx];
+        };
 
-                if (kk > 1e-9)
-                {
-                    const float u0 = mFft_uc[idx][0];
-                    const float v0 = mFft_vc[idx][0];
-                    const float u1 = mFft_uc[idx][1];
-                    const float v1 = mFft_vc[idx][1];
+        const int W = width(), H = height();
+        for (int jBegin = 1; jBegin < H-1;) {
+            const int jEnd = std::min(H-1, (jBegin / ROW_BLOCK + 1) * ROW_BLOCK);
+            forTileSegments(jBegin, jEnd, 1, W-1, true, fluidRuns([&](const int j, const int iBegin, const int iEnd) {
+                for (int i = iBegin; i < iEnd; ++i) {
+                    dataTgt[POS(i,j)] = (dataSource[POS(i,j)] + (cur(i > 1, POS(i-1,j)) + cur(false, POS(i+1,j)) +
+                                         cur(j > 1, POS(i,j-1)) + cur(false, POS(i,j+1))) * a) * (trans/(1+4*a));
+                }
+            }));
+            jBegin = jEnd;
+        }
+    }
 
-                    // Note: Mass conserving velocity corresponds to vectors in
-                    // frequency domain that are perpendicular to the wavenumber
-                    // Therefore, projecting to the mass conserving vector removes divergent flow
-                    const float wxx = kx * kx / kk;
-                    const float wxy = ky * kx / kk;
-                    const float wyy = ky * ky / kk;
+    // sweepLexicographic for packed fields. Each run of cells is widened once together with its
+    // neighbours, relaxed in float and narrowed after the sweep has passed it, so a cell reads its
+    // left neighbour's update before it is rounded to the storage format.
+    template<bool FIRST_SWEEP>
+    void sweepLexicographicPacked(auto& dataTgt, const auto& dataSource, const float a, const float trans)
+    {
+        static_assert(IndexType::ROW_CONTIGUOUS);
+        const int W = width(), H = height();
+        const bool simd = mOptions.simd;
+        // the rows above and below and the source of a run, and the run with a cell either side
+        mSweepRows.resize(3 * (4 * static_cast<size_t>(W) + 2));
+        float* up = mSweepRows.data();
+        float* down = up + 3 * W;
+        float* src = down + 3 * W;
+        float* mid = src + 3 * W;
 
-                    const float f = std::exp(-kk * DT * viscosity); // viscosity
+        for (int row = 1; row < H-1; ++row) {
+            forTileSegments(row, row+1, 1, W-1, true, fluidRuns([&](const int j, const int iBegin, const int iEnd) {
+                const int n = iEnd - iBegin;
+                const int idx = POS(iBegin, j);
+                (j > 1 || !FIRST_SWEEP ? dataTgt : dataSource).widen(POS(iBegin, j-1), n, up, simd);
+                (FIRST_SWEEP ? dataSource : dataTgt).widen(POS(iBegin, j+1), n, down, simd);
+                dataSource.widen(idx, n, src, simd);
+                (FIRST_SWEEP ? dataSource : dataTgt).widen(idx - 1, n + 2, mid, simd);
+                if (FIRST_SWEEP && iBegin > 1) dataTgt.widen(idx - 1, 1, mid, simd);
 
-                    // update the Fourier values
-                    mFft_uc[idx][0] = f * ((1 - wxx) * u0 - wxy * v0);
-                    mFft_uc[idx][1] = f * ((1 - wxx) * u1 - wxy * v1);
-                    mFft_vc[idx][0] = f * ((1 - wyy) * v0 - wxy * u0);
-                    mFft_vc[idx][1] = f * ((1 - wyy) * v1 - wxy * u1);
+                const float scale = trans/(1+4*a);
+                Density left{mid[0], mid[1], mid[2]};
+                for (int k = 0; k < n; ++k) {
+                    float* cell = mid + 3 * (k + 1);
+                    const Density right{cell[3], cell[4], cell[5]};
+                    const Density above{up[3*k], up[3*k + 1], up[3*k + 2]};
+                    const Density below{down[3*k], down[3*k + 1], down[3*k + 2]};
+                    const Density source{src[3*k], src[3*k + 1], src[3*k + 2]};
+                    const Density val = (source + (left + right + above + below) * a) * scale;
+                    cell[0] = val.r;
+                    cell[1] = val.g;
+                    cell[2] = val.b;
+                    left = val;
                 }
-                idx++;
+                dataTgt.narrow(idx, n, mid + 3, simd);
+            }));
+        }
+    }
+
+    // Red-black Gauss-Seidel: cells with (i+j) even are updated first, then the odd ones.
+    // A cell only reads neighbours of the other colour, so each half sweep has no loop carried
+    // dependency and rows can be split across threads; results do not depend on the thread count.
+    template<bool FIRST_SWEEP>
+    void sweepRedBlack(auto& dataTgt, const auto& dataSource, const float a, const float trans)
+    {
+        const int W = width(), H = height();
+        const float c = trans/(1+4*a);
+        for (int colour = 0; colour < 2; ++colour) {
+            forRows(1, H-1, [&](const int jBegin, const int jEnd) {
+                forTileSegments(jBegin, jEnd, 1, W-1, true, fluidRuns([&](const int j, const int iBegin, const int iEnd) {
+                    relaxRedBlackRow<FIRST_SWEEP>(dataTgt, dataSource, mGridCells.index(), W, H, j, iBegin, iEnd, colour, a, c);
+                }));
+            });
+        }
+    }
+
+    void diffuseVelocities(const float viscosity, StageTimer* pTimer)
+    {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point fftStart;
+        auto startFft = [&] { if (pTimer) fftStart = Clock::now(); };
+        auto stopFft = [&] { if (pTimer) pTimer->addFft(Clock::now() - fftStart); };
+        const int W = width(), H = height();
+
+        if constexpr (SOA) {
+            // the u and v planes are transformed in place of mFft_ur/mFft_vr, no de-interleave needed
+            startFft();
+            fftwf_execute_dft_r2c(m_plan_u_rc, mGridCells.velocity.plane(0), mFft_uc);
+            fftwf_execute_dft_r2c(m_plan_v_rc, mGridCells.velocity.plane(1), mFft_vc);
+            stopFft();
+        } else {
+            if constexpr (PACKED) {
+                forPackedRows<true, false>(mGridCells.velocity, [&](const int j, const float* row) {
+                    for (int i = 0; i < W; ++i) {
+                        mFft_ur[i + W * j] = row[2*i];
+                        mFft_vr[i + W * j] = row[2*i + 1];
+                    }
+                });
+            } else {
+                forLinearCells([&](const int idx, const int lin) { // copy velocity
+                    const auto& v = mGridCells.velocity[idx];
+                    mFft_ur[lin] = v.x;
+                    mFft_vr[lin] = v.y;
+                });
             }
+
+            startFft();
+            fftwf_execute(m_plan_u_rc); // FFT of velocities
+            fftwf_execute(m_plan_v_rc);
+            stopFft();
         }
 
-        // convert back to real space
-        fftwf_execute(m_plan_u_cr);
-        fftwf_execute(m_plan_v_cr);
+        forRows(0, H, [&](const int jBegin, const int jEnd) {
+            projectSpectrum(mFft_uc, mFft_vc, W, H, jBegin, jEnd, DT, viscosity);
+        });
 
         // scale and copy back
-        const float f = 1.0 / (float)(GRID_SIZE * GRID_SIZE);
-        for (int i = 0; i < GRID_SIZE*GRID_SIZE; ++i) {
-            mGridCells.velocity[i] = XYPair(mFft_ur[i], mFft_vr[i]) * f;
+        const float f = 1.0 / (float)(W * H);
+        if constexpr (SOA) {
+            float* pU = mGridCells.velocity.plane(0);
+            float* pV = mGridCells.velocity.plane(1);
+            startFft();
+            fftwf_execute_dft_c2r(m_plan_u_cr, mFft_uc, pU);
+            fftwf_execute_dft_c2r(m_plan_v_cr, mFft_vc, pV);
+            stopFft();
+            forRows(0, H, [&](const int jBegin, const int jEnd) {
+                for (int i = POS(0, jBegin); i < POS(0, jEnd); ++i) {
+                    pU[i] *= f;
+                    pV[i] *= f;
+                }
+            });
+        } else {
+            // convert back to real space
+            startFft();
+            fftwf_execute(m_plan_u_cr);
+            fftwf_execute(m_plan_v_cr);
+            stopFft();
+
+            if constexpr (PACKED) {
+                forPackedRows<false, true>(mGridCells.velocity, [&](const int j, float* row) {
+                    for (int i = 0; i < W; ++i) {
+                        row[2*i] = mFft_ur[i + W * j] * f;
+                        row[2*i + 1] = mFft_vr[i + W * j] * f;
+                    }
+                });
+            } else {
+                forLinearCells([&](const int idx, const int lin) {
+                    mGridCells.velocity[idx] = XYPair(mFft_ur[lin], mFft_vr[lin]) * f;
+                });
+            }
+        }
+    }
+
+    // The multigrid alternative to diffuseVelocities: Stam's projection with central differences,
+    // where no flow and no pressure gradient cross the faces of solid cells, which end up at zero velocity.
+    void projectMultigrid(const float viscosity)
+    {
+        MultigridPoisson& mg = *mMultigrid;
+        auto& vel = mGridCells.velocity;
+        const int W = width(), H = height();
+        if (viscosity > 0.0f) relaxViscosity(viscosity);
+
+        // Divergence as the net outflow through the faces of a cell, a face carrying the mean velocity
+        // of its two cells or nothing if one of them is solid. Between fluid cells this is the central
+        // difference; the frame is solid, so every fluid cell is an interior one.
+        float* b = mg.rhs();
+        forRows(1, H-1, [&](const int jBegin, const int jEnd) {
+            for (int j = jBegin; j < jEnd; ++j) {
+                for (int i = 1; i < W-1; ++i) {
+                    if (!mg.fluid(i, j)) continue;
+                    const XYPair c = vel[POS(i, j)];
+                    auto flux = [&](const int ni, const int nj) { return mg.fluid(ni, nj) ? (XYPair(vel[POS(ni, nj)]) + c) * 0.5f : XYPair{}; };
+                    b[mg.at(i, j)] = -(flux(i+1, j).x - flux(i-1, j).x + flux(i, j+1).y - flux(i, j-1).y);
+                }
+            }
+        });
+        mMultigridCycles = mg.solve(mPool, mOptions.multigridCycles, mOptions.multigridTolerance);
+
+        const float* q = mg.pressure();
+        forRows(0, H, [&](const int jBegin, const int jEnd) {
+            for (int j = jBegin; j < jEnd; ++j) {
+                for (int i = 0; i < W; ++i) {
+                    if (!mg.fluid(i, j)) {
+                        vel[POS(i, j)] = XYPair{};
+                        continue;
+                    }
+                    const float qc = q[mg.at(i, j)];
+                    auto side = [&](const int si, const int sj) { return mg.fluid(si, sj) ? q[mg.at(si, sj)] : qc; };
+                    const XYPair grad{0.5f * (side(i+1, j) - side(i-1, j)), 0.5f * (side(i, j+1) - side(i, j-1))};
+                    vel[POS(i, j)] = XYPair(vel[POS(i, j)]) - grad;
+                }
+            }
+        });
+    }
+
+    // Implicit viscosity by red-black relaxation, solid cells holding zero velocity. The rate matches
+    // diffuseVelocities, whose wavenumbers are in cycles rather than radians per domain width.
+    void relaxViscosity(const float viscosity)
+    {
+        constexpr int SWEEPS{4};
+        const MultigridPoisson& mg = *mMultigrid;
+        auto& vel = mGridCells.velocity;
+        auto& src = mGridCells.velocityBack; // free until advection swaps the buffers
+        const int W = width(), H = height();
+        const float a = DT * viscosity * W * W / (4.0f * M_PI * M_PI);
+        forRows(0, H, [&](const int jBegin, const int jEnd) {
+            for (int j = jBegin; j < jEnd; ++j) {
+                for (int i = 0; i < W; ++i) src[POS(i, j)] = XYPair(vel[POS(i, j)]);
+            }
+        });
+        for (int k = 0; k < SWEEPS; ++k) {
+            for (int colour = 0; colour < 2; ++colour) {
+                forRows(1, H-1, [&](const int jBegin, const int jEnd) {
+                    auto u = [&](const int i, const int j) { return mg.fluid(i, j) ? XYPair(vel[POS(i, j)]) : XYPair{}; };
+                    for (int j = jBegin; j < jEnd; ++j) {
+                        for (int i = 1 + ((1 + j + colour) & 1); i < W-1; i += 2) {
+                            if (!mg.fluid(i, j)) continue;
+                            const XYPair sum = u(i-1, j) + u(i+1, j) + u(i, j-1) + u(i, j+1);
+                            vel[POS(i, j)] = (XYPair(src[POS(i, j)]) + sum * a) * (1.0f / (1.0f + 4.0f * a));
+                        }
+                    }
+                });
+            }
         }
     }
 
+    // Exact implicit diffusion of the density in frequency space. Like the velocity projection this
+    // treats the grid as periodic; the reflective boundary is applied afterwards as in diffuse().
+    void diffuseDensitySpectral(const float diffusion, const float trans, StageTimer* pTimer)
+    {
+        if (!mPlanDensityRc) {
+            throw std::logic_error("spectral diffusion needs prepareSpectralDiffusion() before the step");
+        }
+
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point fftStart;
+        auto startFft = [&] { if (pTimer) fftStart = Clock::now(); };
+        auto stopFft = [&] { if (pTimer) pTimer->addFft(Clock::now() - fftStart); };
+        const int W = width(), H = height();
+
+        float* pDensity = mFft_densityr;
+        if constexpr (SOA) {
+            pDensity = mGridCells.density.plane(0); // planes are DENSITY_DIST apart, see planeStride()
+        } else if constexpr (PACKED) {
+            forPackedRows<true, false>(mGridCells.density, [&](const int j, const float* row) {
+                for (int i = 0; i < W; ++i) {
+                    for (int c = 0; c < 3; ++c) mFft_densityr[i + W * j + c*DENSITY_DIST] = row[3*i + c];
+                }
+            });
+        } else {
+            forLinearCells([&](const int idx, const int lin) {
+                const Density& d = mGridCells.density[idx];
+                mFft_densityr[lin] = d.r;
+                mFft_densityr[lin + DENSITY_DIST] = d.g;
+                mFft_densityr[lin + 2*DENSITY_DIST] = d.b;
+            });
+        }
+
+        startFft();
+        fftwf_execute_dft_r2c(mPlanDensityRc, pDensity, mFft_densityc);
+        stopFft();
+
+        const float scale = trans / (float)(W * H); // includes the c2r normalisation
+        const float kyScale = static_cast<float>(W) / H;
+        forRows(0, H, [&](const int jBegin, const int jEnd) {
+            for (int j = jBegin; j < jEnd; ++j) {
+                int idx = j * (W / 2 + 1);
+                const float ky = ((j <= H / 2) ? j : j - H) * kyScale;
+                for (int i = 0; i <= W / 2; ++i) {
+                    const float f = spectralDecay(i, ky, scale, DT, diffusion);
+                    for (int c = 0; c < 3; ++c) {
+                        mFft_densityc[idx + c*SPECTRUM_SIZE][0] *= f;
+                        mFft_densityc[idx + c*SPECTRUM_SIZE][1] *= f;
+                    }
+                    idx++;
+                }
+            }
+        });
+
+        startFft();
+        fftwf_execute_dft_c2r(mPlanDensityCr, mFft_densityc, pDensity);
+        stopFft();
+
+        if constexpr (PACKED) {
+            forPackedRows<false, true>(mGridCells.density, [&](const int j, float* row) {
+                for (int i = 0; i < W; ++i) {
+                    for (int c = 0; c < 3; ++c) row[3*i + c] = mFft_densityr[i + W * j + c*DENSITY_DIST];
+                }
+            });
+        } else if constexpr (!SOA) {
+            forLinearCells([&](const int idx, const int lin) {
+                mGridCells.density[idx] = Density{mFft_densityr[lin], mFft_densityr[lin + DENSITY_DIST],
+                                                  mFft_densityr[lin + 2*DENSITY_DIST]};
+            });
+        }
+        clearSolids(mGridCells.density, Density{});
+        setDensityBoundary(mGridCells.density);
+    }
+
+    // Advects densityBack into density and velocityBack into velocity, back-tracing each cell once
+    void advectFused(const float dt)
+    {
+        using Channels = AdvectChannels<Format>;
+        Channels ch;
+        for (int c = 0; c < Channels::COUNT; ++c) {
+            const bool isDensity = c < Channels::U;
+            const int fc = isDensity ? c : c - Channels::U;
+            const auto src = isDensity ? channelOf(mGridCells.densityBack, fc) : channelOf(mGridCells.velocityBack, fc);
+            const auto tgt = isDensity ? channelOf(mGridCells.density, fc) : channelOf(mGridCells.velocity, fc);
+            ch.src[c] = src.p;
+            ch.srcStride[c] = src.stride;
+            ch.tgt[c] = tgt.p;
+            ch.tgtStride[c] = tgt.stride;
+        }
+
+#ifdef SF_HAVE_AVX2
+        const bool useAvx2 = mOptions.simd && Format::hasSimd();
+#endif
+        const int W = width(), H = height();
+        const auto index = mGridCells.index();
+        forRows(1, H-1, [&](const int jBegin, const int jEnd) {
+            forTileSegments(jBegin, jEnd, 1, W-1, true, fluidRuns([&](const int j, const int iBegin, const int iEnd) {
+#ifdef SF_HAVE_AVX2
+                if (useAvx2) {
+                    advectFusedRowAvx2(ch, index, W, H, W, dt, j, iBegin, iEnd);
+                    return;
+                }
+#endif
+                advectFusedRowScalar(ch, index, W, H, W, dt, j, iBegin, iEnd);
+            }));
+            // quiet tiles: velocity only, the density there is flushed
+            forTileSegments(jBegin, jEnd, 1, W-1, false, fluidRuns([&](const int j, const int iBegin, const int iEnd) {
+#ifdef SF_HAVE_AVX2
+                if (useAvx2) {
+                    advectFusedRowAvx2<Channels::U>(ch, index, W, H, W, dt, j, iBegin, iEnd);
+                } else
+#endif
+                advectFusedRowScalar<Channels::U>(ch, index, W, H, W, dt, j, iBegin, iEnd);
+                for (int i = iBegin; i < iEnd; ++i) mGridCells.density[POS(i, j)] = Density{};
+            }));
+        });
+    }
+
     // interpolate the 4 cells around the specified point
     template<typename CellType>
     CellType interpolate(XYPair& point, const auto& q)
     {
-        auto clip = [](float& a, const float mn, const float mx) {
-            a = std::min(mx, std::max(mn, a));
-        };
+        clampToGrid(point, width(), height());
+        return interpolateCell<CellType>(point, q, mGridCells.index());
+    }
 
-        clip(point.x, 0.5, GRID_SIZE-1.5);
-        clip(point.y, 0.5, GRID_SIZE-1.5);
+    GridCellsType& mGridCells;
+    float DT; // the current step, fixed unless mOptions.adaptiveDt
+    const SimOptions mOptions;
+    const int32_t DENSITY_DIST;  // distance between the r, g and b planes of the density transform
+    const int32_t SPECTRUM_SIZE; // complex values in the spectrum of one plane
+    int mDiffuseIterations{};
+    int mSubsteps{1};
+    double mPlanSeconds{};
+    std::vector<float> mRowResidual;
+    std::vector<float> mSweepRows; // only for packed layouts
+    std::vector<float> mRowSpeed;
+    struct RowStats
+    {
+        float maxSpeedSq{}, divergenceMax{};
+        double divergenceSq{}, density{};
+        int64_t fluidCells{};
+    };
+    std::vector<RowStats> mRowStats; // partial sums of the flow stats, per row
+    bool mTrackActive{false}; // this update restricts the density passes to mActive
 
-        const int intX = static_cast<int>(point.x);
-        const int intY = static_cast<int>(point.y);
-        const float decX = point.x - intX;
-        const float decY = point.y - intY;
+    // only with Projection::Spectral
+    fftwf_plan m_plan_u_rc{}, m_plan_u_cr{}, m_plan_v_rc{}, m_plan_v_cr{};
+    fftwf_complex* mFft_uc{};
+    fftwf_complex* mFft_vc{};
+    float* mFft_ur{};
+    float* mFft_vr{};
 
-        return q[POS(intX, intY)] * (1.0f - decX) * (1.0f - decY) +
-               q[POS(intX, intY+1)] * (1.0f - decX) * decY +
-               q[POS(intX+1, intY)] * decX * (1.0f - decY) +
-               q[POS(intX+1, intY+1)] * decX * decY;
-    }
+    fftwf_plan mPlanDensityRc{}, mPlanDensityCr{};
+    fftwf_complex* mFft_densityc{};
+    float* mFft_densityr{};
 
-    GridCellsType& mGridCells;
-    const float DT;
+    std::unique_ptr<MultigridPoisson> mMultigrid; // only with Projection::Multigrid
+    int mMultigridCycles{};
 
-    fftwf_plan m_plan_u_rc, m_plan_u_cr, m_plan_v_rc, m_plan_v_cr;
-    fftwf_complex* mFft_uc;
-    fftwf_complex* mFft_vc;
-    float* mFft_ur;
-    float* mFft_vr;
+    ActiveTiles mActive;
+    ThreadPool mPool;
 };
@@ -0,0 +1,636 @@
+#pragma once
+#include <fftw3.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "fieldLayout.h"
+#include "simulator2D.h"
+#include "slabTransport.h"
+#include "stageTimer.h"
+#include "utils.h"
+
+
+// Where the share of `rank` begins when n rows or columns are split over `ranks`; rank == ranks gives n
+inline int32_t slabBegin(const int32_t n, const int ranks, const int rank)
+{
+    return static_cast<int32_t>(static_cast<int64_t>(n) * rank / ranks);
+}
+
+// The command line of the multi-process headless mode
+struct SlabOptions
+{
+    int ranks{};             // processes to split the grid over, 0 runs a single Simulator2D
+    int halo{32};            // rows of each neighbour a rank keeps, the farthest a back-trace may reach
+    bool compareSingle{false}; // rerun on one Simulator2D and report the differences
+
+    bool enabled() const { return ranks > 0; }
+
+    // Consumes a --ranks, --halo or --compare-single option at argv[i], returns false if argv[i] is not one
+    bool parseArg(const int argc, char* argv[], int& i)
+    {
+        if (!strcmp(argv[i], "--ranks") && i+1 < argc) {
+            ranks = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--halo") && i+1 < argc) {
+            halo = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--compare-single")) {
+            compareSingle = true;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static constexpr const char* USAGE{" [--ranks N] [--halo ROWS] [--compare-single]"};
+};
+
+
+// Rows [rowBegin, rowEnd) of a width x height AoS grid, the slab one rank of a SlabSimulator2D owns,
+// with room for `halo` rows of the neighbouring slabs on either side. Cells keep their coordinates
+// in the whole grid, so scenes draw on a slab as on a whole grid: pos() sends the rows it does not
+// store to a scratch row, where whatever is added to them is dropped.
+class SlabCells
+{
+public:
+    using LayoutType = AoSLayout;
+    using IndexType = LinearIndex;
+
+    SlabCells(const int32_t width, const int32_t height, const int32_t rowBegin, const int32_t rowEnd,
+              const int32_t halo, const MemoryHint memory = {}) :
+        mWidth{width}, mHeight{height}, mRowBegin{rowBegin}, mRowEnd{rowEnd}, mHalo{halo},
+        mFirstRow{rowBegin - halo}, mStoredRows{rowEnd - rowBegin + 2 * halo},
+        velocity(checkedStorage(), memory), velocityBack(checkedStorage(), memory), force(checkedStorage(), memory),
+        density(checkedStorage(), memory), densityBack(checkedStorage(), memory) {}
+
+    int32_t pos(const int32_t i, const int32_t j) const
+    {
+        const int32_t row = j - mFirstRow;
+        return (static_cast<uint32_t>(row) < static_cast<uint32_t>(mStoredRows) ? row : mStoredRows) * mWidth + i;
+    }
+
+    // pos() as a functor, and one that also sends the halo rows to the scratch row
+    auto index() const { return [this](const int32_t i, const int32_t j) { return pos(i, j); }; }
+    auto ownedIndex() const
+    {
+        return [this](const int32_t i, const int32_t j) { return j < mRowBegin || j >= mRowEnd ? mStoredRows * mWidth + i : pos(i, j); };
+    }
+
+    int32_t width() const { return mWidth; }
+    int32_t height() const { return mHeight; }
+    int32_t rowBegin() const { return mRowBegin; }
+    int32_t rowEnd() const { return mRowEnd; }
+    int32_t halo() const { return mHalo; }
+
+    void swapVelocity() { using std::swap; swap(velocity, velocityBack); }
+    void swapDensity() { using std::swap; swap(density, densityBack); }
+
+private:
+    int32_t checkedStorage() const
+    {
+        if (mWidth < 4 || mHeight < 4 || mRowBegin < 0 || mRowEnd > mHeight || mRowEnd - mRowBegin < 2 || mHalo < 1) {
+            throw std::invalid_argument("bad slab, rows " + std::to_string(mRowBegin) + "-" + std::to_string(mRowEnd) +
+                                        " of a " + std::to_string(mWidth) + "x" + std::to_string(mHeight) + " grid");
+        }
+        const int64_t storage = static_cast<int64_t>(mStoredRows + 1) * mWidth;
+        if (storage > std::numeric_limits<int32_t>::max() / 4) {
+            throw std::invalid_argument("slab of " + std::to_string(mStoredRows) + " rows is too large");
+        }
+        return static_cast<int32_t>(storage);
+    }
+
+    const int32_t mWidth, mHeight;
+    const int32_t mRowBegin, mRowEnd, mHalo;
+    const int32_t mFirstRow;   // of the halo above the slab
+    const int32_t mStoredRows; // the scratch row follows them
+
+public:
+    AoSField<XYPair> velocity;
+    AoSField<XYPair> velocityBack;
+    AoSField<XYPair> force;
+    AoSField<Density> density;
+    AoSField<Density> densityBack;
+};
+
+
+// The 2D r2c FFT of a width x height grid whose rows are split over the ranks like the slabs. Each
+// rank transforms its rows, a transpose hands every rank a share of the spectrum's columns, which
+// it transforms in place; the inverse runs the same way back. The 1D transforms are planned once
+// with FFTW_ESTIMATE on padded rows and columns of equal alignment and executed one by one, so the
+// result does not depend on the number of ranks.
+class SlabFft
+{
+public:
+    static constexpr int MAX_CHANNELS{3};
+
+    SlabFft(SlabTransport& transport, const int32_t width, const int32_t height) :
+        mTransport{transport}, W{width}, H{height}, K{width / 2 + 1},
+        mRowBegin{slabBegin(height, transport.ranks(), transport.rank())},
+        mRows{slabBegin(height, transport.ranks(), transport.rank() + 1) - mRowBegin},
+        mColBegin{slabBegin(K, transport.ranks(), transport.rank())},
+        mCols{slabBegin(K, transport.ranks(), transport.rank() + 1) - mColBegin},
+        mRealStride{(width + 15) / 16 * 16}, mRowStride{(K + 7) / 8 * 8}, mColStride{(height + 7) / 8 * 8}
+    {
+        if (mRows < 1 || mCols < 1) {
+            throw std::invalid_argument("a " + std::to_string(W) + "x" + std::to_string(H) + " grid is too small for " +
+                                        std::to_string(transport.ranks()) + " ranks");
+        }
+        const auto start = std::chrono::steady_clock::now();
+        mReal = fftwf_alloc_real(static_cast<size_t>(MAX_CHANNELS) * mRows * mRealStride);
+        mRowSpectrum = fftwf_alloc_complex(static_cast<size_t>(MAX_CHANNELS) * mRows * mRowStride);
+        mColSpectrum = fftwf_alloc_complex(static_cast<size_t>(MAX_CHANNELS) * mCols * mColStride);
+        mBlocks = fftwf_alloc_complex(static_cast<size_t>(MAX_CHANNELS) * mRows * K);
+        mPlanR2c = fftwf_plan_dft_r2c_1d(W, mReal, mRowSpectrum, FFTW_ESTIMATE);
+        mPlanC2r = fftwf_plan_dft_c2r_1d(W, mRowSpectrum, mReal, FFTW_ESTIMATE);
+        mPlanForward = fftwf_plan_dft_1d(H, mColSpectrum, mColSpectrum, FFTW_FORWARD, FFTW_ESTIMATE);
+        mPlanBackward = fftwf_plan_dft_1d(H, mColSpectrum, mColSpectrum, FFTW_BACKWARD, FFTW_ESTIMATE);
+        mPlanSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    ~SlabFft()
+    {
+        fftwf_destroy_plan(mPlanR2c);
+        fftwf_destroy_plan(mPlanC2r);
+        fftwf_destroy_plan(mPlanForward);
+        fftwf_destroy_plan(mPlanBackward);
+        fftwf_free(mReal);
+        fftwf_free(mRowSpectrum);
+        fftwf_free(mColSpectrum);
+        fftwf_free(mBlocks);
+    }
+
+    SlabFft(const SlabFft&) = delete;
+    SlabFft& operator=(const SlabFft&) = delete;
+
+    // The W values of row j, one of this rank's, in channel c: the input of transform(), and its
+    // output scaled by W * H
+    float* row(const int c, const int32_t j) { return mReal + (static_cast<size_t>(c) * mRows + (j - mRowBegin)) * mRealStride; }
+
+    // Transforms channels [0, count) forward, calls fn(i, j, coefficients) for every (i, j) of the
+    // r2c spectrum in this rank's columns, with coefficients[c] the one of channel c, and back.
+    template<typename Fn>
+    void transform(const int count, Fn&& fn, StageTimer* pTimer = nullptr)
+    {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point fftStart;
+        auto startFft = [&] { if (pTimer) fftStart = Clock::now(); };
+        auto stopFft = [&] { if (pTimer) pTimer->addFft(Clock::now() - fftStart); };
+        const int ranks = mTransport.ranks();
+
+        startFft();
+        for (int c = 0; c < count; ++c) {
+            for (int32_t j = 0; j < mRows; ++j) fftwf_execute_dft_r2c(mPlanR2c, realRow(c, j), rowSpectrum(c, j));
+        }
+        stopFft();
+
+        // Each peer gets its columns of these rows, column by column, and sends its rows of these
+        // columns, which land in the columns as they are
+        mMessages.clear();
+        fftwf_complex* block = mBlocks;
+        for (int q = 0; q < ranks; ++q) {
+            const fftwf_complex* begin = block;
+            for (int c = 0; c < count; ++c) {
+                for (int32_t k = slabBegin(K, ranks, q); k < slabBegin(K, ranks, q + 1); ++k) {
+                    for (int32_t j = 0; j < mRows; ++j, ++block) copy(rowSpectrum(c, j)[k], *block);
+                }
+            }
+            mMessages.push_back(SlabMessage{q, begin, (block - begin) * sizeof(fftwf_complex), nullptr, 0});
+            const int32_t qBegin = slabBegin(H, ranks, q), qRows = slabBegin(H, ranks, q + 1) - qBegin;
+            for (int c = 0; c < count; ++c) {
+                for (int32_t k = 0; k < mCols; ++k) {
+                    mMessages.push_back(SlabMessage{q, nullptr, 0, colSpectrum(c, k) + qBegin, qRows * sizeof(fftwf_complex)});
+                }
+            }
+        }
+        exchange();
+
+        startFft();
+        for (int c = 0; c < count; ++c) {
+            for (int32_t k = 0; k < mCols; ++k) fftwf_execute_dft(mPlanForward, colSpectrum(c, k), colSpectrum(c, k));
+        }
+        stopFft();
+
+        fftwf_complex* coefficients[MAX_CHANNELS]{};
+        for (int32_t k = 0; k < mCols; ++k) {
+            for (int32_t j = 0; j < H; ++j) {
+                for (int c = 0; c < count; ++c) coefficients[c] = colSpectrum(c, k) + j;
+                fn(mColBegin + k, j, coefficients);
+            }
+        }
+
+        startFft();
+        for (int c = 0; c < count; ++c) {
+            for (int32_t k = 0; k < mCols; ++k) fftwf_execute_dft(mPlanBackward, colSpectrum(c, k), colSpectrum(c, k));
+        }
+        stopFft();
+
+        // and back: each peer gets its rows of these columns, and sends its columns of these rows
+        mMessages.clear();
+        block = mBlocks;
+        for (int q = 0; q < ranks; ++q) {
+            const int32_t qBegin = slabBegin(H, ranks, q), qRows = slabBegin(H, ranks, q + 1) - qBegin;
+            for (int c = 0; c < count; ++c) {
+                for (int32_t k = 0; k < mCols; ++k) {
+                    mMessages.push_back(SlabMessage{q, colSpectrum(c, k) + qBegin, qRows * sizeof(fftwf_complex), nullptr, 0});
+                }
+            }
+            const size_t blockSize = static_cast<size_t>(count) * (slabBegin(K, ranks, q + 1) - slabBegin(K, ranks, q)) * mRows;
+            mMessages.push_back(SlabMessage{q, nullptr, 0, block, blockSize * sizeof(fftwf_complex)});
+            block += blockSize;
+        }
+        exchange();
+        block = mBlocks;
+        for (int q = 0; q < ranks; ++q) {
+            for (int c = 0; c < count; ++c) {
+                for (int32_t k = slabBegin(K, ranks, q); k < slabBegin(K, ranks, q + 1); ++k) {
+                    for (int32_t j = 0; j < mRows; ++j, ++block) copy(*block, rowSpectrum(c, j)[k]);
+                }
+            }
+        }
+
+        startFft();
+        for (int c = 0; c < count; ++c) {
+            for (int32_t j = 0; j < mRows; ++j) fftwf_execute_dft_c2r(mPlanC2r, rowSpectrum(c, j), realRow(c, j));
+        }
+        stopFft();
+    }
+
+    double planSeconds() const { return mPlanSeconds; }
+
+    // wall time spent in the transposes
+    double exchangeSeconds() const { return mExchangeSeconds; }
+
+    // the most one rank sends another in a transpose
+    static size_t messageBytes(const int32_t width, const int32_t height, const int ranks)
+    {
+        const size_t rows = (height + ranks - 1) / ranks, cols = (width / 2 + 1 + ranks - 1) / ranks;
+        return MAX_CHANNELS * rows * cols * sizeof(fftwf_complex);
+    }
+
+private:
+    static void copy(const fftwf_complex& from, fftwf_complex& to)
+    {
+        to[0] = from[0];
+        to[1] = from[1];
+    }
+
+    float* realRow(const int c, const int32_t j) { return mReal + (static_cast<size_t>(c) * mRows + j) * mRealStride; }
+    fftwf_complex* rowSpectrum(const int c, const int32_t j) { return mRowSpectrum + (static_cast<size_t>(c) * mRows + j) * mRowStride; }
+    fftwf_complex* colSpectrum(const int c, const int32_t k) { return mColSpectrum + (static_cast<size_t>(c) * mCols + k) * mColStride; }
+
+    void exchange()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        mTransport.exchange(mMessages);
+        mExchangeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    SlabTransport& mTransport;
+    const int32_t W, H, K; // K columns of the r2c spectrum
+    const int32_t mRowBegin, mRows, mColBegin, mCols; // of the grid and of the spectrum owned here
+    const int32_t mRealStride, mRowStride, mColStride; // padded to 64 bytes
+    float* mReal{};
+    fftwf_complex* mRowSpectrum{};
+    fftwf_complex* mColSpectrum{}; // columns contiguous
+    fftwf_complex* mBlocks{};      // the transposed blocks to or from every peer
+    fftwf_plan mPlanR2c{}, mPlanC2r{}, mPlanForward{}, mPlanBackward{};
+    std::vector<SlabMessage> mMessages;
+    double mPlanSeconds{};
+    double mExchangeSeconds{};
+};
+
+
+// Simulator2D's step on a grid split into horizontal slabs, one per rank of a SlabTransport, for
+// grids that do not fit one process. Each rank owns the rows of its SlabCells and works on them
+// alone; it only needs other rows for the back-traces of advection and the neighbours of diffusion,
+// which it copies into its halo before each of those passes, and the velocity projection runs on a
+// SlabFft. The per-cell kernels and boundary rules are Simulator2D's own, run on the slab's rows, so
+// only the FFT's rounding separates the result from a single process run with --diffuse rb, and the
+// result is the same for any number of ranks as long as no back-trace reaches past the halo; those
+// are clamped to it (clippedTraces()), which a single rank never does.
+//
+// Supported is the spectral projection on a grid whose only obstacle is the frame, advected with a
+// fixed DT. Density is always relaxed with red-black sweeps, one thread per rank.
+class SlabSimulator2D
+{
+    int32_t POS(const int32_t i, const int32_t j) const { return mCells.pos(i, j); }
+public:
+    SlabSimulator2D(SlabCells& cells, SlabTransport& transport, const float dt, const SimOptions& options = {}) :
+        mCells{cells}, mTransport{transport}, DT{dt},
+        mOptions{checked(cells.width(), cells.height(), transport.ranks(), options)},
+        mFft(transport, cells.width(), cells.height()), mFrame(cells.width(), cells.height())
+    {
+        const int ranks = transport.ranks(), rank = transport.rank();
+        if (cells.rowBegin() != slabBegin(cells.height(), ranks, rank) || cells.rowEnd() != slabBegin(cells.height(), ranks, rank + 1)) {
+            throw std::invalid_argument("the slab of rank " + std::to_string(rank) + " does not match slabBegin()");
+        }
+        // Simulator2D's boundary rules on this slab's rows; all of their source cells are in the
+        // slab too, as it has at least 2 rows
+        mFrame.compile(cells.ownedIndex());
+    }
+
+    // Throws std::invalid_argument unless a width x height grid can be split over `ranks` with these
+    // options, e.g. to check before starting the ranks
+    static SimOptions checked(const int32_t width, const int32_t height, const int ranks, const SimOptions& options)
+    {
+        if (width < 4 || height < 2 * ranks || width / 2 + 1 < ranks) {
+            throw std::invalid_argument("a " + std::to_string(width) + "x" + std::to_string(height) + " grid is too small for " +
+                                        std::to_string(ranks) + " ranks, which need 2 rows each");
+        }
+        if (options.projection != Projection::Spectral) {
+            throw std::invalid_argument("the slab solver only projects with the FFT");
+        }
+        if (options.adaptiveDt || options.activeTiles) {
+            throw std::invalid_argument("the slab solver supports neither adaptive DT nor active tiles");
+        }
+        return options;
+    }
+
+    // the most one rank sends another in an exchange, for sizing the transport
+    static size_t messageBytes(const int32_t width, const int32_t height, const int ranks, const int32_t halo)
+    {
+        const size_t haloBytes = static_cast<size_t>(halo) * width * (sizeof(XYPair) + sizeof(Density));
+        return std::max(SlabFft::messageBytes(width, height, ranks), haloBytes);
+    }
+
+    int diffuseIterations() const { return mDiffuseIterations; }
+    float timeStep() const { return DT; }
+    double planSeconds() const { return mFft.planSeconds(); }
+
+    // wall time spent exchanging rows and spectra, including the wait for slower ranks
+    double exchangeSeconds() const { return mExchangeSeconds + mFft.exchangeSeconds(); }
+
+    // The most rows the fastest flow could carry a back-trace in a step so far, and how many
+    // back-traces of this rank reached past the halo and were cut short; a larger halo avoids those.
+    int32_t maxReach() const { return mMaxReach; }
+    int64_t clippedTraces() const { return mClippedTraces; }
+
+    // Collective. Rank 0 gets fn(j, velocity, density) for every row of the grid in order, with
+    // pointers to its width cells; the other ranks send it their rows.
+    template<typename Fn>
+    void gatherRows(Fn&& fn)
+    {
+        const int32_t W = mCells.width();
+        const int ranks = mTransport.ranks();
+        const size_t rowBytes = W * (sizeof(XYPair) + sizeof(Density));
+        const int32_t chunk = static_cast<int32_t>(std::max<size_t>(1, mTransport.capacity() / rowBytes));
+        if (mTransport.rank() == 0) {
+            for (int32_t j = mCells.rowBegin(); j < mCells.rowEnd(); ++j) {
+                fn(j, &mCells.velocity[POS(0, j)], &mCells.density[POS(0, j)]);
+            }
+            std::vector<XYPair> velocity(static_cast<size_t>(chunk) * W);
+            std::vector<Density> density(static_cast<size_t>(chunk) * W);
+            for (int q = 1; q < ranks; ++q) {
+                for (int32_t j = slabBegin(mCells.height(), ranks, q); j < slabBegin(mCells.height(), ranks, q + 1); j += chunk) {
+                    const int32_t n = std::min(chunk, slabBegin(mCells.height(), ranks, q + 1) - j);
+                    const SlabMessage messages[]{{q, nullptr, 0, velocity.data(), n * W * sizeof(XYPair)},
+                                                 {q, nullptr, 0, density.data(), n * W * sizeof(Density)}};
+                    mTransport.exchange(messages);
+                    for (int32_t k = 0; k < n; ++k) fn(j + k, &velocity[static_cast<size_t>(k) * W], &density[static_cast<size_t>(k) * W]);
+                }
+            }
+        } else {
+            for (int32_t j = mCells.rowBegin(); j < mCells.rowEnd(); j += chunk) {
+                const int32_t n = std::min(chunk, mCells.rowEnd() - j);
+                const SlabMessage messages[]{{0, &mCells.velocity[POS(0, j)], n * W * sizeof(XYPair), nullptr, 0},
+                                             {0, &mCells.density[POS(0, j)], n * W * sizeof(Density), nullptr, 0}};
+                mTransport.exchange(messages);
+            }
+        }
+    }
+
+    // Collective, every rank calls it with the same params
+    void update(const auto params, StageTimer* pTimer = nullptr)
+    {
+        auto lap = [pTimer](const SimStage stage) { if (pTimer) pTimer->lap(stage); };
+        if (pTimer) pTimer->start();
+        const int32_t W = mCells.width();
+
+        // forces, as in Simulator2D::beginUpdate
+        const XYPair gravity{0.0f, params.gravity};
+        for (int32_t j = mCells.rowBegin(); j < mCells.rowEnd(); ++j) {
+            for (int32_t i = 0; i < W; ++i) {
+                const int32_t idx = POS(i, j);
+                XYPair& f = mCells.force[idx];
+                mCells.velocity[idx] += f * DT;
+                if (f.x != gravity.x || f.y != gravity.y) {
+                    f = gravity;
+                }
+            }
+        }
+        lap(SimStage::AddForce);
+
+        diffuseVelocities(params.viscosity, pTimer);
+        lap(SimStage::DiffuseVelocities);
+        mFrame.setVelocityBoundary(mCells.velocity);
+        lap(SimStage::VelocityBoundary);
+
+        // Back-traces reach the fastest flow's distance in a step, plus the row interpolated below.
+        // The rows they reach are copied in from the slabs around.
+        const float reach = std::ceil(mTransport.allReduceMax(maxSpeed()) * W * DT) + 2;
+        const int32_t rows = reach < mCells.halo() ? static_cast<int32_t>(reach) : mCells.halo();
+        mMaxReach = std::max(mMaxReach, reach < std::numeric_limits<int32_t>::max() ? static_cast<int32_t>(reach) : mCells.height());
+        exchangeHalo(rows, mCells.velocity, mCells.density);
+        mCells.swapDensity();
+        mCells.swapVelocity();
+        advect<Density>(mCells.velocityBack, mCells.densityBack, mCells.density, rows);
+        lap(SimStage::AdvectDensity);
+        advect<XYPair>(mCells.velocityBack, mCells.velocityBack, mCells.velocity, rows);
+        lap(SimStage::AdvectVelocity);
+        mFrame.copyBoundary(mCells.velocity, mCells.velocityBack);
+        mFrame.copyBoundary(mCells.density, mCells.densityBack);
+
+        if (mOptions.spectralDiffusion || params.spectralDiffusion) {
+            diffuseDensitySpectral(params.diffusion, params.densityTrans, pTimer);
+            mDiffuseIterations = 0;
+        } else if (mOptions.maxDiffuseIterations > 0) {
+            mCells.swapDensity();
+            mDiffuseIterations = diffuse(mCells.density, mCells.densityBack, params.diffusion, params.densityTrans);
+        }
+        lap(SimStage::DiffuseDensity);
+    }
+
+private:
+    // Copies the rows within `reach` of each slab into its halo from the ranks that own them
+    void exchangeHalo(const int32_t reach, auto&... fields)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const int32_t W = mCells.width(), H = mCells.height();
+        const int ranks = mTransport.ranks(), rank = mTransport.rank();
+        mMessages.clear();
+        for (int q = 0; q < ranks; ++q) {
+            if (q == rank) continue;
+            const int32_t qBegin = slabBegin(H, ranks, q), qEnd = slabBegin(H, ranks, q + 1);
+            // the distance between two slabs is the same both ways, so either both or neither need rows
+            const int32_t sendBegin = std::max(mCells.rowBegin(), qBegin - reach), sendEnd = std::min(mCells.rowEnd(), qEnd + reach);
+            const int32_t recvBegin = std::max(qBegin, mCells.rowBegin() - reach), recvEnd = std::min(qEnd, mCells.rowEnd() + reach);
+            if (sendBegin >= sendEnd) continue;
+            (mMessages.push_back(SlabMessage{q, &fields[POS(0, sendBegin)], (sendEnd - sendBegin) * W * sizeof(fields[0]),
+                                             &fields[POS(0, recvBegin)], (recvEnd - recvBegin) * W * sizeof(fields[0])}), ...);
+        }
+        mTransport.exchange(mMessages);
+        mExchangeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // largest speed in this slab
+    float maxSpeed() const
+    {
+        float maxSq{};
+        for (int32_t j = mCells.rowBegin(); j < mCells.rowEnd(); ++j) {
+            for (int32_t i = 0; i < mCells.width(); ++i) {
+                const XYPair v = mCells.velocity[POS(i, j)];
+                maxSq = std::max(maxSq, v.x * v.x + v.y * v.y);
+            }
+        }
+        return std::sqrt(maxSq);
+    }
+
+    // the interior rows of this slab
+    int32_t interiorBegin() const { return std::max(1, mCells.rowBegin()); }
+    int32_t interiorEnd() const { return std::min(mCells.height() - 1, mCells.rowEnd()); }
+
+    // Simulator2D::advect, with back-traces held to the rows the halo has
+    template<typename DataType>
+    void advect(const auto& velSource, const auto& dataSource, auto& dataTgt, const int32_t reach)
+    {
+        const int W = mCells.width();
+        const float yMin = std::max(0, mCells.rowBegin() - reach);
+        const float yMax = std::nextafter(static_cast<float>(std::min(mCells.height(), mCells.rowEnd() + reach) - 1), 0.0f);
+        for (int j = interiorBegin(); j < interiorEnd(); ++j) {
+            for (int i = 1; i < W-1; ++i) {
+                const int idx = POS(i, j);
+                XYPair point = backTrace(i, j, velSource[idx], W, DT);
+                clampToGrid(point, W, mCells.height());
+                if (point.y < yMin || point.y > yMax) {
+                    ++mClippedTraces;
+                    point.y = std::min(yMax, std::max(yMin, point.y));
+                }
+                dataTgt[idx] = interpolateCell<DataType>(point, dataSource, mCells.index());
+            }
+        }
+    }
+
+    // Simulator2D::diffuse with red-black sweeps, which only need the row either side of the slab
+    int diffuse(AoSField<Density>& dataTgt, AoSField<Density>& dataSource, const float diffusion, const float trans)
+    {
+        const float a = DT * diffusion * mCells.width() * mCells.width();
+        const bool checkResidual = mOptions.diffuseTolerance > 0.0f;
+        mFrame.copyBoundary(dataTgt, dataSource);
+        exchangeHalo(1, dataSource);
+        for (int k=0 ; k<mOptions.maxDiffuseIterations ; k++ ) {
+            k == 0 ? sweepRedBlack<true>(dataTgt, dataSource, a, trans)
+                   : sweepRedBlack<false>(dataTgt, dataSource, a, trans);
+            mFrame.setDensityBoundary(dataTgt);
+
+            if (checkResidual && diffuseResidual(dataTgt, dataSource, a, trans) <= mOptions.diffuseTolerance) {
+                return k+1;
+            }
+        }
+        return mOptions.maxDiffuseIterations;
+    }
+
+    // Collective: Simulator2D::diffuseResidual over all slabs, once the halo has the last sweep
+    float diffuseResidual(AoSField<Density>& dataTgt, const AoSField<Density>& dataSource, const float a, const float trans)
+    {
+        const int W = mCells.width();
+        const float c = trans/(1+4*a);
+        exchangeHalo(1, dataTgt);
+        float residual{};
+        for (int j = interiorBegin(); j < interiorEnd(); ++j) {
+            residual = std::max(residual, diffuseResidualRow(dataTgt, dataSource, mCells.index(), j, 1, W-1, a, c));
+        }
+        return mTransport.allReduceMax(residual);
+    }
+
+    // Simulator2D::sweepRedBlack on this slab; before each colour the halo rows get the other's updates
+    template<bool FIRST_SWEEP>
+    void sweepRedBlack(AoSField<Density>& dataTgt, const AoSField<Density>& dataSource, const float a, const float trans)
+    {
+        const int W = mCells.width(), H = mCells.height();
+        const float c = trans/(1+4*a);
+        for (int colour = 0; colour < 2; ++colour) {
+            if (!FIRST_SWEEP || colour == 1) exchangeHalo(1, dataTgt);
+            for (int j = interiorBegin(); j < interiorEnd(); ++j) {
+                relaxRedBlackRow<FIRST_SWEEP>(dataTgt, dataSource, mCells.index(), W, H, j, 1, W-1, colour, a, c);
+            }
+        }
+    }
+
+    void diffuseVelocities(const float viscosity, StageTimer* pTimer)
+    {
+        const int W = mCells.width(), H = mCells.height();
+        for (int32_t j = mCells.rowBegin(); j < mCells.rowEnd(); ++j) {
+            float* u = mFft.row(0, j);
+            float* v = mFft.row(1, j);
+            for (int32_t i = 0; i < W; ++i) {
+                const XYPair& vel = mCells.velocity[POS(i, j)];
+                u[i] = vel.x;
+                v[i] = vel.y;
+            }
+        }
+
+        // ky is rescaled to cycles per domain width like kx, see projectSpectrum
+        const float kyScale = static_cast<float>(W) / H;
+        mFft.transform(2, [&](const int i, const int j, fftwf_complex* const* c) {
+            const float ky = ((j <= H / 2) ? j : j - H) * kyScale;
+            projectCoefficient(*c[0], *c[1], i, ky, DT, viscosity);
+        }, pTimer);
+
+        const float f = 1.0 / (float)(W * H);
+        for (int32_t j = mCells.rowBegin(); j < mCells.rowEnd(); ++j) {
+            const float* u = mFft.row(0, j);
+            const float* v = mFft.row(1, j);
+            for (int32_t i = 0; i < W; ++i) mCells.velocity[POS(i, j)] = XYPair(u[i], v[i]) * f;
+        }
+    }
+
+    // Simulator2D::diffuseDensitySpectral on the SlabFft
+    void diffuseDensitySpectral(const float diffusion, const float trans, StageTimer* pTimer)
+    {
+        const int W = mCells.width(), H = mCells.height();
+        for (int32_t j = mCells.rowBegin(); j < mCells.rowEnd(); ++j) {
+            for (int32_t i = 0; i < W; ++i) {
+                const Density& d = mCells.density[POS(i, j)];
+                mFft.row(0, j)[i] = d.r;
+                mFft.row(1, j)[i] = d.g;
+                mFft.row(2, j)[i] = d.b;
+            }
+        }
+
+        const float scale = trans / (float)(W * H); // includes the c2r normalisation
+        const float kyScale = static_cast<float>(W) / H;
+        mFft.transform(3, [&](const int i, const int j, fftwf_complex* const* c) {
+            const float ky = ((j <= H / 2) ? j : j - H) * kyScale;
+            const float f = spectralDecay(i, ky, scale, DT, diffusion);
+            for (int ch = 0; ch < 3; ++ch) {
+                (*c[ch])[0] *= f;
+                (*c[ch])[1] *= f;
+            }
+        }, pTimer);
+
+        for (int32_t j = mCells.rowBegin(); j < mCells.rowEnd(); ++j) {
+            for (int32_t i = 0; i < W; ++i) {
+                mCells.density[POS(i, j)] = Density{mFft.row(0, j)[i], mFft.row(1, j)[i], mFft.row(2, j)[i]};
+            }
+        }
+        mFrame.setDensityBoundary(mCells.density);
+    }
+
+    SlabCells& mCells;
+    SlabTransport& mTransport;
+    const float DT;
+    const SimOptions mOptions;
+    SlabFft mFft;
+    ObstacleMask mFrame; // the frame, compiled for the rows of this slab
+    std::vector<SlabMessage> mMessages;
+    int mDiffuseIterations{};
+    int32_t mMaxReach{};
+    int64_t mClippedTraces{};
+    double mExchangeSeconds{};
+};
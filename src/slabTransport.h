@@ -0,0 +1,271 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// One leg of an exchange with a peer: send bytes go to it, recv bytes come from it. Either may be
+// empty. A rank may list several messages for the same peer; their sends are concatenated, and so
+// are the receives, which the peer's sends fill in the order it listed them.
+struct SlabMessage
+{
+    int peer{};
+    const void* send{};
+    size_t sendBytes{};
+    void* recv{};
+    size_t recvBytes{};
+};
+
+// How the ranks of a SlabSimulator2D talk to each other. exchange() is collective between each pair:
+// when a rank lists a peer, the peer lists it in its matching exchange too. Messages to the rank
+// itself are allowed and copied locally. Implementations only need exchange(); the reductions are
+// built on it.
+class SlabTransport
+{
+public:
+    virtual ~SlabTransport() = default;
+
+    virtual int rank() const = 0;
+    virtual int ranks() const = 0;
+
+    // most bytes a rank may send one peer in an exchange
+    virtual size_t capacity() const = 0;
+
+    virtual void exchange(std::span<const SlabMessage> messages) = 0;
+
+    // The reductions gather every rank's value and reduce them in rank order, so all ranks agree bit for bit
+    float allReduceMax(const float value)
+    {
+        float result = value;
+        for (const float v : allGather(value)) result = std::max(result, v);
+        return result;
+    }
+
+    double allReduceSum(const double value)
+    {
+        double sum{};
+        for (const double v : allGather(value)) sum += v;
+        return sum;
+    }
+
+    void barrier() { allGather(0); }
+
+private:
+    template<typename T>
+    std::vector<T> allGather(const T value)
+    {
+        std::vector<T> values(ranks());
+        std::vector<SlabMessage> messages;
+        for (int q = 0; q < ranks(); ++q) {
+            messages.push_back(SlabMessage{q, &value, sizeof(T), &values[q], sizeof(T)});
+        }
+        exchange(messages);
+        return values;
+    }
+};
+
+
+// Ranks as processes forked from the calling one on the same machine. Messages travel through a POSIX
+// shared memory segment holding a mailbox per ordered pair of ranks, and a Unix socket between each
+// pair carries a one byte doorbell per exchange. A rank blocks on the socket until its peer has
+// filled the mailbox, and sees the peer leave as end of file instead of hanging.
+//
+// Each mailbox is double buffered by the parity of the exchanges between the pair: a rank only
+// writes a buffer again two exchanges later, after the peer's next message proved that it has
+// read the previous one.
+class ShmTransport : public SlabTransport
+{
+public:
+    // Forks ranks-1 workers, each of which returns from here with its own rank; the caller becomes
+    // rank 0. Call it before starting any thread. messageBytes is the most one rank sends another in
+    // an exchange.
+    static std::unique_ptr<ShmTransport> launch(const int ranks, const size_t messageBytes)
+    {
+        if (ranks < 1) throw std::invalid_argument("the number of ranks must be positive");
+        std::unique_ptr<ShmTransport> t(new ShmTransport(ranks, messageBytes));
+
+        // sockets[p][q] is p's end of the socket between p and q
+        std::vector<std::vector<int>> sockets(ranks, std::vector<int>(ranks, -1));
+        for (int p = 0; p < ranks; ++p) {
+            for (int q = p + 1; q < ranks; ++q) {
+                int fds[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+                    closeAll(sockets);
+                    throw std::runtime_error(std::string("socketpair failed: ") + strerror(errno));
+                }
+                sockets[p][q] = fds[0];
+                sockets[q][p] = fds[1];
+            }
+        }
+
+        fflush(nullptr); // or buffered output would be printed by every rank
+        for (int r = 1; r < ranks; ++r) {
+            const pid_t pid = fork();
+            if (pid < 0) {
+                const int error = errno;
+                closeAll(sockets); // the workers forked so far see rank 0 leave
+                t->waitWorkers();
+                throw std::runtime_error(std::string("fork failed: ") + strerror(error));
+            }
+            if (pid == 0) {
+                t->mRank = r;
+                t->mWorkers.clear();
+                break;
+            }
+            t->mWorkers.push_back(pid);
+        }
+
+        // keep this rank's ends only
+        for (int p = 0; p < ranks; ++p) {
+            for (int q = 0; q < ranks; ++q) {
+                if (p != t->mRank && sockets[p][q] >= 0) close(sockets[p][q]);
+            }
+        }
+        t->mSockets = sockets[t->mRank];
+        return t;
+    }
+
+    ~ShmTransport() override
+    {
+        waitWorkers();
+        if (mMap != MAP_FAILED) munmap(mMap, mMapBytes);
+    }
+
+    int rank() const override { return mRank; }
+    int ranks() const override { return mRanks; }
+    size_t capacity() const override { return mCapacity; }
+
+    void exchange(const std::span<const SlabMessage> messages) override
+    {
+        // the peers in the order they were first listed
+        mPeers.clear();
+        for (const SlabMessage& m : messages) {
+            if (m.peer < 0 || m.peer >= mRanks) throw std::invalid_argument("no rank " + std::to_string(m.peer));
+            if (std::find(mPeers.begin(), mPeers.end(), m.peer) == mPeers.end()) mPeers.push_back(m.peer);
+        }
+
+        for (const int peer : mPeers) {
+            uint8_t* box = mailbox(mRank, peer);
+            size_t offset{};
+            for (const SlabMessage& m : messages) {
+                if (m.peer != peer || !m.sendBytes) continue;
+                if (offset + m.sendBytes > mCapacity) {
+                    throw std::length_error("message to rank " + std::to_string(peer) + " exceeds the mailbox");
+                }
+                memcpy(box + offset, m.send, m.sendBytes);
+                offset += m.sendBytes;
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            if (peer != mRank) ring(peer);
+        }
+
+        for (const int peer : mPeers) {
+            if (peer != mRank) waitFor(peer);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const uint8_t* box = mailbox(peer, mRank);
+            size_t offset{};
+            for (const SlabMessage& m : messages) {
+                if (m.peer != peer || !m.recvBytes) continue;
+                if (offset + m.recvBytes > mCapacity) {
+                    throw std::length_error("message from rank " + std::to_string(peer) + " exceeds the mailbox");
+                }
+                memcpy(m.recv, box + offset, m.recvBytes);
+                offset += m.recvBytes;
+            }
+            mParity[peer] ^= 1;
+        }
+    }
+
+    // Rank 0: hangs up on the workers, so any still waiting for it give up, and reaps them.
+    // Returns how many exited with an error.
+    int waitWorkers()
+    {
+        for (int& fd : mSockets) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+        int failed{};
+        for (const pid_t pid : mWorkers) {
+            int status{};
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+            failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        }
+        mWorkers.clear();
+        return failed;
+    }
+
+private:
+    ShmTransport(const int ranks, const size_t messageBytes) :
+        mRanks{ranks}, mCapacity{(std::max<size_t>(messageBytes, 64) + 63) / 64 * 64}, mParity(ranks)
+    {
+        // two buffers for every ordered pair, the pairs of a rank with itself included
+        mMapBytes = 2 * mCapacity * ranks * ranks;
+        const std::string name = "/sf_slab_" + std::to_string(getpid());
+        const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) throw std::runtime_error("shm_open " + name + " failed: " + strerror(errno));
+        shm_unlink(name.c_str()); // the mapping outlives the name
+        const bool sized = ftruncate(fd, static_cast<off_t>(mMapBytes)) == 0;
+        if (sized) mMap = mmap(nullptr, mMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        const int error = errno;
+        close(fd);
+        if (!sized || mMap == MAP_FAILED) {
+            throw std::runtime_error("cannot map " + std::to_string(mMapBytes) + " bytes of shared memory: " + strerror(error));
+        }
+    }
+
+    // the buffer of the current exchange between from and to; the pair's parity is the same on both sides
+    uint8_t* mailbox(const int from, const int to) const
+    {
+        const int peer = from == mRank ? to : from;
+        const size_t box = (static_cast<size_t>(from) * mRanks + to) * 2 + mParity[peer];
+        return static_cast<uint8_t*>(mMap) + box * mCapacity;
+    }
+
+    void ring(const int peer)
+    {
+        const uint8_t bell{1};
+        ssize_t n;
+        while ((n = send(mSockets[peer], &bell, 1, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+        if (n != 1) throw std::runtime_error("rank " + std::to_string(peer) + " has left");
+    }
+
+    void waitFor(const int peer)
+    {
+        uint8_t bell;
+        ssize_t n;
+        while ((n = recv(mSockets[peer], &bell, 1, 0)) < 0 && errno == EINTR) {}
+        if (n != 1) throw std::runtime_error("rank " + std::to_string(peer) + " has left");
+    }
+
+    static void closeAll(const std::vector<std::vector<int>>& sockets)
+    {
+        for (const auto& row : sockets) {
+            for (const int fd : row) {
+                if (fd >= 0) close(fd);
+            }
+        }
+    }
+
+    const int mRanks;
+    int mRank{};
+    const size_t mCapacity;
+    size_t mMapBytes{};
+    void* mMap{MAP_FAILED};
+    std::vector<int> mSockets; // to each peer, -1 for this rank
+    std::vector<uint8_t> mParity; // of the exchanges with each peer
+    std::vector<int> mPeers;
+    std::vector<pid_t> mWorkers; // rank 0 only
+};
@@ -0,0 +1,80 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <stdint.h>
+
+
+enum class SimStage : uint8_t
+{
+    AddForce,
+    DiffuseVelocities,
+    VelocityBoundary,
+    AdvectDensity,
+    DiffuseDensity,
+    AdvectVelocity,
+    AdvectFused,
+    FlowStats,
+    Count
+};
+
+inline const char* stageName(const SimStage stage)
+{
+    constexpr const char* names[] = {"force-add", "diffuseVelocities", "setVelocityBoundary",
+                                     "density advect", "diffuse", "velocity advect",
+                                     "fused advect", "flow stats"};
+    return names[static_cast<int>(stage)];
+}
+
+// What Simulator2D::update measures of the flow when asked to
+struct FlowStats
+{
+    float maxSpeed{};      // largest speed after the projection, in domain widths per time unit
+    float divergenceRms{}; // net outflow of the fluid cells after the projection, per time unit
+    float divergenceMax{};
+    double totalDensity{}; // r + g + b summed over the grid at the end of the step
+};
+
+// accumulates wall time per simulator stage; each lap() charges the time since the previous lap
+class StageTimer
+{
+    using Clock = std::chrono::steady_clock;
+public:
+    static constexpr int NUM_STAGES = static_cast<int>(SimStage::Count);
+
+    void start() { mLast = Clock::now(); }
+
+    void lap(const SimStage stage)
+    {
+        const auto now = Clock::now();
+        mNanos[static_cast<int>(stage)] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - mLast).count();
+        mLast = now;
+    }
+
+    // time spent inside FFT execution, a subset of the DiffuseVelocities stage
+    void addFft(const Clock::duration elapsed)
+    {
+        mFftNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    }
+
+    int64_t nanos(const SimStage stage) const { return mNanos[static_cast<int>(stage)]; }
+    double seconds(const SimStage stage) const { return mNanos[static_cast<int>(stage)] * 1e-9; }
+    double fftSeconds() const { return mFftNanos * 1e-9; }
+
+    double totalSeconds() const
+    {
+        int64_t total{};
+        for (auto ns : mNanos) total += ns;
+        return total * 1e-9;
+    }
+
+    void reset()
+    {
+        mNanos.fill(0);
+        mFftNanos = 0;
+    }
+
+private:
+    Clock::time_point mLast{};
+    std::array<int64_t, NUM_STAGES> mNanos{};
+    int64_t mFftNanos{};
+};
@@ -0,0 +1,256 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SF_HAVE_F16C 1
+#endif
+
+
+// How the channels of a field are stored. Every format computes in float: values are widened when
+// read and rounded to nearest even when written. widen() and narrow() convert runs of values, with
+// F16C or AVX2 when the CPU has them; the results equal those of unpack() and pack() one by one.
+// The 8-wide helpers are for AVX2 kernels, which also enable F16C and check hasSimd() first.
+
+// Plain float, the default
+struct Fp32
+{
+    using Storage = float;
+    static constexpr uint32_t ID{0};
+    static constexpr const char* NAME{"fp32"};
+
+    static float unpack(const float f) { return f; }
+    static float pack(const float f) { return f; }
+
+    static void widen(const float* in, float* out, const int32_t n, bool) { memcpy(out, in, n * sizeof(float)); }
+    static void narrow(const float* in, float* out, const int32_t n, bool) { memcpy(out, in, n * sizeof(float)); }
+
+#ifdef SF_HAVE_F16C
+    static bool hasSimd()
+    {
+        static const bool has = __builtin_cpu_supports("avx2");
+        return has;
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static __m256 load8(const float* p) { return _mm256_loadu_ps(p); }
+
+    // 8 values at p[idx * stride]
+    __attribute__((target("avx2,f16c")))
+    static __m256 gather8(const float* p, const int32_t stride, const __m256i idx)
+    {
+        const __m256i off = stride == 1 ? idx : _mm256_mullo_epi32(idx, _mm256_set1_epi32(stride));
+        return _mm256_i32gather_ps(p, off, 4);
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static void store8(float* p, const __m256 v) { _mm256_storeu_ps(p, v); }
+#endif
+};
+
+// IEEE binary16: 11 significant bits, finite up to 65504. Enough for density in [0, 1] and for
+// velocities, not for the summed forces, which stay in float.
+struct Fp16
+{
+    using Storage = uint16_t;
+    static constexpr uint32_t ID{1};
+    static constexpr const char* NAME{"fp16"};
+
+    // exact, subnormals included
+    static float unpack(const uint16_t h)
+    {
+#ifdef __F16C__
+        return _cvtsh_ss(h);
+#else
+        // the exponent is rebased by a float multiply, subnormals are built as 0.5 + m * 2^-24 - 0.5
+        const uint32_t w = static_cast<uint32_t>(h) << 16;
+        const uint32_t twoW = w + w;
+        const float normal = std::bit_cast<float>((twoW >> 4) + (0xE0u << 23)) * 0x1.0p-112f;
+        const float subnormal = std::bit_cast<float>((twoW >> 17) | (126u << 23)) - 0.5f;
+        return std::bit_cast<float>((w & 0x80000000u) |
+                                    (twoW < (1u << 27) ? std::bit_cast<uint32_t>(subnormal) : std::bit_cast<uint32_t>(normal)));
+#endif
+    }
+
+    // round to nearest even, overflow to infinity; NaNs become the quiet NaN 0x7E00
+    static uint16_t pack(const float f)
+    {
+#ifdef __F16C__
+        return std::isnan(f) ? 0x7E00 | (std::bit_cast<uint32_t>(f) >> 16 & 0x8000) : _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+        // scaling by 2^112 * 2^-110 leaves the bits below half precision to the float adder, which
+        // rounds them off when the value is added to a power of two of the right exponent
+        float base = (std::abs(f) * 0x1.0p+112f) * 0x1.0p-110f;
+        const uint32_t w = std::bit_cast<uint32_t>(f);
+        const uint32_t twoW = w + w;
+        const uint32_t bias = std::max(twoW & 0xFF000000u, 0x71000000u);
+        base = std::bit_cast<float>((bias >> 1) + 0x07800000u) + base;
+        const uint32_t bits = std::bit_cast<uint32_t>(base);
+        const uint32_t nonSign = ((bits >> 13) & 0x7C00u) + (bits & 0x0FFFu);
+        return static_cast<uint16_t>((w & 0x80000000u) >> 16 | (twoW > 0xFF000000u ? 0x7E00u : nonSign));
+#endif
+    }
+
+    static void widen(const uint16_t* in, float* out, const int32_t n, const bool simd)
+    {
+        int32_t k = 0;
+#ifdef SF_HAVE_F16C
+        if (simd && hasSimd()) k = widenF16c(in, out, n);
+#endif
+        for (; k < n; ++k) out[k] = unpack(in[k]);
+    }
+
+    static void narrow(const float* in, uint16_t* out, const int32_t n, const bool simd)
+    {
+        int32_t k = 0;
+#ifdef SF_HAVE_F16C
+        if (simd && hasSimd()) k = narrowF16c(in, out, n);
+#endif
+        for (; k < n; ++k) out[k] = pack(in[k]);
+    }
+
+#ifdef SF_HAVE_F16C
+    static bool hasSimd()
+    {
+        static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+        return has;
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static __m256 load8(const uint16_t* p) { return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+
+    // 8 values at p[idx * stride]. Each lane gathers the 32 bits starting at its value, so the field
+    // needs one element of padding after its last value.
+    __attribute__((target("avx2,f16c")))
+    static __m256 gather8(const uint16_t* p, const int32_t stride, const __m256i idx)
+    {
+        const __m256i off = stride == 1 ? idx : _mm256_mullo_epi32(idx, _mm256_set1_epi32(stride));
+        const __m256i words = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(p), off, 2),
+                                               _mm256_set1_epi32(0xFFFF));
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(words, words), 0b1000);
+        return _mm256_cvtph_ps(_mm256_castsi256_si128(packed));
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static void store8(uint16_t* p, const __m256 v)
+    {
+        __m128i h = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+        // F16C keeps NaN payloads, pack() does not
+        const __m256 nan = _mm256_cmp_ps(v, v, _CMP_UNORD_Q);
+        if (!_mm256_testz_ps(nan, nan)) {
+            const __m128i nan16 = _mm_packs_epi32(_mm256_castsi256_si128(_mm256_castps_si256(nan)),
+                                                  _mm256_extracti128_si256(_mm256_castps_si256(nan), 1));
+            const __m128i quiet = _mm_or_si128(_mm_and_si128(h, _mm_set1_epi16(static_cast<short>(0x8000))), _mm_set1_epi16(0x7E00));
+            h = _mm_blendv_epi8(h, quiet, nan16);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), h);
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static int32_t widenF16c(const uint16_t* in, float* out, const int32_t n)
+    {
+        int32_t k = 0;
+        for (; k + 8 <= n; k += 8) _mm256_storeu_ps(out + k, load8(in + k));
+        return k;
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static int32_t narrowF16c(const float* in, uint16_t* out, const int32_t n)
+    {
+        int32_t k = 0;
+        for (; k + 8 <= n; k += 8) store8(out + k, _mm256_loadu_ps(in + k));
+        return k;
+    }
+#endif
+};
+
+// bfloat16, the upper half of a float: the float range with 8 significant bits
+struct Bf16
+{
+    using Storage = uint16_t;
+    static constexpr uint32_t ID{2};
+    static constexpr const char* NAME{"bf16"};
+
+    static float unpack(const uint16_t h) { return std::bit_cast<float>(static_cast<uint32_t>(h) << 16); }
+
+    // round to nearest even; NaNs stay NaN, which rounding could turn into infinity
+    static uint16_t pack(const float f)
+    {
+        const uint32_t w = std::bit_cast<uint32_t>(f);
+        if ((w & 0x7FFFFFFFu) > 0x7F800000u) return static_cast<uint16_t>(w >> 16 | 0x40);
+        return static_cast<uint16_t>((w + 0x7FFFu + (w >> 16 & 1)) >> 16);
+    }
+
+    static void widen(const uint16_t* in, float* out, const int32_t n, const bool simd)
+    {
+        int32_t k = 0;
+#ifdef SF_HAVE_F16C
+        if (simd && hasSimd()) k = widenAvx2(in, out, n);
+#endif
+        for (; k < n; ++k) out[k] = unpack(in[k]);
+    }
+
+    static void narrow(const float* in, uint16_t* out, const int32_t n, const bool simd)
+    {
+        int32_t k = 0;
+#ifdef SF_HAVE_F16C
+        if (simd && hasSimd()) k = narrowAvx2(in, out, n);
+#endif
+        for (; k < n; ++k) out[k] = pack(in[k]);
+    }
+
+#ifdef SF_HAVE_F16C
+    static bool hasSimd()
+    {
+        static const bool has = __builtin_cpu_supports("avx2");
+        return has;
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static __m256 load8(const uint16_t* p)
+    {
+        const __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(w, 16));
+    }
+
+    // 8 values at p[idx * stride], with the same padding as Fp16::gather8
+    __attribute__((target("avx2,f16c")))
+    static __m256 gather8(const uint16_t* p, const int32_t stride, const __m256i idx)
+    {
+        const __m256i off = stride == 1 ? idx : _mm256_mullo_epi32(idx, _mm256_set1_epi32(stride));
+        const __m256i words = _mm256_i32gather_epi32(reinterpret_cast<const int*>(p), off, 2);
+        return _mm256_castsi256_ps(_mm256_slli_epi32(words, 16));
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static void store8(uint16_t* p, const __m256 v)
+    {
+        const __m256i w = _mm256_castps_si256(v);
+        const __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(w, 16), _mm256_set1_epi32(1));
+        __m256i h = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(w, _mm256_set1_epi32(0x7FFF)), lsb), 16);
+        const __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+        h = _mm256_blendv_epi8(h, _mm256_or_si256(_mm256_srli_epi32(w, 16), _mm256_set1_epi32(0x40)), nan);
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(h, h), 0b1000);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(packed));
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static int32_t widenAvx2(const uint16_t* in, float* out, const int32_t n)
+    {
+        int32_t k = 0;
+        for (; k + 8 <= n; k += 8) _mm256_storeu_ps(out + k, load8(in + k));
+        return k;
+    }
+
+    __attribute__((target("avx2,f16c")))
+    static int32_t narrowAvx2(const float* in, uint16_t* out, const int32_t n)
+    {
+        int32_t k = 0;
+        for (; k + 8 <= n; k += 8) store8(out + k, _mm256_loadu_ps(in + k));
+        return k;
+    }
+#endif
+};
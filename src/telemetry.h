@@ -0,0 +1,441 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "stageTimer.h"
+
+
+// Parts of the step and frame loops timed besides the simulator stages
+enum class Probe : uint8_t
+{
+    SceneUpdate,
+    PublishFrame, // density to RGBA8 for the window
+    Step,         // a whole iteration of the simulation loop
+    Draw,         // the draw calls of a frame, without the wait for the swap
+    Count
+};
+
+inline const char* probeName(const Probe probe)
+{
+    constexpr const char* names[] = {"scene update", "publish frame", "step", "draw"};
+    return names[static_cast<int>(probe)];
+}
+
+// Counts of durations in fixed buckets: below 2^MIN_EXP ns, SUB buckets per octave up to
+// 2^MAX_EXP ns (about 1 us to 8.6 s), and an overflow bucket. One thread records into a histogram,
+// any thread may take a snapshot, which is only consistent to within the samples in flight.
+class LatencyHistogram
+{
+public:
+    static constexpr int MIN_EXP{10}, MAX_EXP{33};
+    static constexpr int LOG2_SUB{1}, SUB{1 << LOG2_SUB};
+    static constexpr int BUCKETS{2 + (MAX_EXP - MIN_EXP) * SUB};
+
+    struct Snapshot
+    {
+        std::array<uint64_t, BUCKETS> counts{};
+        uint64_t count{}, sumNanos{}, maxNanos{};
+    };
+
+    static int bucket(const uint64_t nanos)
+    {
+        if (nanos < (1ull << MIN_EXP)) return 0;
+        const int e = std::bit_width(nanos) - 1;
+        if (e >= MAX_EXP) return BUCKETS - 1;
+        return 1 + (e - MIN_EXP) * SUB + static_cast<int>((nanos >> (e - LOG2_SUB)) & (SUB - 1));
+    }
+
+    // exclusive upper end of a bucket in ns, infinite for the overflow bucket
+    static double upperNanos(const int b)
+    {
+        if (b == BUCKETS - 1) return INFINITY;
+        if (b == 0) return static_cast<double>(1ull << MIN_EXP);
+        const int e = MIN_EXP + (b - 1) / SUB;
+        return static_cast<double>(1ull << e) * (1.0 + static_cast<double>((b - 1) % SUB + 1) / SUB);
+    }
+
+    static double lowerNanos(const int b) { return b == 0 ? 0.0 : upperNanos(b - 1); }
+
+    void record(const uint64_t nanos)
+    {
+        auto add = [](std::atomic<uint64_t>& a, const uint64_t v) { a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed); };
+        add(mCounts[bucket(nanos)], 1);
+        add(mCount, 1);
+        add(mSumNanos, nanos);
+        if (nanos > mMaxNanos.load(std::memory_order_relaxed)) mMaxNanos.store(nanos, std::memory_order_relaxed);
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot s;
+        for (int b = 0; b < BUCKETS; ++b) s.counts[b] = mCounts[b].load(std::memory_order_relaxed);
+        s.count = mCount.load(std::memory_order_relaxed);
+        s.sumNanos = mSumNanos.load(std::memory_order_relaxed);
+        s.maxNanos = mMaxNanos.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    // The q-quantile of the samples counted in `counts`, interpolated within its bucket, in ns
+    static double quantile(const std::array<uint64_t, BUCKETS>& counts, const double q)
+    {
+        uint64_t total{};
+        for (const uint64_t c : counts) total += c;
+        if (!total) return 0.0;
+        const double rank = q * total;
+        uint64_t below{};
+        for (int b = 0; b < BUCKETS; ++b) {
+            if (counts[b] && below + counts[b] >= rank) {
+                const double upper = b == BUCKETS - 1 ? 2.0 * lowerNanos(b) : upperNanos(b);
+                return lowerNanos(b) + (upper - lowerNanos(b)) * std::max(0.0, rank - below) / counts[b];
+            }
+            below += counts[b];
+        }
+        return upperNanos(BUCKETS - 2);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> mCounts{};
+    std::atomic<uint64_t> mCount{}, mSumNanos{}, mMaxNanos{};
+};
+
+// Records the time from its construction to its destruction, if given a histogram. steady_clock
+// reads the invariant TSC through the vDSO on x86 Linux, already calibrated to ns.
+class ScopedTimer
+{
+    using Clock = std::chrono::steady_clock;
+public:
+    explicit ScopedTimer(LatencyHistogram* pHistogram) :
+        mpHistogram{pHistogram}, mStart{pHistogram ? Clock::now() : Clock::time_point{}}
+    {}
+
+    ~ScopedTimer()
+    {
+        if (mpHistogram) mpHistogram->record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - mStart).count());
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    LatencyHistogram* const mpHistogram;
+    const Clock::time_point mStart;
+};
+
+struct TelemetryOptions
+{
+    std::string path{};     // rewritten every `seconds`, Prometheus text if it ends in .prom and JSON otherwise
+    double seconds{1.0};
+    bool overlay{false};    // draw the report in the window, see TelemetryOverlay
+
+    bool enabled() const { return !path.empty() || overlay; }
+
+    // Consumes a --telemetry* option at argv[i], returns false if argv[i] is not one
+    bool parseArg(const int argc, char* argv[], int& i)
+    {
+        if (!strcmp(argv[i], "--telemetry") && i+1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "--telemetry-every") && i+1 < argc) {
+            seconds = std::max(0.01, atof(argv[++i]));
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static constexpr const char* USAGE{" [--telemetry FILE] [--telemetry-every SECONDS]"};
+};
+
+// Timing of one stage or probe; count and max cover the whole run, the rest the last period
+struct StageSummary
+{
+    const char* name{};
+    uint64_t count{}, periodCount{};
+    double meanMs{}, p50Ms{}, p99Ms{}, maxMs{};
+};
+
+struct TelemetryReport
+{
+    uint64_t sequence{}; // 0 until the first report
+    double uptime{};     // seconds
+    uint64_t steps{}, frames{};
+    double stepsPerSecond{}, framesPerSecond{}; // over the last period
+    std::vector<StageSummary> stages;           // simulator stages, then the probes
+    FlowStats flow{};
+    uint64_t flowStep{}; // the step flow was measured in, 0 if not yet
+};
+
+// Collects latency histograms of the simulator stages and the probes, and the flow stats, from the
+// simulation and window threads. A thread of its own turns them into a TelemetryReport every
+// period and rewrites the file, if any, by renaming a finished temporary over it so readers never
+// see a partial file. Recording costs a few relaxed atomic stores; the flow stats are asked for
+// once per period.
+class Telemetry
+{
+    using Clock = std::chrono::steady_clock;
+    static constexpr int SIM_STAGES{StageTimer::NUM_STAGES};
+    static constexpr int HISTOGRAMS{SIM_STAGES + static_cast<int>(Probe::Count)};
+
+public:
+    Telemetry(const TelemetryOptions& options, const int32_t gridWidth, const int32_t gridHeight) :
+        mOptions{options}, mGridWidth{gridWidth}, mGridHeight{gridHeight},
+        mPrometheus{options.path.ends_with(".prom")},
+        mStart{Clock::now()}, mLastReport{mStart}
+    {
+        if (!options.path.empty()) {
+            FILE* pFile = fopen(tempPath().c_str(), "w");
+            if (!pFile) {
+                throw std::runtime_error("cannot write telemetry to " + options.path);
+            }
+            fclose(pFile);
+            remove(tempPath().c_str());
+        }
+        mWriter = std::thread([this] { writerLoop(); });
+    }
+
+    ~Telemetry() { finish(); }
+
+    Telemetry(const Telemetry&) = delete;
+    Telemetry& operator=(const Telemetry&) = delete;
+
+    LatencyHistogram& histogram(const Probe probe) { return mHistograms[SIM_STAGES + static_cast<int>(probe)]; }
+
+    // true once per period, for the simulation thread to pass FlowStats to the next update
+    bool wantFlowStats() const { return mWantFlow.load(std::memory_order_relaxed); }
+
+    // Simulation thread, after each step: the stages timed since the last call, and the flow stats
+    // if the step measured them
+    void recordStep(const StageTimer& timer, const FlowStats* pFlow = nullptr)
+    {
+        for (int s = 0; s < SIM_STAGES; ++s) {
+            const int64_t total = timer.nanos(static_cast<SimStage>(s));
+            const int64_t nanos = total >= mStageNanos[s] ? total - mStageNanos[s] : total; // the timer was reset
+            mStageNanos[s] = total;
+            if (nanos > 0) mHistograms[s].record(nanos); // stages that did not run this step are not counted
+        }
+        const uint64_t steps = mSteps.load(std::memory_order_relaxed) + 1;
+        if (pFlow) {
+            std::lock_guard lock(mFlowMutex);
+            mFlow = *pFlow;
+            mFlowStep = steps;
+            mWantFlow.store(false, std::memory_order_relaxed);
+        }
+        mSteps.store(steps, std::memory_order_relaxed);
+    }
+
+    // Window thread, after each frame
+    void countFrame() { mFrames.store(mFrames.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+    uint64_t sequence() const { return mSequence.load(std::memory_order_acquire); }
+
+    TelemetryReport latest() const
+    {
+        std::lock_guard lock(mReportMutex);
+        return mReport;
+    }
+
+    // Publishes the final report and stops the thread
+    void finish()
+    {
+        if (!mWriter.joinable()) return;
+        {
+            std::lock_guard lock(mWriterMutex);
+            mStop = true;
+        }
+        mWake.notify_one();
+        mWriter.join();
+    }
+
+    uint64_t written() const { return mWritten; }
+    uint64_t failed() const { return mFailed; }
+    const std::string& path() const { return mOptions.path; }
+
+private:
+    std::string tempPath() const { return mOptions.path + ".tmp"; }
+
+    void writerLoop()
+    {
+        const auto period = std::chrono::duration<double>(mOptions.seconds);
+        std::unique_lock lock(mWriterMutex);
+        while (!mWake.wait_for(lock, period, [this] { return mStop; })) {
+            publish();
+        }
+        publish(); // the final state
+    }
+
+    void publish()
+    {
+        TelemetryReport report = buildReport();
+        if (!mOptions.path.empty()) {
+            if (write(report)) {
+                ++mWritten;
+            } else if (!mFailed++) {
+                std::cerr << "cannot write telemetry to " << mOptions.path << std::endl;
+            }
+        }
+        {
+            std::lock_guard lock(mReportMutex);
+            mReport = std::move(report);
+        }
+        mSequence.store(mReport.sequence, std::memory_order_release);
+        mWantFlow.store(true, std::memory_order_relaxed);
+    }
+
+    TelemetryReport buildReport()
+    {
+        const auto now = Clock::now();
+        const double periodSecs = std::chrono::duration<double>(now - mLastReport).count();
+        mLastReport = now;
+
+        TelemetryReport r;
+        r.sequence = mReport.sequence + 1; // only this thread writes mReport
+        r.uptime = std::chrono::duration<double>(now - mStart).count();
+        r.steps = mSteps.load(std::memory_order_relaxed);
+        r.frames = mFrames.load(std::memory_order_relaxed);
+        r.stepsPerSecond = (r.steps - mReport.steps) / periodSecs;
+        r.framesPerSecond = (r.frames - mReport.frames) / periodSecs;
+        for (int h = 0; h < HISTOGRAMS; ++h) {
+            const LatencyHistogram::Snapshot s = mHistograms[h].snapshot();
+            LatencyHistogram::Snapshot& prev = mSnapshots[h];
+            std::array<uint64_t, LatencyHistogram::BUCKETS> period{};
+            for (int b = 0; b < LatencyHistogram::BUCKETS; ++b) period[b] = s.counts[b] - prev.counts[b];
+
+            StageSummary& sum = r.stages.emplace_back();
+            sum.name = h < SIM_STAGES ? stageName(static_cast<SimStage>(h)) : probeName(static_cast<Probe>(h - SIM_STAGES));
+            sum.count = s.count;
+            sum.periodCount = s.count - prev.count;
+            sum.meanMs = sum.periodCount ? 1e-6 * (s.sumNanos - prev.sumNanos) / sum.periodCount : 0.0;
+            sum.maxMs = 1e-6 * s.maxNanos;
+            sum.p50Ms = std::min(sum.maxMs, 1e-6 * LatencyHistogram::quantile(period, 0.5));
+            sum.p99Ms = std::min(sum.maxMs, 1e-6 * LatencyHistogram::quantile(period, 0.99));
+            prev = s;
+        }
+        {
+            std::lock_guard lock(mFlowMutex);
+            r.flow = mFlow;
+            r.flowStep = mFlowStep;
+        }
+        return r;
+    }
+
+    bool write(const TelemetryReport& r)
+    {
+        FILE* pFile = fopen(tempPath().c_str(), "w");
+        if (!pFile) return false;
+        if (mPrometheus) {
+            writePrometheus(pFile, r);
+        } else {
+            writeJson(pFile, r);
+        }
+        const bool ok = !ferror(pFile);
+        if (fclose(pFile) || !ok) return false;
+        return !rename(tempPath().c_str(), mOptions.path.c_str());
+    }
+
+    void writeJson(FILE* pFile, const TelemetryReport& r) const
+    {
+        fprintf(pFile, "{\n  \"sequence\": %llu,\n  \"uptime_seconds\": %.3f,\n  \"grid\": [%d, %d],\n",
+                static_cast<unsigned long long>(r.sequence), r.uptime, mGridWidth, mGridHeight);
+        fprintf(pFile, "  \"steps\": %llu,\n  \"steps_per_second\": %.3f,\n  \"frames\": %llu,\n  \"frames_per_second\": %.3f,\n",
+                static_cast<unsigned long long>(r.steps), r.stepsPerSecond, static_cast<unsigned long long>(r.frames), r.framesPerSecond);
+        fprintf(pFile, "  \"flow\": {\"step\": %llu, \"max_speed\": %.6g, \"total_density\": %.9g, "
+                       "\"divergence_rms\": %.6g, \"divergence_max\": %.6g},\n",
+                static_cast<unsigned long long>(r.flowStep), r.flow.maxSpeed, r.flow.totalDensity,
+                r.flow.divergenceRms, r.flow.divergenceMax);
+        // mean and quantiles over the last period, buckets as [upper bound in ms, count] since the start
+        fprintf(pFile, "  \"stages\": {");
+        for (size_t h = 0; h < r.stages.size(); ++h) {
+            const StageSummary& s = r.stages[h];
+            fprintf(pFile, "%s\n    \"%s\": {\"count\": %llu, \"period_count\": %llu, \"mean_ms\": %.4f, \"p50_ms\": %.4f, "
+                           "\"p99_ms\": %.4f, \"max_ms\": %.4f, \"buckets\": [",
+                    h ? "," : "", s.name, static_cast<unsigned long long>(s.count), static_cast<unsigned long long>(s.periodCount),
+                    s.meanMs, s.p50Ms, s.p99Ms, s.maxMs);
+            const LatencyHistogram::Snapshot& snap = mSnapshots[h];
+            bool first{true};
+            for (int b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+                if (!snap.counts[b]) continue;
+                const double upper = LatencyHistogram::upperNanos(b);
+                if (b == LatencyHistogram::BUCKETS - 1) {
+                    fprintf(pFile, "%s[null, %llu]", first ? "" : ", ", static_cast<unsigned long long>(snap.counts[b]));
+                } else {
+                    fprintf(pFile, "%s[%.6g, %llu]", first ? "" : ", ", 1e-6 * upper, static_cast<unsigned long long>(snap.counts[b]));
+                }
+                first = false;
+            }
+            fprintf(pFile, "]}");
+        }
+        fprintf(pFile, "\n  }\n}\n");
+    }
+
+    // cumulative histograms in seconds, for rate() and histogram_quantile()
+    void writePrometheus(FILE* pFile, const TelemetryReport& r) const
+    {
+        fprintf(pFile, "# HELP sf_stage_seconds Wall time per step of each simulator stage, or per call of a probe.\n");
+        fprintf(pFile, "# TYPE sf_stage_seconds histogram\n");
+        for (size_t h = 0; h < r.stages.size(); ++h) {
+            const char* name = r.stages[h].name;
+            const LatencyHistogram::Snapshot& snap = mSnapshots[h];
+            uint64_t cumulative{};
+            for (int b = 0; b < LatencyHistogram::BUCKETS - 1; ++b) {
+                cumulative += snap.counts[b];
+                fprintf(pFile, "sf_stage_seconds_bucket{stage=\"%s\",le=\"%.6g\"} %llu\n", name,
+                        1e-9 * LatencyHistogram::upperNanos(b), static_cast<unsigned long long>(cumulative));
+            }
+            fprintf(pFile, "sf_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", name, static_cast<unsigned long long>(snap.count));
+            fprintf(pFile, "sf_stage_seconds_sum{stage=\"%s\"} %.9g\n", name, 1e-9 * snap.sumNanos);
+            fprintf(pFile, "sf_stage_seconds_count{stage=\"%s\"} %llu\n", name, static_cast<unsigned long long>(snap.count));
+        }
+        auto metric = [pFile](const char* name, const char* type, const char* help, const double value) {
+            fprintf(pFile, "# HELP %s %s\n# TYPE %s %s\n%s %.9g\n", name, help, name, type, name, value);
+        };
+        metric("sf_steps_total", "counter", "Simulation steps run.", r.steps);
+        metric("sf_frames_total", "counter", "Frames drawn.", r.frames);
+        metric("sf_uptime_seconds", "gauge", "Seconds since the telemetry started.", r.uptime);
+        metric("sf_grid_cells", "gauge", "Cells of the grid.", static_cast<double>(mGridWidth) * mGridHeight);
+        metric("sf_flow_max_speed", "gauge", "Largest speed after the projection, domain widths per time unit.", r.flow.maxSpeed);
+        metric("sf_flow_total_density", "gauge", "Density summed over the grid and the r, g and b channels.", r.flow.totalDensity);
+        metric("sf_flow_divergence_rms", "gauge", "RMS divergence of the fluid cells after the projection, per time unit.", r.flow.divergenceRms);
+        metric("sf_flow_divergence_max", "gauge", "Largest divergence of a fluid cell after the projection, per time unit.", r.flow.divergenceMax);
+        metric("sf_flow_step", "gauge", "Step the flow gauges were measured in.", r.flowStep);
+    }
+
+    const TelemetryOptions mOptions;
+    const int32_t mGridWidth, mGridHeight;
+    const bool mPrometheus;
+
+    std::array<LatencyHistogram, HISTOGRAMS> mHistograms;
+    std::array<int64_t, SIM_STAGES> mStageNanos{}; // StageTimer totals at the last recordStep
+    std::atomic<uint64_t> mSteps{}, mFrames{};
+    std::atomic<bool> mWantFlow{true};
+    std::mutex mFlowMutex;
+    FlowStats mFlow{};
+    uint64_t mFlowStep{};
+
+    // the writer thread's
+    const Clock::time_point mStart;
+    Clock::time_point mLastReport;
+    std::array<LatencyHistogram::Snapshot, HISTOGRAMS> mSnapshots{}; // as of the last report
+    std::atomic<uint64_t> mWritten{}, mFailed{};
+
+    mutable std::mutex mReportMutex;
+    TelemetryReport mReport;
+    std::atomic<uint64_t> mSequence{};
+
+    std::mutex mWriterMutex;
+    std::condition_variable mWake;
+    bool mStop{false};
+    std::thread mWriter;
+};
@@ -0,0 +1,100 @@
+#pragma once
+#include <GL/gl.h>
+#include <algorithm>
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "displayConvert.h"
+#include "glyphAtlas.h"
+#include "telemetry.h"
+
+
+// The latest telemetry report as text in the top left corner of the window: steps/s, the flow stats
+// and the mean and p99 time of each stage over the last period. The text is only laid out again
+// when a new report is out, drawing it is one glDrawPixels.
+class TelemetryOverlay
+{
+    static constexpr int FONT_SIZE{13}; // pixels
+    static constexpr int MARGIN{6};
+public:
+    explicit TelemetryOverlay(const Telemetry& telemetry) :
+        mTelemetry(telemetry),
+        mAtlas("/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf", FONT_SIZE,
+               " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~")
+    {}
+
+    // Main thread, in the window's GL context with the pixel coordinates of the window set up
+    void draw(const int winHeight)
+    {
+        const uint64_t sequence = mTelemetry.sequence();
+        if (sequence != mSequence) {
+            mSequence = sequence;
+            compose(mTelemetry.latest());
+        }
+        if (mPixels.empty()) return;
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glPixelZoom(1.0f, -1.0f);
+        glRasterPos2i(MARGIN, winHeight - MARGIN);
+        glDrawPixels(mWidth, mHeight, GL_RGBA, GL_UNSIGNED_BYTE, mPixels.data());
+        glDisable(GL_BLEND);
+    }
+
+private:
+    void compose(const TelemetryReport& r)
+    {
+        std::vector<std::string> lines;
+        char line[128];
+        snprintf(line, sizeof(line), "%.0f steps/s  %.0f fps  step %llu", r.stepsPerSecond, r.framesPerSecond,
+                 static_cast<unsigned long long>(r.steps));
+        lines.emplace_back(line);
+        snprintf(line, sizeof(line), "max |v| %.3g  density %.4g  div rms %.3g max %.3g", r.flow.maxSpeed,
+                 r.flow.totalDensity, r.flow.divergenceRms, r.flow.divergenceMax);
+        lines.emplace_back(line);
+        snprintf(line, sizeof(line), "%-20s %9s %9s", "stage", "mean ms", "p99 ms");
+        lines.emplace_back(line);
+        for (const StageSummary& s : r.stages) {
+            if (!s.periodCount) continue;
+            snprintf(line, sizeof(line), "%-20s %9.3f %9.3f", s.name, s.meanMs, s.p99Ms);
+            lines.emplace_back(line);
+        }
+
+        // monospaced, so every line advances by the same amount per character
+        const int advance = std::max(1, mAtlas['0'].advance);
+        const int lineHeight = FONT_SIZE + FONT_SIZE / 3;
+        size_t chars{};
+        for (const std::string& l : lines) chars = std::max(chars, l.size());
+        mWidth = static_cast<int>(chars) * advance + 2 * MARGIN;
+        mHeight = static_cast<int>(lines.size()) * lineHeight + 2 * MARGIN;
+        mPixels.assign(static_cast<size_t>(mWidth) * mHeight, packRGBA8(0, 0, 0, 160));
+
+        // rows top down, as glDrawPixels is zoomed by -1 vertically
+        for (size_t n = 0; n < lines.size(); ++n) {
+            const int baseline = MARGIN + static_cast<int>(n) * lineHeight + FONT_SIZE;
+            int x = MARGIN;
+            for (const char c : lines[n]) {
+                const GlyphAtlas::Glyph& glyph = mAtlas[c];
+                for (int j = 0; j < glyph.rows; ++j) {
+                    const int y = baseline - glyph.top + j;
+                    if (y < 0 || y >= mHeight) continue;
+                    for (int i = 0; i < glyph.width; ++i) {
+                        const int px = x + glyph.left + i;
+                        const uint8_t a = glyph.pixels[i + static_cast<size_t>(glyph.width) * j];
+                        if (a && px >= 0 && px < mWidth) {
+                            mPixels[px + static_cast<size_t>(mWidth) * y] = packRGBA8(a, a, a, std::max<uint8_t>(160, a));
+                        }
+                    }
+                }
+                x += advance;
+            }
+        }
+    }
+
+    const Telemetry& mTelemetry;
+    const GlyphAtlas mAtlas;
+    uint64_t mSequence{};
+    int mWidth{}, mHeight{};
+    std::vector<uint32_t> mPixels; // RGBA8, rows top down
+};
@@ -0,0 +1,111 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+// Persistent worker pool. parallelFor splits [begin, end) into one contiguous chunk per
+// thread (the caller runs the first chunk) and returns once every chunk is done.
+// The split only depends on the range and the thread count, so results are reproducible.
+// Jobs must not call parallelFor on the same pool.
+class ThreadPool
+{
+    struct Job
+    {
+        int begin{}, end{};
+        void (*fn)(void*, int, int){};
+        void* ctx{};
+    };
+
+public:
+    explicit ThreadPool(const int numThreads) : mNumThreads(std::max(1, numThreads))
+    {
+        for (int t = 1; t < mNumThreads; ++t) {
+            mWorkers.emplace_back([this, t] { workerLoop(t); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard lock(mMutex);
+            mStop = true;
+        }
+        mWake.notify_all();
+        for (auto& w : mWorkers) w.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return mNumThreads; }
+
+    template<typename Fn>
+    void parallelFor(const int begin, const int end, Fn&& fn)
+    {
+        if (mNumThreads == 1 || end - begin < 2) {
+            if (begin < end) fn(begin, end);
+            return;
+        }
+
+        using FnType = std::remove_reference_t<Fn>;
+        const Job job{begin, end, [](void* ctx, int b, int e) { (*static_cast<FnType*>(ctx))(b, e); },
+                      const_cast<void*>(static_cast<const void*>(&fn))};
+        {
+            std::lock_guard lock(mMutex);
+            mJob = job;
+            mPending = mNumThreads - 1;
+            ++mGeneration;
+        }
+        mWake.notify_all();
+
+        runChunk(job, 0);
+
+        std::unique_lock lock(mMutex);
+        mDone.wait(lock, [this] { return mPending == 0; });
+    }
+
+private:
+    void runChunk(const Job& job, const int t) const
+    {
+        const int64_t n = job.end - job.begin;
+        const int b = job.begin + static_cast<int>(n * t / mNumThreads);
+        const int e = job.begin + static_cast<int>(n * (t + 1) / mNumThreads);
+        if (b < e) job.fn(job.ctx, b, e);
+    }
+
+    void workerLoop(const int t)
+    {
+        uint64_t seen{};
+        while (true) {
+            Job job;
+            {
+                std::unique_lock lock(mMutex);
+                mWake.wait(lock, [&] { return mStop || mGeneration != seen; });
+                if (mStop) return;
+                seen = mGeneration;
+                job = mJob;
+            }
+
+            runChunk(job, t);
+
+            std::lock_guard lock(mMutex);
+            if (--mPending == 0) mDone.notify_one();
+        }
+    }
+
+    const int mNumThreads;
+    std::vector<std::thread> mWorkers;
+
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+    Job mJob{};
+    uint64_t mGeneration{};
+    int mPending{};
+    bool mStop{false};
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <stdint.h>
+
+
+// Lock-free hand-over of the latest value from one producer thread to one consumer thread.
+// The producer fills back() and publish()es it, the consumer calls acquire() and reads front().
+// Each side owns one slot and they trade the third, so neither ever waits for the other; values
+// the consumer did not get to are simply overwritten.
+template<typename T>
+class TripleBuffer
+{
+    static constexpr uint8_t INDEX{3};
+    static constexpr uint8_t FRESH{4}; // the middle slot holds a value the consumer has not seen
+public:
+    explicit TripleBuffer(const T& initial = {}) : mSlots{initial, initial, initial} {}
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // producer side
+    T& back() { return mSlots[mBack]; }
+    void publish() { mBack = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel) & INDEX; }
+
+    // consumer side, acquire() returns false if nothing was published since the last call
+    bool acquire()
+    {
+        if (!(mMiddle.load(std::memory_order_relaxed) & FRESH)) return false;
+        mFront = mMiddle.exchange(mFront, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    const T& front() const { return mSlots[mFront]; }
+
+private:
+    std::array<T, 3> mSlots;
+    alignas(64) std::atomic<uint8_t> mMiddle{1};
+    alignas(64) uint8_t mBack{0};
+    alignas(64) uint8_t mFront{2};
+};